@@ -11,12 +11,21 @@
 #define AB_KEY_IMAGE	"image"
 #define AB_KEY_SEC	"sec"
 #define AB_KEY_USEC	"usec"
+/* What the picture looks like (see struct frame_stats), if the daemon worked it out */
+#define AB_KEY_LUMA		"luma"
+#define AB_KEY_CONTRAST		"contrast"
+#define AB_KEY_SHARPNESS	"sharpness"
+#define AB_KEY_BLANK		"blank"
+#define AB_KEY_HISTOGRAM	"histogram"
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
 #include "main.h"
 #include "frame.h"
 
 struct appbase;
+struct reactor;
 
 struct appbase *appbase_open(const char *app_name,
 		const char *username,
@@ -25,13 +34,69 @@ struct appbase *appbase_open(const char *app_name,
 bool appbase_push_frame(struct appbase *ab,
 		const unsigned char *data,
 		size_t length,
-		struct timeval *timestamp);
+		struct timeval *timestamp,
+		const struct frame_stats *stats);
 void appbase_close(struct appbase *);
 
+typedef void (* appbase_upload_cb_t) (bool success, void *userdata);
+bool appbase_attach_reactor(struct appbase *, struct reactor *, unsigned int max_uploads);
+bool appbase_push_frame_async(struct appbase *ab,
+		const unsigned char *data,
+		size_t length,
+		const struct timeval *timestamp,
+		const struct frame_stats *stats,
+		appbase_upload_cb_t cb,
+		void *userdata);
+unsigned int appbase_uploads_in_flight(struct appbase *);
+
 void appbase_enable_progress(struct appbase *appbase, bool enable);
 void appbase_enable_verbose(struct appbase *appbase, bool enable);
+bool appbase_enable_history(struct appbase *appbase, bool enable);
+void appbase_enable_dry_run(struct appbase *appbase, bool enable);
 
-typedef void (* appbase_frame_cb_t) (const char *data, size_t len, void *userdata);
+/* 'timestamp' is when the frame was captured, or NULL if it didn't say */
+typedef void (* appbase_frame_cb_t) (const char *data, size_t len,
+		const struct timeval *timestamp, void *userdata);
 bool appbase_stream_loop(struct appbase *, appbase_frame_cb_t, void *);
+void appbase_stream_stop(struct appbase *);
+
+/*
+ * Many streams from a single event loop, for receivers of lots of cameras.
+ * Frames are not decoded, unless asked to (see appbase_streams_add()).
+ */
+struct appbase_streams;
+struct appbase_streams *appbase_streams_new(struct reactor *);
+bool appbase_streams_add(struct appbase_streams *, struct appbase *, appbase_frame_cb_t, void *);
+void appbase_streams_free(struct appbase_streams *);
+
+size_t appbase_decoded_len(size_t len);
+size_t appbase_decode_image(const char *image, size_t len, unsigned char *out);
+
+/*
+ * A daemon can publish the same camera at several sizes and rates.
+ * Each rendition goes to its own document.
+ */
+#define AB_DEFAULT_RENDITION	"1"
+#define AB_RENDITION_ID_LEN	32
+#define AB_MAX_RENDITIONS	8
+
+struct appbase_rendition {
+	char id[AB_RENDITION_ID_LEN];
+	unsigned int width;
+	unsigned int height;
+	double fps;
+};
+
+bool appbase_set_rendition(struct appbase *, const char *id);
+bool appbase_publish_renditions(struct appbase *, const struct appbase_rendition *, unsigned int count);
+int appbase_get_renditions(struct appbase *, struct appbase_rendition *, unsigned int max);
+
+typedef bool (* appbase_history_cb_t) (char *data, size_t len, const struct timeval *timestamp, void *userdata);
+int appbase_history_query(struct appbase *,
+		const struct timeval *after,
+		time_t until,
+		unsigned int batch,
+		appbase_history_cb_t,
+		void *);
 
 #endif /* APPBASE_H_ */
@@ -0,0 +1,223 @@
+/*
+ * arena.c
+ *
+ * Per-frame bump allocator, see arena.h.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "metrics.h"
+#include "arena.h"
+
+#define ARENA_ALIGN		16
+#define ARENA_MIN_SIZE		4096
+#define ARENA_ROUND(n)		(((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/*
+ * Every allocation is preceded by its size, so that it can be grown
+ * without being told how big it was. Kept a whole alignment unit long,
+ * so that what follows it stays aligned.
+ */
+struct arena_header {
+	size_t size;
+	unsigned char pad[ARENA_ALIGN - sizeof(size_t)];
+};
+
+/* What didn't fit in the block, until the next reset */
+struct arena_overflow {
+	struct arena_overflow *next;
+	unsigned char pad[ARENA_ALIGN - sizeof(void *)];
+	unsigned char data[];
+};
+
+struct arena {
+	unsigned char *block;
+	size_t size;
+	size_t used;
+	struct arena_overflow *overflow;
+	/* Everything asked for since the last reset, whether it fit or not */
+	size_t wanted;
+	/* The most wanted between resets, in this window and in the last one */
+	size_t peak;
+	size_t last_peak;
+	unsigned int resets;
+	/* The last allocation, which can grow in place */
+	void *last;
+};
+
+static bool arena_resize(struct arena *a, size_t size)
+{
+	unsigned char *block = malloc(size);
+
+	if (!block)
+		return false;
+
+	metrics_inc(METRIC_ARENA_ALLOCS);
+	free(a->block);
+	a->block = block;
+	a->size = size;
+	return true;
+}
+
+struct arena *arena_new(size_t size)
+{
+	struct arena *a = ec_malloc(sizeof(struct arena));
+
+	if (size < ARENA_MIN_SIZE)
+		size = ARENA_MIN_SIZE;
+	if (!arena_resize(a, ARENA_ROUND(size))) {
+		free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+static void arena_free_overflow(struct arena *a)
+{
+	struct arena_overflow *o;
+
+	while ((o = a->overflow)) {
+		a->overflow = o->next;
+		free(o);
+	}
+}
+
+void arena_free(struct arena *a)
+{
+	if (a) {
+		arena_free_overflow(a);
+		free(a->block);
+		free(a);
+	}
+}
+
+static bool arena_in_block(const struct arena *a, const void *ptr)
+{
+	return ((const unsigned char *) ptr >= a->block &&
+			(const unsigned char *) ptr < a->block + a->size);
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_header *h;
+	struct arena_overflow *o;
+	size_t total = sizeof(struct arena_header) + ARENA_ROUND(size);
+
+	if (!a || !size)
+		return NULL;
+
+	if (a->used + total <= a->size) {
+		h = (struct arena_header *) (a->block + a->used);
+		a->used += total;
+	} else {
+		o = malloc(sizeof(struct arena_overflow) + total);
+		if (!o)
+			return NULL;
+
+		metrics_inc(METRIC_ARENA_ALLOCS);
+		o->next = a->overflow;
+		a->overflow = o;
+		h = (struct arena_header *) o->data;
+	}
+
+	a->wanted += total;
+	h->size = ARENA_ROUND(size);
+	a->last = h + 1;
+	return a->last;
+}
+
+/*
+ * The last allocation grows in place, if the block has room for it.
+ * Others are copied over to a new one.
+ */
+void *arena_realloc(struct arena *a, void *ptr, size_t size)
+{
+	struct arena_header *h;
+	size_t grow;
+	void *p;
+
+	if (!ptr)
+		return arena_alloc(a, size);
+	if (!a || !size)
+		return NULL;
+
+	h = (struct arena_header *) ptr - 1;
+	if (size <= h->size)
+		return ptr;
+
+	grow = ARENA_ROUND(size) - h->size;
+	if (ptr == a->last && arena_in_block(a, ptr) && a->used + grow <= a->size) {
+		a->used += grow;
+		a->wanted += grow;
+		h->size += grow;
+		return ptr;
+	}
+
+	p = arena_alloc(a, size);
+	if (p)
+		memcpy(p, ptr, h->size);
+	return p;
+}
+
+/*
+ * Only the last allocation is actually given back, so that alloc/free
+ * pairs don't use the arena up.
+ */
+void arena_release(struct arena *a, void *ptr)
+{
+	struct arena_header *h;
+
+	if (!a || !ptr || ptr != a->last || !arena_in_block(a, ptr))
+		return;
+
+	h = (struct arena_header *) ptr - 1;
+	a->used -= sizeof(struct arena_header) + h->size;
+	a->wanted -= sizeof(struct arena_header) + h->size;
+	a->last = NULL;
+}
+
+/*
+ * Release everything at once, and size the block after what was needed lately.
+ */
+void arena_reset(struct arena *a)
+{
+	size_t target;
+
+	if (!a)
+		return;
+
+	arena_free_overflow(a);
+
+	if (a->wanted > a->peak)
+		a->peak = a->wanted;
+
+	/* A quarter more than was needed lately, so that slightly bigger frames still fit */
+	target = (a->peak > a->last_peak ? a->peak : a->last_peak);
+	target = ARENA_ROUND(target + target / 4);
+	if (target < ARENA_MIN_SIZE)
+		target = ARENA_MIN_SIZE;
+
+	if (a->wanted > a->size)
+		arena_resize(a, target);
+
+	if (++a->resets == ARENA_WINDOW) {
+		if (target * 2 < a->size)
+			arena_resize(a, target);
+		a->last_peak = a->peak;
+		a->peak = 0;
+		a->resets = 0;
+	}
+
+	a->used = 0;
+	a->wanted = 0;
+	a->last = NULL;
+}
+
+size_t arena_size(const struct arena *a)
+{
+	return (a ? a->size : 0);
+}
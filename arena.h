@@ -0,0 +1,41 @@
+/*
+ * arena.h
+ *
+ * A bump allocator for things that are built per frame, and then thrown
+ * away all at once: JSON documents on their way out, and the parser state
+ * of those on their way in. Everything allocated from an arena is released
+ * in one step by arena_reset(), and individual frees do nothing.
+ *
+ * The arena is one block, sized after the biggest frames it's seen lately.
+ * Whatever doesn't fit goes to blocks of its own, and the arena grows to fit
+ * it all on the next reset. Then frames of a steady size do no calls to
+ * malloc(3) at all. If frames get much smaller for a while, the block shrinks
+ * back.
+ *
+ * Arenas are not thread-safe. Every user should have its own.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+#include <stddef.h>
+#include "main.h"
+
+/* Resets after which the block may shrink, if nothing in them needed it that big */
+#define ARENA_WINDOW	64
+
+struct arena;
+
+struct arena *arena_new(size_t size);
+void arena_free(struct arena *);
+
+void *arena_alloc(struct arena *, size_t);
+void *arena_realloc(struct arena *, void *, size_t);
+void arena_release(struct arena *, void *);
+void arena_reset(struct arena *);
+
+size_t arena_size(const struct arena *);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,685 @@
+/*
+ * bench.c
+ *
+ * Micro-benchmarks for the hot paths of the daemon and the client,
+ * run over synthetic frames at several resolutions.
+ *
+ * A human-readable table is printed to stderr, and every result is also
+ * written as a single-line JSON object to stdout (or the file given with -o),
+ * so that runs can be compared across commits.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <modp_b64.h>
+#include <linux/videodev2.h>
+#include "main.h"
+#include "utils.h"
+#include "frame.h"
+#include "pool.h"
+#include "uvc.h"
+#include "appbase.h"
+#include "json-streamer.h"
+#include "cb.h"
+#include "denoise.h"
+
+#define BENCH_MIN_TIME_MS	500
+#define BENCH_MIN_ITERATIONS	10
+#define BENCH_WARMUP		3
+#define BENCH_MAX_SIZES		8
+#define BENCH_STREAM_DOCS	32
+#define BENCH_CB_LEN		16
+#define BENCH_CB_ITEMS		200000
+/* libcurl hands us at most this much data per write callback */
+#define BENCH_CHUNK_SIZE	16384
+
+/*
+ * Allocation counting
+ *
+ * We interpose the allocator functions, so that every allocation
+ * made by us, libappbase-common, or any library it uses is accounted.
+ * glibc exports its own implementation as __libc_*, so we just forward there.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static atomic_ulong num_allocs;
+
+void *malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+/*
+ * Benchmark harness
+ */
+struct bench_size {
+	size_t width;
+	size_t height;
+};
+
+struct bench_result {
+	const char *name;
+	const char *variant;
+	size_t width;
+	size_t height;
+	unsigned long iterations;
+	double ns_per_frame;
+	double mb_per_s;
+	double allocs_per_frame;
+	double bytes_out;
+};
+
+/*
+ * A benchmark is made of an optional 'prepare' step, which is not timed,
+ * and a 'run' step, which is. 'run' returns the number of bytes it processed,
+ * which is used to compute the throughput, and can set 'bytes_out' to the size of its output.
+ */
+typedef void (* bench_prepare_t) (void *ctx);
+typedef size_t (* bench_run_t) (void *ctx, size_t *bytes_out);
+
+static FILE *out;
+static const char *label = "";
+static long min_time_ms = BENCH_MIN_TIME_MS;
+
+static long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const struct bench_result *r)
+{
+	fprintf(stderr, "%-14s %-10s %5zux%-5zu %10.0f ns/frame %9.2f MB/s %8.2f allocs/frame",
+			r->name, r->variant, r->width, r->height,
+			r->ns_per_frame, r->mb_per_s, r->allocs_per_frame);
+	if (r->bytes_out)
+		fprintf(stderr, " %9.0f bytes out", r->bytes_out);
+	fprintf(stderr, "\n");
+
+	fprintf(out, "{\"label\":\"%s\",\"bench\":\"%s\",\"variant\":\"%s\","
+			"\"width\":%zu,\"height\":%zu,\"iterations\":%lu,"
+			"\"ns_per_frame\":%.1f,\"mb_per_s\":%.3f,\"allocs_per_frame\":%.3f,"
+			"\"bytes_out\":%.0f}\n",
+			label, r->name, r->variant,
+			r->width, r->height, r->iterations,
+			r->ns_per_frame, r->mb_per_s, r->allocs_per_frame,
+			r->bytes_out);
+	fflush(out);
+}
+
+static void run_bench(const char *name, const char *variant,
+		const struct bench_size *size,
+		bench_prepare_t prepare, bench_run_t run, void *ctx)
+{
+	struct bench_result r;
+	long long start, elapsed = 0, deadline = (long long) min_time_ms * 1000000LL;
+	unsigned long allocs = 0, allocs_before;
+	size_t bytes = 0, bytes_out = 0, total_out = 0;
+
+	for (int i = 0; i < BENCH_WARMUP; i++) {
+		if (prepare)
+			prepare(ctx);
+		run(ctx, &bytes_out);
+	}
+
+	memset(&r, 0, sizeof(r));
+	while (elapsed < deadline || r.iterations < BENCH_MIN_ITERATIONS) {
+		if (prepare)
+			prepare(ctx);
+
+		bytes_out = 0;
+		allocs_before = atomic_load(&num_allocs);
+		start = now_ns();
+
+		bytes += run(ctx, &bytes_out);
+
+		elapsed += now_ns() - start;
+		allocs += atomic_load(&num_allocs) - allocs_before;
+		total_out += bytes_out;
+		r.iterations++;
+	}
+
+	r.name = name;
+	r.variant = variant;
+	r.width = size->width;
+	r.height = size->height;
+	r.ns_per_frame = (double) elapsed / r.iterations;
+	r.mb_per_s = (bytes / 1048576.0) / (elapsed / 1e9);
+	r.allocs_per_frame = (double) allocs / r.iterations;
+	r.bytes_out = (double) total_out / r.iterations;
+
+	report(&r);
+}
+
+/*
+ * Synthetic frames
+ *
+ * A smooth gradient plus some pseudo-random noise, so that the JPEG encoder
+ * has about as much work to do as with a real camera picture.
+ */
+static void fill_yuyv(unsigned char *data, size_t width, size_t height)
+{
+	unsigned int seed = 0x12345678;
+
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x += 2) {
+			unsigned char *p = data + (y * width + x) * 2;
+
+			seed = seed * 1103515245 + 12345;
+			p[0] = (unsigned char) ((x + y) * 255 / (width + height) + ((seed >> 16) & 0x0f));
+			p[1] = (unsigned char) (128 + (int) (x * 64 / width) - 32);
+			p[2] = (unsigned char) ((x + 1 + y) * 255 / (width + height) + ((seed >> 20) & 0x0f));
+			p[3] = (unsigned char) (128 + (int) (y * 64 / height) - 32);
+		}
+	}
+}
+
+struct frame_ctx {
+	struct frame *frame;
+	unsigned char *yuyv;
+	size_t yuyv_len;
+	unsigned char *jpeg;
+	size_t jpeg_len;
+	char *b64;
+	size_t b64_len;
+	unsigned char *scratch;
+	struct appbase *ab;
+	struct frame scaled;
+	enum jpeg_preset preset;
+	struct denoiser *denoise;
+};
+
+static void restore_yuyv(void *ptr)
+{
+	struct frame_ctx *ctx = ptr;
+
+	memcpy(ctx->frame->frame_data, ctx->yuyv, ctx->yuyv_len);
+	ctx->frame->frame_bytes_used = ctx->yuyv_len;
+}
+
+static size_t bench_jpeg(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+
+	frame_convert_yuyv_to_jpeg(ctx->frame);
+	*bytes_out = ctx->frame->frame_bytes_used;
+
+	return ctx->yuyv_len;
+}
+
+static size_t bench_jpeg_gray(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+	struct jpeg_params params = {
+		.quality = JPEG_DEFAULT_QUALITY,
+		.grayscale = true
+	};
+
+	frame_convert_yuyv_to_jpeg_ext(ctx->frame, &params);
+	*bytes_out = ctx->frame->frame_bytes_used;
+
+	return ctx->yuyv_len;
+}
+
+static size_t bench_jpeg_preset(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+	struct jpeg_params params = {
+		.quality = JPEG_DEFAULT_QUALITY,
+		.preset = ctx->preset
+	};
+
+	frame_convert_yuyv_to_jpeg_ext(ctx->frame, &params);
+	*bytes_out = ctx->frame->frame_bytes_used;
+
+	return ctx->yuyv_len;
+}
+
+static size_t bench_denoise(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+
+	if (!denoiser_apply(ctx->denoise, ctx->frame))
+		fprintf(stderr, "WARNING: denoiser_apply() failed\n");
+
+	return ctx->yuyv_len;
+}
+
+static void restore_yuv420(void *ptr)
+{
+	struct frame_ctx *ctx = ptr;
+
+	restore_yuyv(ctx);
+	ctx->scaled.width = ctx->frame->width;
+	ctx->scaled.height = ctx->frame->height;
+	ctx->scaled.format = V4L2_PIX_FMT_YUV420;
+	frame_scale(ctx->frame, &ctx->scaled);
+}
+
+static size_t bench_jpeg_yuv420(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+
+	frame_convert_yuyv_to_jpeg(&ctx->scaled);
+	*bytes_out = ctx->scaled.frame_bytes_used;
+
+	return ctx->yuyv_len;
+}
+
+static size_t bench_scale(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+
+	if (!frame_scale(ctx->frame, &ctx->scaled))
+		fprintf(stderr, "WARNING: frame_scale() failed\n");
+	*bytes_out = ctx->scaled.frame_bytes_used;
+
+	return ctx->yuyv_len;
+}
+
+static void run_scale_bench(struct frame_ctx *ctx, const struct bench_size *size,
+		const char *variant, size_t num, size_t den, int format)
+{
+	ctx->scaled.width = (size->width * num / den) & ~1;
+	ctx->scaled.height = (size->height * num / den) & ~1;
+	ctx->scaled.format = format;
+
+	if (ctx->scaled.width && ctx->scaled.height)
+		run_bench("scale", variant, size, NULL, bench_scale, ctx);
+}
+
+static size_t bench_b64_encode(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+
+	*bytes_out = modp_b64_encode((char *) ctx->scratch, (const char *) ctx->jpeg, ctx->jpeg_len);
+	return ctx->jpeg_len;
+}
+
+static size_t bench_b64_decode(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+
+	*bytes_out = modp_b64_decode((char *) ctx->scratch, ctx->b64, ctx->b64_len);
+	return ctx->b64_len;
+}
+
+static size_t bench_push_frame(void *ptr, size_t *bytes_out)
+{
+	struct frame_ctx *ctx = ptr;
+	struct timeval tv = { .tv_sec = 1466700000, .tv_usec = 123456 };
+
+	if (!appbase_push_frame(ctx->ab, ctx->jpeg, ctx->jpeg_len, &tv, NULL))
+		fprintf(stderr, "WARNING: appbase_push_frame() failed\n");
+
+	return ctx->jpeg_len;
+}
+
+/*
+ * json_streamer benchmark
+ *
+ * The stream is fed the same way libcurl would do it: in chunks of at most
+ * BENCH_CHUNK_SIZE bytes. Each recorded document starts a new chunk, since
+ * that's what we get from the server, which sends documents one at a time.
+ */
+struct stream_ctx {
+	struct json_streamer *json;
+	char *stream;
+	size_t stream_len;
+	size_t *doc_offsets;
+	size_t num_docs;
+	unsigned long frames;
+	unsigned long errors;
+};
+
+static void stream_frame_cb(const char *data, size_t len,
+		const struct timeval *timestamp, void *userdata)
+{
+	struct stream_ctx *ctx = userdata;
+
+	if (data && len)
+		ctx->frames++;
+}
+
+static size_t bench_stream(void *ptr, size_t *bytes_out)
+{
+	struct stream_ctx *ctx = ptr;
+	size_t offset, end, chunk;
+
+	for (size_t i = 0; i < ctx->num_docs; i++) {
+		offset = ctx->doc_offsets[i];
+		end = (i + 1 < ctx->num_docs ? ctx->doc_offsets[i + 1] : ctx->stream_len);
+
+		while (offset < end) {
+			chunk = end - offset;
+			if (chunk > BENCH_CHUNK_SIZE)
+				chunk = BENCH_CHUNK_SIZE;
+
+			if (!json_streamer_push(ctx->json, (const unsigned char *) ctx->stream + offset, chunk))
+				ctx->errors++;
+			offset += chunk;
+		}
+	}
+
+	return ctx->stream_len;
+}
+
+static void build_stream(struct stream_ctx *ctx, const char *b64)
+{
+	size_t len = 0, max = 0, doc_len;
+	char *doc;
+
+	ctx->num_docs = BENCH_STREAM_DOCS;
+	ctx->doc_offsets = ec_malloc(ctx->num_docs * sizeof(size_t));
+
+	for (size_t i = 0; i < ctx->num_docs; i++) {
+		doc_len = asprintf(&doc,
+				"{\"_type\":\"pic\",\"_id\":\"1\",\"_source\":{\"" AB_KEY_IMAGE "\":\"%s\","
+				"\"" AB_KEY_SEC "\":%zu,\"" AB_KEY_USEC "\":%zu}}\n",
+				b64, 1466700000 + i, i * 1000);
+
+		if (len + doc_len > max) {
+			max = (len + doc_len) * 2;
+			ctx->stream = ec_realloc(ctx->stream, max);
+		}
+
+		ctx->doc_offsets[i] = len;
+		memcpy(ctx->stream + len, doc, doc_len);
+		len += doc_len;
+		free(doc);
+	}
+
+	ctx->stream_len = len;
+}
+
+/*
+ * A recorded stream (eg. dumped with 'curl -N') is fed in plain
+ * BENCH_CHUNK_SIZE-byte chunks, with no knowledge of document boundaries.
+ */
+static bool load_stream(struct stream_ctx *ctx, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	long len;
+
+	if (!f)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (len <= 0) {
+		fclose(f);
+		return false;
+	}
+
+	ctx->stream = ec_malloc(len);
+	ctx->stream_len = fread(ctx->stream, 1, len, f);
+	fclose(f);
+
+	ctx->num_docs = 1;
+	ctx->doc_offsets = ec_malloc(sizeof(size_t));
+
+	return true;
+}
+
+/*
+ * cb benchmark
+ *
+ * One thread appends, another one takes them out, just like
+ * the client does with the streaming thread and the main thread.
+ * Every item stands for a whole frame of the given size, handed over by reference.
+ */
+struct cb_ctx {
+	struct cb *cb;
+	unsigned long items;
+	size_t frame_len;
+};
+
+static void *cb_producer(void *ptr)
+{
+	struct cb_ctx *ctx = ptr;
+
+	for (unsigned long i = 0; i < ctx->items; i++)
+		cb_append_wait(ctx->cb, (const char *) ctx, ctx->frame_len);
+
+	return NULL;
+}
+
+static void run_cb_bench(const struct bench_size *size)
+{
+	struct bench_result r;
+	struct cb_ctx ctx;
+	pthread_t thread;
+	const char *data;
+	size_t len;
+	unsigned long received = 0, allocs;
+	long long start, elapsed;
+
+	ctx.cb = cb_start(BENCH_CB_LEN);
+	ctx.items = BENCH_CB_ITEMS;
+	ctx.frame_len = size->width * size->height * 2;
+
+	allocs = atomic_load(&num_allocs);
+	start = now_ns();
+
+	pthread_create(&thread, NULL, cb_producer, &ctx);
+	while (received < ctx.items) {
+		if (cb_try_next(ctx.cb, &data, &len))
+			received++;
+	}
+	pthread_join(thread, NULL);
+
+	elapsed = now_ns() - start;
+	allocs = atomic_load(&num_allocs) - allocs;
+	cb_destroy(ctx.cb);
+
+	memset(&r, 0, sizeof(r));
+	r.name = "cb";
+	r.variant = "spsc";
+	r.width = size->width;
+	r.height = size->height;
+	r.iterations = ctx.items;
+	r.ns_per_frame = (double) elapsed / ctx.items;
+	r.mb_per_s = ((double) ctx.frame_len * ctx.items / 1048576.0) / (elapsed / 1e9);
+	/* Thread creation accounts for a few allocations, which we don't want to spread */
+	r.allocs_per_frame = (double) allocs / ctx.items;
+
+	report(&r);
+}
+
+static void run_size(const struct bench_size *size, const char *recorded)
+{
+	struct frame_ctx ctx;
+	struct stream_ctx sctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	ctx.frame = uvc_alloc_frame(size->width, size->height, V4L2_PIX_FMT_YUYV);
+	if (!ctx.frame)
+		fatal("Could not allocate frame");
+
+	ctx.yuyv_len = ctx.frame->frame_size;
+	ctx.yuyv = ec_malloc(ctx.yuyv_len);
+	fill_yuyv(ctx.yuyv, size->width, size->height);
+
+	/* Downscaling */
+	restore_yuyv(&ctx);
+	run_scale_bench(&ctx, size, "1/2", 1, 2, V4L2_PIX_FMT_YUYV);
+	run_scale_bench(&ctx, size, "1/4", 1, 4, V4L2_PIX_FMT_YUYV);
+	run_scale_bench(&ctx, size, "2/3", 2, 3, V4L2_PIX_FMT_YUYV);
+	run_scale_bench(&ctx, size, "1/2-yuv420", 1, 2, V4L2_PIX_FMT_YUV420);
+
+	/* Noise reduction. The first frame only sets the reference, but that's in the warmup */
+	ctx.denoise = denoiser_new(6);
+	run_bench("denoise", "yuyv", size, restore_yuyv, bench_denoise, &ctx);
+	denoiser_free(ctx.denoise);
+
+	/* JPEG */
+	run_bench("jpeg", "yuv420", size, restore_yuv420, bench_jpeg_yuv420, &ctx);
+	run_bench("jpeg", "gray", size, restore_yuyv, bench_jpeg_gray, &ctx);
+	/* Encoding time against size, for every encoder preset */
+	for (ctx.preset = 0; ctx.preset < JPEG_PRESET_COUNT; ctx.preset++)
+		run_bench("jpeg_preset", frame_jpeg_preset_name(ctx.preset), size,
+				restore_yuyv, bench_jpeg_preset, &ctx);
+	run_bench("jpeg", "default", size, restore_yuyv, bench_jpeg, &ctx);
+
+	/* Keep the last JPEG around for the next benchmarks */
+	ctx.jpeg_len = ctx.frame->frame_bytes_used;
+	ctx.jpeg = ec_malloc_fill(ctx.jpeg_len, (const char *) ctx.frame->frame_data);
+
+	/* Base64 */
+	ctx.b64_len = modp_b64_encode_len(ctx.jpeg_len);
+	ctx.b64 = ec_malloc(ctx.b64_len);
+	ctx.b64_len = modp_b64_encode(ctx.b64, (const char *) ctx.jpeg, ctx.jpeg_len);
+	ctx.scratch = ec_malloc(ctx.b64_len + 4);
+
+	run_bench("b64_encode", "jpeg", size, NULL, bench_b64_encode, &ctx);
+	run_bench("b64_decode", "jpeg", size, NULL, bench_b64_decode, &ctx);
+
+	/* Upload path, up until the point it hits the network */
+	ctx.ab = appbase_open("bench", "user", "password", false);
+	if (!ctx.ab)
+		fatal("Could not create Appbase handle");
+	appbase_enable_dry_run(ctx.ab, true);
+
+	run_bench("push_frame", "live", size, NULL, bench_push_frame, &ctx);
+	appbase_enable_history(ctx.ab, true);
+	run_bench("push_frame", "history", size, NULL, bench_push_frame, &ctx);
+	appbase_close(ctx.ab);
+
+	/* Stream parser */
+	memset(&sctx, 0, sizeof(sctx));
+	if (recorded) {
+		if (!load_stream(&sctx, recorded))
+			fatal("Could not read recorded stream");
+	} else {
+		build_stream(&sctx, ctx.b64);
+	}
+
+	sctx.json = json_streamer_init(stream_frame_cb, &sctx);
+	run_bench("json_streamer", (recorded ? "recorded" : "synthetic"), size, NULL, bench_stream, &sctx);
+	if (sctx.errors)
+		fprintf(stderr, "WARNING: json_streamer reported %lu errors\n", sctx.errors);
+	json_streamer_destroy(sctx.json);
+
+	/* Circular buffer hand-off */
+	run_cb_bench(size);
+
+	free(sctx.stream);
+	free(sctx.doc_offsets);
+	free(ctx.scratch);
+	free(ctx.b64);
+	free(ctx.jpeg);
+	free(ctx.yuyv);
+	pool_unref(ctx.scaled.frame_data);
+	uvc_free_frame(ctx.frame);
+}
+
+static void print_usage_and_exit(const char *name)
+{
+	if (name) {
+		printf("Usage: %s [OPTIONS]\n"
+				"Options:\n"
+				"    -s WxH         Benchmark this resolution (can be given several times)\n"
+				"    -t msecs       Minimum time to run each benchmark for (default: %d)\n"
+				"    -r file        Feed the stream parser with this recorded stream\n"
+				"    -o file        Write machine-readable results here instead of stdout\n"
+				"    -l label       Tag results with this label (eg. a commit hash)\n",
+				name, BENCH_MIN_TIME_MS);
+	}
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	char *endptr;
+	const char *recorded = NULL, *outfile = NULL;
+	struct bench_size sizes[BENCH_MAX_SIZES] = {
+			{ 320, 240 },
+			{ 640, 480 },
+			{ 1280, 720 },
+			{ 1920, 1080 }
+	};
+	int num_sizes = 4, user_sizes = 0;
+
+	while ((opt = getopt(argc, argv, "s:t:r:o:l:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (user_sizes == BENCH_MAX_SIZES)
+				print_usage_and_exit(argv[0]);
+			sizes[user_sizes].width = strtoul(optarg, &endptr, 10);
+			if (*endptr != 'x')
+				print_usage_and_exit(argv[0]);
+			sizes[user_sizes].height = strtoul(endptr + 1, &endptr, 10);
+			if (*endptr || !sizes[user_sizes].width || !sizes[user_sizes].height ||
+					sizes[user_sizes].width % 2)
+				print_usage_and_exit(argv[0]);
+			num_sizes = ++user_sizes;
+			break;
+		case 't':
+			min_time_ms = strtol(optarg, &endptr, 10);
+			if (*endptr || min_time_ms <= 0)
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'r':
+			recorded = optarg;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		default:
+			print_usage_and_exit(argv[0]);
+			break;
+		}
+	}
+
+	out = stdout;
+	if (outfile) {
+		out = fopen(outfile, "w");
+		if (!out)
+			fatal("Could not open output file");
+	}
+
+	for (int i = 0; i < num_sizes; i++)
+		run_size(&sizes[i], recorded);
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
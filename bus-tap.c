@@ -0,0 +1,133 @@
+/*
+ * bus-tap.c
+ *
+ * Reads frames off the daemon's frame bus (see framebus.h), and prints
+ * what it gets. It's also an example of a local consumer: frames are
+ * used right from the shared memory, without copying them.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include "main.h"
+#include "framebus.h"
+
+#define TAP_TIMEOUT_MS	1000
+
+static volatile sig_atomic_t stop = 0;
+
+static void sighandler(int s)
+{
+	stop = 1;
+}
+
+static void print_usage(const char *name)
+{
+	printf("Usage: %s [OPTIONS] <socket>\n"
+			"Options:\n"
+			"    -s stream      Only take frames from this stream (0: as captured, 1: main rendition, ...)\n"
+			"    -o file        Keep the last frame taken in this file\n"
+			"    -q             Do not print every frame, just a summary on exit\n",
+			name);
+}
+
+static double age_ms(const struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000.0 + (now.tv_usec - tv->tv_usec) / 1000.0;
+}
+
+static bool write_frame(const char *path, const struct framebus_frame *frame)
+{
+	FILE *fp = fopen(path, "w");
+	bool ok;
+
+	if (!fp)
+		return false;
+
+	ok = (fwrite(frame->data, frame->len, 1, fp) == 1);
+	fclose(fp);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	struct framebus *bus;
+	struct framebus_frame frame;
+	struct sigaction sig;
+	const char *output = NULL;
+	char *endptr;
+	long stream = -1;
+	bool quiet = false;
+	unsigned long frames = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:o:q")) != -1) {
+		switch (opt) {
+		case 's':
+			stream = strtol(optarg, &endptr, 10);
+			if (*endptr || stream < 0)
+				goto exit_help;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			goto exit_help;
+		}
+	}
+
+	if (argc - optind < 1)
+		goto exit_help;
+
+	/* No SA_RESTART, so that we're woken up while waiting for frames */
+	memset(&sig, 0, sizeof(sig));
+	sig.sa_handler = sighandler;
+	sigemptyset(&sig.sa_mask);
+	sigaction(SIGINT, &sig, NULL);
+	sigaction(SIGTERM, &sig, NULL);
+
+	bus = framebus_connect(argv[optind]);
+	if (!bus) {
+		fprintf(stderr, "ERROR: Could not connect to the frame bus at '%s'\n", argv[optind]);
+		return 1;
+	}
+
+	while (!stop) {
+		if (!framebus_next(bus, &frame, TAP_TIMEOUT_MS))
+			continue;
+		if (stream >= 0 && frame.stream != stream)
+			continue;
+
+		if (output && !write_frame(output, &frame))
+			fprintf(stderr, "ERROR: Could not write frame to '%s'\n", output);
+
+		/* If it was overwritten under our feet, what we wrote is garbage (and it counts as lost) */
+		if (!framebus_release(bus, &frame))
+			continue;
+
+		frames++;
+		if (!quiet)
+			printf("FRAME seq=%llu stream=%u format=%.4s size=%ux%u bytes=%zu age_ms=%.1f\n",
+					(unsigned long long) frame.seq, frame.stream, (const char *) &frame.format,
+					frame.width, frame.height, frame.len, age_ms(&frame.capture_time));
+	}
+
+	printf("SUMMARY frames=%lu lost=%llu\n", frames, (unsigned long long) framebus_lost(bus));
+	framebus_close(bus);
+	return 0;
+
+exit_help:
+	print_usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,202 @@
+/*
+ * capture.c
+ *
+ * Capture thread, see capture.h.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "utils.h"
+#include "pool.h"
+#include "metrics.h"
+#include "capture.h"
+
+struct capture_thread {
+	struct camera *c;
+	pthread_t thread;
+	atomic_bool stop;
+	/* Readable when there's a frame to take, or capture failed */
+	int fd;
+	pthread_mutex_t lock;
+	/* While 'full', the slot holds a reference to its frame buffer */
+	struct capture_frame slot;
+	bool full;
+	bool failed;
+	/* Since the last call to capture_thread_get_stats() */
+	unsigned int frames;
+	unsigned int drops;
+	unsigned int taken;
+	uint64_t handoff_sum;
+	uint64_t handoff_max;
+};
+
+static void *capture_run(void *ptr)
+{
+	struct capture_thread *ct = ptr;
+	struct frame *f = ct->c->frame;
+	uint64_t start, captured, one = 1;
+	bool ok = true;
+
+	while (ok && !atomic_load(&ct->stop)) {
+		/* The buffer we captured into last is still in the slot, or in the event loop */
+		start = metrics_now();
+		ok = uvc_capture_frame(ct->c);
+		captured = metrics_now();
+
+		pthread_mutex_lock(&ct->lock);
+		if (ok) {
+			if (ct->full) {
+				pool_unref(ct->slot.frame.frame_data);
+				ct->drops++;
+			}
+
+			ct->slot.frame = *f;
+			ct->slot.frame.frame_data = pool_ref(f->frame_data);
+			ct->slot.start = start;
+			ct->slot.captured = captured;
+			ct->full = true;
+			ct->frames++;
+		} else {
+			ct->failed = true;
+		}
+		pthread_mutex_unlock(&ct->lock);
+
+		if (write(ct->fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			fprintf(stderr, "ERROR: Could not hand a frame over\n");
+	}
+
+	return NULL;
+}
+
+/*
+ * Start capturing from 'c' (already initialized) into its frame.
+ * Returns NULL if the thread could not be started, eg. when asking for
+ * a real-time policy without the privileges for it.
+ */
+struct capture_thread *capture_thread_start(struct camera *c, const struct capture_config *cfg)
+{
+	struct capture_thread *ct;
+	struct sched_param param;
+	pthread_attr_t attr;
+	int err;
+
+	if (!c || !c->frame || !cfg)
+		return NULL;
+
+	ct = ec_malloc(sizeof(struct capture_thread));
+	ct->c = c;
+	atomic_init(&ct->stop, false);
+	pthread_mutex_init(&ct->lock, NULL);
+	ct->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ct->fd == -1)
+		goto fail;
+
+	pthread_attr_init(&attr);
+	if (cfg->policy != SCHED_OTHER) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = cfg->priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, cfg->policy);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (CPU_COUNT(&cfg->cpus))
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cfg->cpus);
+
+	err = pthread_create(&ct->thread, &attr, capture_run, ct);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		fprintf(stderr, "ERROR: Could not start the capture thread: %s\n", strerror(err));
+		goto fail;
+	}
+
+	return ct;
+
+fail:
+	if (ct->fd != -1)
+		close(ct->fd);
+	pthread_mutex_destroy(&ct->lock);
+	free(ct);
+	return NULL;
+}
+
+/*
+ * Might take up to a frame (or UVC_CAPTURE_TIMEOUT_MS, if the camera is stuck).
+ */
+void capture_thread_stop(struct capture_thread *ct)
+{
+	if (!ct)
+		return;
+
+	atomic_store(&ct->stop, true);
+	pthread_join(ct->thread, NULL);
+
+	if (ct->full)
+		pool_unref(ct->slot.frame.frame_data);
+	close(ct->fd);
+	pthread_mutex_destroy(&ct->lock);
+	free(ct);
+}
+
+int capture_thread_get_fd(struct capture_thread *ct)
+{
+	return (ct ? ct->fd : -1);
+}
+
+/*
+ * Take the frame waiting in the slot, if any. Returns 1 if there was one,
+ * which is then the caller's to pool_unref(), 0 if there wasn't, and -1 if
+ * capture failed.
+ */
+int capture_thread_take(struct capture_thread *ct, struct capture_frame *out)
+{
+	uint64_t count, handoff;
+	int retval = 0;
+
+	if (!ct || !out)
+		return -1;
+
+	if (read(ct->fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		return -1;
+
+	pthread_mutex_lock(&ct->lock);
+	if (ct->full) {
+		*out = ct->slot;
+		ct->full = false;
+
+		handoff = metrics_now() - out->captured;
+		ct->handoff_sum += handoff;
+		if (handoff > ct->handoff_max)
+			ct->handoff_max = handoff;
+		ct->taken++;
+		retval = 1;
+	} else if (ct->failed) {
+		retval = -1;
+	}
+	pthread_mutex_unlock(&ct->lock);
+
+	return retval;
+}
+
+void capture_thread_get_stats(struct capture_thread *ct, struct capture_thread_stats *stats)
+{
+	if (!ct || !stats)
+		return;
+
+	pthread_mutex_lock(&ct->lock);
+	stats->frames = ct->frames;
+	stats->drops = ct->drops;
+	stats->handoff_avg = (ct->taken ? ct->handoff_sum / 1e6 / ct->taken : 0);
+	stats->handoff_max = ct->handoff_max / 1e6;
+
+	ct->frames = ct->drops = ct->taken = 0;
+	ct->handoff_sum = ct->handoff_max = 0;
+	pthread_mutex_unlock(&ct->lock);
+}
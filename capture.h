@@ -0,0 +1,58 @@
+/*
+ * capture.h
+ *
+ * Capture on a thread of its own, away from encoding and uploading, so that
+ * it can be given a real-time priority and CPUs of its own. Then a busy box
+ * doesn't keep it from draining the camera in time.
+ *
+ * Frames are handed over to the event loop through a single slot: if the loop
+ * hasn't taken the last one when the next is captured, the last one is dropped,
+ * so the loop always gets the freshest frame. Only a reference to the frame
+ * buffer changes hands; it's never copied.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+#include <stdint.h>
+#include <sched.h>
+#include "main.h"
+#include "frame.h"
+#include "uvc.h"
+
+struct capture_config {
+	/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int policy;
+	int priority;
+	/* CPUs to run on. All of them, if empty */
+	cpu_set_t cpus;
+};
+
+/* A frame handed over, with when its capture began and ended (ns, CLOCK_MONOTONIC) */
+struct capture_frame {
+	struct frame frame;
+	uint64_t start;
+	uint64_t captured;
+};
+
+struct capture_thread_stats {
+	unsigned int frames;
+	/* Frames the event loop never took, because a newer one came first */
+	unsigned int drops;
+	/* How long frames waited for the event loop to take them, in ms */
+	double handoff_avg;
+	double handoff_max;
+};
+
+struct capture_thread;
+
+struct capture_thread *capture_thread_start(struct camera *, const struct capture_config *);
+void capture_thread_stop(struct capture_thread *);
+
+int capture_thread_get_fd(struct capture_thread *);
+int capture_thread_take(struct capture_thread *, struct capture_frame *);
+void capture_thread_get_stats(struct capture_thread *, struct capture_thread_stats *);
+
+#endif /* CAPTURE_H_ */
@@ -22,6 +22,7 @@ struct cb {
 	uint8_t write;
 	uint8_t buflen;
 	sem_t sem;
+	sem_t free_slots;
 	struct bucket *buf;
 };
 
@@ -49,26 +50,66 @@ bool cb_try_next(struct cb *cb, const char **data, size_t *len)
 		cb->buf[idx].len = 0;
 
 		cb->read++;
+		sem_post(&cb->free_slots);
 		retval = true;
 	}
 
 	return retval;
 }
 
-void cb_append(struct cb *cb, const char *data, size_t len)
+static void cb_put(struct cb *cb, const char *data, size_t len)
 {
-	int idx;
-
-	if (!cb)
-		return;
-
-	idx = cb->write % cb->buflen;
+	int idx = cb->write % cb->buflen;
 
 	cb->buf[idx].data = (char *) data;
 	cb->buf[idx].len = len;
+	cb->write++;
+
 	sem_post(&cb->sem);
+}
 
-	cb->write++;
+/*
+ * Append a new bucket, if there's room for it.
+ * If the reader is lagging behind and the buffer is full, the bucket
+ * is not appended and false is returned. The caller still owns 'data' then.
+ */
+bool cb_append(struct cb *cb, const char *data, size_t len)
+{
+	if (!cb || sem_trywait(&cb->free_slots) != 0)
+		return false;
+
+	cb_put(cb, data, len);
+	return true;
+}
+
+/*
+ * Same as cb_append(), but if the buffer is full, block
+ * until the reader frees up a slot.
+ */
+bool cb_append_wait(struct cb *cb, const char *data, size_t len)
+{
+	if (!cb)
+		return false;
+
+	while (sem_wait(&cb->free_slots) != 0) {
+		/* Interrupted by a signal handler. Try again. */
+	}
+
+	cb_put(cb, data, len);
+	return true;
+}
+
+/*
+ * Number of buckets waiting to be read.
+ */
+unsigned int cb_count(struct cb *cb)
+{
+	int val = 0;
+
+	if (cb)
+		sem_getvalue(&cb->sem, &val);
+
+	return (val > 0 ? val : 0);
 }
 
 struct cb *cb_start(uint8_t buflen)
@@ -84,6 +125,7 @@ struct cb *cb_start(uint8_t buflen)
 	cb->buf = ec_malloc(sizeof(struct bucket) * buflen);
 
 	sem_init(&cb->sem, 0, 0);
+	sem_init(&cb->free_slots, 0, buflen);
 
 	return cb;
 
@@ -98,6 +140,7 @@ void cb_destroy(struct cb *cb)
 		if (cb->buf)
 			free(cb->buf);
 		sem_destroy(&cb->sem);
+		sem_destroy(&cb->free_slots);
 		free(cb);
 	}
 }
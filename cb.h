@@ -19,7 +19,9 @@ struct cb;
 struct cb *cb_start(uint8_t buflen);
 void cb_destroy(struct cb *cb);
 
-void cb_append(struct cb *, const char *, size_t);
+bool cb_append(struct cb *, const char *, size_t);
+bool cb_append_wait(struct cb *, const char *, size_t);
 bool cb_try_next(struct cb *, const char **, size_t *);
+unsigned int cb_count(struct cb *);
 
 #endif /* CB_H_ */
@@ -6,7 +6,11 @@
  */
 #include <linux/videodev2.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <getopt.h>
+#include <signal.h>
 #include <pthread.h>
 #include "main.h"
 #include "utils.h"
@@ -14,19 +18,38 @@
 #include "uvc.h"
 #include "window.h"
 #include "cb.h"
+#include "playback.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define CB_LEN 5
+#define PLAYBACK_BATCH		200
+#define PLAYBACK_SEEK_MS	10000
+#define PLAYBACK_MAX_SPEED	64.0
+#define HEADLESS_STATS_SECS	5
 
 static struct appbase *ab = NULL;
+static bool debug = false;
+static volatile sig_atomic_t stop = 0;
 
 static void print_usage(const char *name)
 {
 	if (name) {
 		printf("Usage: %s [OPTIONS] <app name> <username> <password>\n"
 				"Options:\n"
-				"    -d    Display debug messages\n"
-				"    -j    Decode images from JPEG\n",
-				name);
+				"    -d               Display debug messages\n"
+				"    -j               Decode images from JPEG\n"
+				"    -p from[:to]     Play back frames recorded in this time range\n"
+				"                     (seconds since the epoch, with optional .usecs)\n"
+				"    -x speed         Playback speed (default: 1)\n"
+				"    -n               Headless: do not open a window, just print frame statistics\n"
+				"    -s WxH           Window size (default: %dx%d). If the daemon publishes several\n"
+				"                     renditions, the one that best fits it is streamed\n"
+				"    -m port          Serve runtime metrics for Prometheus on this local port\n"
+				"    -M file          Write runtime metrics to this file every few seconds\n"
+				"    -t file          Trace every stage of the pipeline, and write it to this file on exit\n"
+				"While playing back, use left/right arrows to seek and up/down to change speed\n",
+				name, DEFAULT_WIDTH, DEFAULT_HEIGHT);
 	}
 }
 
@@ -35,19 +58,216 @@ static void print_usage(const char *name)
  * Frame 'f' might be NULL. This means that a frame was retrieved from Appbase,
  * but that we were unable to decode it.
  */
-static void frame_callback(const char *data, size_t len, void *userdata)
+static void frame_callback(const char *data, size_t len,
+		const struct timeval *timestamp, void *userdata)
 {
 //	struct window *w = userdata;
 	struct cb *cb = userdata;
 	if (data && len && cb) {
-		/* 'data' will be freed in the main thread */
-		cb_append(cb, data, len);
-		fprintf(stderr, "Image decoded (decoded len: %ld)\n", len);
+		/* 'data' will be freed in the main thread, unless we have to drop it */
+		if (!cb_append(cb, data, len)) {
+			metrics_inc(METRIC_FRAMES_DROPPED);
+			free((char *) data);
+		} else if (debug) {
+			fprintf(stderr, "Image decoded (decoded len: %ld)\n", len);
+		}
+		metrics_set(METRIC_QUEUE_DEPTH, cb_count(cb));
 	} else {
 		fprintf(stderr, "ERROR decoding image\n");
 	}
 }
 
+/*
+ * Parses "<seconds>[.<fraction>]" into 'tv'. Returns a pointer
+ * to the first character not parsed, or NULL on error.
+ */
+static const char *parse_timestamp(const char *str, struct timeval *tv)
+{
+	char *endptr;
+	long usec = 0, scale = 100000;
+
+	tv->tv_sec = strtol(str, &endptr, 10);
+	if (endptr == str || tv->tv_sec < 0)
+		return NULL;
+
+	if (*endptr == '.') {
+		for (endptr++; *endptr >= '0' && *endptr <= '9'; endptr++) {
+			usec += (*endptr - '0') * scale;
+			scale /= 10;
+		}
+	}
+
+	tv->tv_usec = usec;
+	return endptr;
+}
+
+static bool parse_range(const char *str, struct timeval *from, time_t *until)
+{
+	struct timeval to;
+
+	str = parse_timestamp(str, from);
+	if (!str)
+		return false;
+
+	if (*str == ':') {
+		str = parse_timestamp(str + 1, &to);
+		if (!str || to.tv_sec < from->tv_sec)
+			return false;
+		*until = to.tv_sec;
+	} else {
+		*until = time(NULL);
+	}
+
+	return (*str == 0);
+}
+
+/*
+ * If the daemon publishes several renditions, stream the smallest one
+ * that fills the window, or the biggest one if none does. Otherwise,
+ * we just stream the default one, and assume it's as big as the window.
+ */
+static void pick_rendition(size_t width, size_t height, struct frame *f)
+{
+	struct appbase_rendition renditions[AB_MAX_RENDITIONS], *r, *best = NULL;
+	int count = appbase_get_renditions(ab, renditions, AB_MAX_RENDITIONS);
+	bool fits, best_fits = false;
+
+	for (int i = 0; i < count; i++) {
+		r = &renditions[i];
+		fits = (r->width >= width && r->height >= height);
+
+		if (!best ||
+				(fits && (!best_fits || r->width * r->height < best->width * best->height)) ||
+				(!fits && !best_fits && r->width * r->height > best->width * best->height)) {
+			best = r;
+			best_fits = fits;
+		}
+	}
+
+	if (!best)
+		return;
+
+	if (!appbase_set_rendition(ab, best->id)) {
+		fprintf(stderr, "ERROR: Could not select rendition '%s'\n", best->id);
+		return;
+	}
+
+	f->width = best->width;
+	f->height = best->height;
+	if (debug)
+		fprintf(stderr, "Streaming rendition '%s' (%ux%u, %.1f fps)\n",
+				best->id, best->width, best->height, best->fps);
+}
+
+/*
+ * Recorded frames are all from the main rendition, so they are all 'width' x 'height'.
+ */
+static void playback_loop(struct window *window, struct playback *pb, size_t width, size_t height)
+{
+	struct frame frame;
+	struct timespec idle = { .tv_sec = 0, .tv_nsec = 1000000L };
+	double speed;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.width = width;
+	frame.height = height;
+
+	while (!window_is_closed() && !playback_finished(pb)) {
+		speed = playback_get_speed(pb);
+
+		switch (window_poll_key()) {
+		case WINDOW_KEY_LEFT:
+			playback_seek(pb, -PLAYBACK_SEEK_MS);
+			window_invalidate(window);
+			break;
+		case WINDOW_KEY_RIGHT:
+			playback_seek(pb, PLAYBACK_SEEK_MS);
+			window_invalidate(window);
+			break;
+		case WINDOW_KEY_UP:
+			if (speed < PLAYBACK_MAX_SPEED)
+				playback_set_speed(pb, speed * 2);
+			break;
+		case WINDOW_KEY_DOWN:
+			if (speed > 1 / PLAYBACK_MAX_SPEED)
+				playback_set_speed(pb, speed / 2);
+			break;
+		default:
+			break;
+		}
+
+		if (playback_next(pb, &frame)) {
+			trace_begin(TRACE_RENDER);
+			if (!window_render_frame(window, &frame))
+				fprintf(stderr, "ERROR: Could not render frame\n");
+			trace_end(TRACE_RENDER);
+			free(frame.frame_data);
+		} else {
+			nanosleep(&idle, NULL);
+		}
+	}
+}
+
+static void sighandler(int s)
+{
+	stop = 1;
+}
+
+static double elapsed_secs(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+ * Headless mode: frames are just counted and thrown away.
+ * Statistics are printed to stdout every HEADLESS_STATS_SECS, and a summary at the end,
+ * in a "key=value" format that is easy to parse by load testing scripts.
+ */
+static void headless_loop(struct cb *cb)
+{
+	struct timespec start, interval_start, idle = { .tv_sec = 0, .tv_nsec = 1000000L };
+	unsigned long frames = 0, interval_frames = 0;
+	unsigned long long bytes = 0;
+	const char *data;
+	size_t len;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	interval_start = start;
+
+	while (!stop) {
+		if (cb_try_next(cb, &data, &len)) {
+			frames++;
+			interval_frames++;
+			bytes += len;
+			free((char *) data);
+		} else {
+			nanosleep(&idle, NULL);
+		}
+
+		secs = elapsed_secs(&interval_start);
+		if (secs >= HEADLESS_STATS_SECS) {
+			printf("STATS frames=%lu fps=%.2f\n", frames, interval_frames / secs);
+			fflush(stdout);
+			clock_gettime(CLOCK_MONOTONIC, &interval_start);
+			interval_frames = 0;
+		}
+	}
+
+	secs = elapsed_secs(&start);
+	printf("SUMMARY frames=%lu secs=%.2f fps=%.2f bytes_per_frame=%.0f\n",
+			frames, secs, frames / secs,
+			(frames ? (double) bytes / frames : 0));
+	fflush(stdout);
+}
+
+/*
+ * appbase_stream_loop() takes care of reconnecting by itself when the stream drops,
+ * so it only returns when we ask it to stop, or if it could not start at all.
+ */
 static void *thread_loop(void *ptr)
 {
 	if (!appbase_stream_loop(ab, frame_callback, ptr))
@@ -58,18 +278,24 @@ static void *thread_loop(void *ptr)
 int main(int argc, char **argv)
 {
 	int opt;
-	bool debug = false;
+	char *endptr;
+	long metrics_port = 0;
+	const char *metrics_file = NULL, *trace_file = NULL;
+	uint64_t start;
+	bool playback = false, headless = false;
+	double speed = 1.0;
 	enum frame_format format = FRAME_FORMAT_YUYV;
+	size_t width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
 	struct window *window;
 	struct frame frame;
 	struct cb *cb;
+	struct playback *pb;
+	struct timeval from;
+	time_t until = 0;
+	struct sigaction sig;
 	pthread_t thread;
-	pthread_attr_t thread_attr;
-
-	frame.width = DEFAULT_WIDTH;
-	frame.height = DEFAULT_HEIGHT;
 
-	while ((opt = getopt(argc, argv, "dj")) != -1) {
+	while ((opt = getopt(argc, argv, "djp:x:ns:m:M:t:")) != -1) {
 		switch (opt) {
 		case 'd':
 			debug = true;
@@ -77,19 +303,54 @@ int main(int argc, char **argv)
 		case 'j':
 			format = FRAME_FORMAT_JPEG;
 			break;
+		case 'p':
+			if (!parse_range(optarg, &from, &until))
+				goto exit_help;
+			playback = true;
+			break;
+		case 'x':
+			speed = strtod(optarg, &endptr);
+			if (*endptr || speed <= 0)
+				goto exit_help;
+			break;
+		case 'n':
+			headless = true;
+			break;
+		case 's':
+			width = strtoul(optarg, &endptr, 10);
+			if (*endptr != 'x')
+				goto exit_help;
+			height = strtoul(endptr + 1, &endptr, 10);
+			if (*endptr || !width || !height)
+				goto exit_help;
+			break;
+		case 'm':
+			metrics_port = strtol(optarg, &endptr, 10);
+			if (*endptr || metrics_port <= 0 || metrics_port > 65535)
+				goto exit_help;
+			break;
+		case 'M':
+			metrics_file = optarg;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
 		default:
 			goto exit_help;
 		}
 	}
 
-	if (argc - optind < 3)
+	if (argc - optind < 3 || (headless && playback))
 		goto exit_help;
+	/* There's only one metrics exporter */
+	if (metrics_port && metrics_file)
+		fatal("Metrics can either be served (-m) or written to a file (-M), not both");
 
 	ab = appbase_open(
 			argv[optind],		// app name
 			argv[optind + 1],	// username
 			argv[optind + 2],	// password
-			true);			// enable streaming
+			!playback);		// enable streaming
 	if (!ab)
 		fatal("Could not log into Appbase");
 
@@ -98,28 +359,83 @@ int main(int argc, char **argv)
 		appbase_enable_verbose(ab, true);
 	}
 
+	/* Recorded frames only come from the main rendition */
+	frame.width = width;
+	frame.height = height;
+	if (!playback)
+		pick_rendition(width, height, &frame);
+
+	if (metrics_port && !metrics_serve(NULL, metrics_port))
+		fatal("Could not serve metrics on the requested port");
+	if (metrics_file && !metrics_write_file(metrics_file, METRICS_FILE_INTERVAL))
+		fatal("Could not write metrics to the requested file");
+	if (trace_file)
+		trace_start(trace_file);
+
+	if (headless) {
+		memset(&sig, 0, sizeof(sig));
+		sig.sa_handler = sighandler;
+		sigemptyset(&sig.sa_mask);
+		sigaction(SIGINT, &sig, NULL);
+		sigaction(SIGTERM, &sig, NULL);
+
+		window = NULL;
+	} else {
+		window = start_window(width, height, format);
+		if (!window)
+			fatal("Could not create window");
+	}
+
+	if (playback) {
+		pb = playback_start(ab, &from, until, PLAYBACK_BATCH);
+		if (!pb)
+			fatal("Could not start playback");
+
+		playback_set_speed(pb, speed);
+		playback_loop(window, pb, frame.width, frame.height);
+
+		playback_stop(pb);
+		trace_stop();
+		metrics_stop();
+		appbase_close(ab);
+		destroy_window(window);
+		goto exit;
+	}
+
 	cb = cb_start(CB_LEN);
-	window = start_window(frame.width, frame.height, format);
 
 	/*
 	 * Run the Appbase loop in a separate thread.
 	 * In the main thread, we wait until the user closes the window.
 	 */
-	pthread_attr_init(&thread_attr);
-	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
-	pthread_create(&thread, &thread_attr, thread_loop, (void *) cb);
+	if (pthread_create(&thread, NULL, thread_loop, (void *) cb) != 0)
+		fatal("Could not start the streaming thread");
 
-	while (!window_is_closed()) {
-		if (cb_try_next(cb, (const char **) &frame.frame_data, &frame.frame_bytes_used)) {
-			if (!window_render_frame(window, &frame))
-				fprintf(stderr, "ERROR: Could not render frame\n");
-			free(frame.frame_data);
+	if (headless) {
+		headless_loop(cb);
+	} else {
+		while (!window_is_closed()) {
+			if (cb_try_next(cb, (const char **) &frame.frame_data, &frame.frame_bytes_used)) {
+				start = metrics_now();
+				trace_begin(TRACE_RENDER);
+				if (!window_render_frame(window, &frame))
+					fprintf(stderr, "ERROR: Could not render frame\n");
+				trace_end(TRACE_RENDER);
+				metrics_observe_since(METRIC_TIME_RENDER, start);
+				free(frame.frame_data);
+			}
 		}
 	}
 
+	/* The thread writes into 'cb' and uses 'ab' until it's really gone */
+	appbase_stream_stop(ab);
+	pthread_join(thread, NULL);
+	trace_stop();
+	metrics_stop();
 	appbase_close(ab);
 
-	destroy_window(window);
+	if (window)
+		destroy_window(window);
 	cb_destroy(cb);
 
 	goto exit;
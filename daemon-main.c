@@ -8,20 +8,70 @@
 #include <signal.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <linux/videodev2.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
 #include "utils.h"
 #include "appbase.h"
 #include "uvc.h"
+#include "pixfmt.h"
+#include "metrics.h"
+#include "pool.h"
+#include "trace.h"
+#include "governor.h"
+#include "tiles.h"
+#include "schedule.h"
+#include "framebus.h"
+#include "mjpeg.h"
+#include "capture.h"
+#include "denoise.h"
+#include "reactor.h"
 
-#define DEFAULT_WAIT_TIME	5
+/* In ms */
+#define DEFAULT_WAIT_TIME	5000
+#define DEFAULT_TARGET_LATENCY	500
+/* Frames being uploaded at the same time, when streaming */
+#define MAX_UPLOADS		2
+/* Frames in a row without colour before we stop sending it, with -a */
+#define GRAYSCALE_AFTER		30
 
 int stop;
 #define SHOULD_STOP(v) (stop = v)
 #define IS_STOPPED()   (stop)
 
+static bool test_pattern = false;
+/* JPEG encoder settings, see frame.h */
+static enum jpeg_preset jpeg_preset = JPEG_PRESET_DEFAULT;
+/* Pixel format to ask cameras for, if not the cheapest one to convert */
+static const struct pixfmt *source_format = NULL;
+/* Work out what frames look like while encoding them, and send it along */
+static bool analyze = false;
+/* Where local consumers can get frames from, if anywhere */
+static const char *bus_path = NULL;
+/* Port to serve MJPEG to viewers on the LAN at, if any */
+static long int lan_port = 0;
+/* Reduce noise across frames, up to this many levels, if at all */
+static long int denoise_level = 0;
+/* Capture on a thread of its own (with -p or -C), scheduled like this */
+static bool threaded_capture = false;
+static struct capture_config capture_cfg = { .policy = SCHED_OTHER };
+/* CPUs for the event loop, which encodes and uploads. All of them, if empty */
+static cpu_set_t loop_cpus;
+static size_t capture_width = DEFAULT_WIDTH, capture_height = DEFAULT_HEIGHT;
+/* Size frames are scaled down to before sending them, if any */
+static size_t scale_width = 0, scale_height = 0;
+static enum {
+	GRAYSCALE_NEVER,
+	GRAYSCALE_ALWAYS,
+	/* Whenever the camera stops seeing colour, eg. when it switches to IR at night */
+	GRAYSCALE_AUTO
+} grayscale = GRAYSCALE_NEVER;
+
 static char *create_debug_filename()
 {
 #define COUNT_LIMIT 9
@@ -60,16 +110,176 @@ static void print_usage_and_exit(const char *name)
 	if (name) {
 		printf("Usage: %s [OPTIONS] <app name> <username> <password>\n"
 				"Options:\n"
-				"    -w secs        Sleep this amount of seconds between shots\n"
+				"    -w secs        Take a shot every this amount of seconds (down to 0.001)\n"
+				"    -o msecs       With -w, take them this many ms into every period,\n"
+				"                   to stagger cameras (default: 0, all in step)\n"
 				"    -d             Display debug messages\n"
 				"    -s             Take one single shot and exit\n"
 				"    -j             Convert frames to JPEG\n"
-				"    -S             Stream as fast as possible\n",
-				name);
+				"    -J preset      JPEG encoder preset: fastest, streaming, default, quality\n"
+				"                   or smallest (implies -j)\n"
+				"    -g             Encode the luma only, as grayscale JPEG (implies -j)\n"
+				"    -a             Switch to grayscale JPEG by itself, while there is no colour (implies -j)\n"
+				"    -A             Send the brightness, contrast and sharpness of every frame with it,\n"
+				"                   and whether it's blank (implies -j)\n"
+				"    -S             Stream as fast as possible\n"
+				"    -H             Also keep every frame in a time-indexed document, for playback\n"
+				"    -T             Capture from a synthetic test pattern instead of a camera\n"
+				"    -f format      Capture in this pixel format, if the camera can do it: yuyv, uyvy,\n"
+				"                   nv12, yuv420, grey or rgb24 (default: the cheapest to convert)\n"
+				"    -L             Back frame buffers with huge pages\n"
+				"    -m port        Serve runtime metrics for Prometheus on this local port\n"
+				"    -M file        Write runtime metrics to this file every few seconds\n"
+				"    -t file        Trace every stage of the pipeline, and write it to this file on exit\n"
+				"    -G min:max     Stream, adapting the frame rate between these bounds to the load (implies -S)\n"
+				"    -l msecs       With -G, keep the latency of every frame under this (default: %d ms)\n"
+				"    -q min:max     With -G, also adapt the JPEG quality between these bounds (implies -j)\n"
+				"    -i secs        When streaming, print capture statistics every this amount of seconds\n"
+				"    -c WxH         Capture at this resolution (default: %dx%d)\n"
+				"    -r WxH         Scale frames down to this resolution before sending them\n"
+				"    -R WxH[@fps]   Also publish a rendition of this size, at most at this rate\n"
+				"                   (can be given several times, implies -S)\n"
+				"    -k secs        Only send the tiles that changed, with a whole keyframe\n"
+				"                   every this amount of seconds (implies -S and -j)\n"
+				"    -B path        Also hand frames to local processes, through a frame bus\n"
+				"                   at this UNIX socket (implies -S)\n"
+				"    -P port        Also serve an MJPEG stream (/stream) and snapshots (/snapshot.jpg)\n"
+				"                   to viewers on the LAN, on this port (implies -S)\n"
+				"    -p fifo:N|rr:N Capture on a thread of its own, with this real-time policy\n"
+				"                   and priority (implies -S)\n"
+				"    -C cpus        Capture on a thread of its own, on these CPUs, eg. 2 or 2-3 (implies -S)\n"
+				"    -E cpus        Encode and upload on these CPUs (implies -S)\n"
+				"    -K             Lock all memory, so that frames are never paged out\n"
+				"    -N levels      Smooth out differences of up to about this many levels between\n"
+				"                   frames, as noise, but not what moves (1-%d, eg. 6, implies -S)\n",
+				name, DEFAULT_TARGET_LATENCY, DEFAULT_WIDTH, DEFAULT_HEIGHT, DENOISE_MAX_LEVEL);
 	}
 	exit(1);
 }
 
+/*
+ * Parse a pair of bounds in the form "min:max".
+ */
+static bool parse_bounds(const char *str, double *min, double *max)
+{
+	char *endptr;
+
+	*min = strtod(str, &endptr);
+	if (endptr == str || *endptr != ':')
+		return false;
+
+	str = endptr + 1;
+	*max = strtod(str, &endptr);
+	if (endptr == str || *endptr)
+		return false;
+
+	return (*min <= *max);
+}
+
+/*
+ * Parse a resolution in the form "WxH". Both must be even,
+ * since YUYV pixels come in pairs, and planar chroma rows too.
+ */
+static bool parse_size(const char *str, size_t *width, size_t *height)
+{
+	char *endptr;
+
+	*width = strtoul(str, &endptr, 10);
+	if (endptr == str || *endptr != 'x')
+		return false;
+
+	str = endptr + 1;
+	*height = strtoul(str, &endptr, 10);
+	if (endptr == str || *endptr)
+		return false;
+
+	return (*width && *height && *width % 2 == 0 && *height % 2 == 0);
+}
+
+/*
+ * Parse an additional rendition in the form "WxH[@fps]".
+ * Its document is named after its size.
+ */
+static bool parse_rendition(const char *str, struct appbase_rendition *rendition)
+{
+	char size[AB_RENDITION_ID_LEN], *at, *endptr;
+	size_t width, height;
+
+	snprintf(size, sizeof(size), "%s", str);
+	at = strchr(size, '@');
+	if (at) {
+		*(at++) = 0;
+		rendition->fps = strtod(at, &endptr);
+		if (endptr == at || *endptr || rendition->fps <= 0)
+			return false;
+	}
+
+	if (!parse_size(size, &width, &height))
+		return false;
+
+	rendition->width = width;
+	rendition->height = height;
+	snprintf(rendition->id, sizeof(rendition->id), "%zux%zu", width, height);
+
+	return true;
+}
+
+/*
+ * Parse a list of CPUs, such as "2", "2,3" or "2-3".
+ */
+static bool parse_cpus(const char *str, cpu_set_t *cpus)
+{
+	char *endptr;
+	long first, last;
+
+	CPU_ZERO(cpus);
+	do {
+		first = last = strtol(str, &endptr, 10);
+		if (endptr == str || first < 0)
+			return false;
+
+		if (*endptr == '-') {
+			str = endptr + 1;
+			last = strtol(str, &endptr, 10);
+			if (endptr == str || last < first)
+				return false;
+		}
+		if (last >= CPU_SETSIZE)
+			return false;
+
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, cpus);
+		str = endptr + 1;
+	} while (*endptr == ',');
+
+	return (*endptr == '\0');
+}
+
+/*
+ * Parse a real-time policy and priority in the form "fifo:N" or "rr:N".
+ */
+static bool parse_policy(const char *str, struct capture_config *cfg)
+{
+	char *endptr;
+
+	if (strncmp(str, "fifo:", 5) == 0) {
+		cfg->policy = SCHED_FIFO;
+		str += 5;
+	} else if (strncmp(str, "rr:", 3) == 0) {
+		cfg->policy = SCHED_RR;
+		str += 3;
+	} else {
+		return false;
+	}
+
+	cfg->priority = strtol(str, &endptr, 10);
+	if (endptr == str || *endptr)
+		return false;
+
+	return (cfg->priority >= sched_get_priority_min(cfg->policy) &&
+			cfg->priority <= sched_get_priority_max(cfg->policy));
+}
+
 static void sighandler(int s)
 {
 	char *signame;
@@ -104,81 +314,516 @@ static void sighandler(int s)
 	SHOULD_STOP(1);
 }
 
-static void do_stream(struct appbase *ab, bool jpeg)
+static struct camera *open_camera()
+{
+	struct camera *c = (test_pattern ? uvc_open_test_pattern() : uvc_open());
+
+	if (c && source_format)
+		uvc_set_source_format(c, source_format->fourcc);
+	return c;
+}
+
+/*
+ * Set up 'scaled' for frames coming from 'c', to be scaled down to 'width' x 'height'.
+ * Zero means the same size as captured, which costs nothing unless converting to JPEG.
+ * The encoder takes planar frames directly, so those are cheaper to convert,
+ * unless the JPEG preset wants all the chroma: then they're kept in YUYV.
+ */
+static void setup_scaling(struct camera *c, struct frame *scaled, size_t width, size_t height, bool jpeg)
 {
+	/* The camera might have chosen a different resolution than we asked for */
+	if (width > c->frame->width || height > c->frame->height)
+		fatal("Frames can only be scaled down, not up");
+
+	scaled->width = (width ? width : c->frame->width);
+	scaled->height = (height ? height : c->frame->height);
+	scaled->format = (jpeg && !frame_jpeg_preset_full_chroma(jpeg_preset) ?
+			V4L2_PIX_FMT_YUV420 : V4L2_PIX_FMT_YUYV);
+}
+
+/*
+ * When streaming, everything runs from a single event loop:
+ * frames are captured when the camera fd becomes readable, and uploaded
+ * asynchronously while we go on capturing the next ones.
+ * With a capture thread, frames are captured there instead,
+ * and the event loop is woken up when one is handed over.
+ */
+struct stream {
 	struct camera *c;
+	struct reactor *r;
+	struct reactor_timer *watchdog;
+	struct reactor_timer *stats_timer;
+	unsigned int stats_interval;
+	unsigned int upload_drops;
+	struct jpeg_params params;
+	bool jpeg;
+	/* Frames in a row without colour */
+	unsigned int neutral_frames;
+	struct framebus *bus;
+	struct mjpeg_server *lan;
+	/* For LAN viewers, when no rendition gave them this frame */
+	struct frame lan_frame;
+	bool lan_served;
+	/* Only with -p or -C */
+	struct capture_thread *capture;
+	/* Only with -N */
+	struct denoiser *denoise;
+};
+
+/*
+ * Every rendition is published to its own document, at its own size and rate,
+ * with its own governor to pace it. Frames are captured once, and scaled down
+ * for each of them from the same buffer. The first one is the main stream:
+ * it keeps the default document, and is the only one kept in the history.
+ */
+struct rendition {
+	struct appbase_rendition info;
+	struct appbase *ab;
+	struct governor *gov;
+	struct frame scaled;
+	/* Only with -k */
+	struct tile_encoder *tiles;
+};
+
+static struct rendition renditions[AB_MAX_RENDITIONS];
+static unsigned int num_renditions = 1;
+
+struct stream_upload {
+	struct governor *gov;
+	uint64_t captured;
+	uint64_t submitted;
+};
+
+static void stream_upload_done(bool success, void *userdata)
+{
+	struct stream_upload *su = userdata;
+
+	if (success) {
+		governor_observe(su->gov, GOVERNOR_UPLOAD, governor_now() - su->submitted);
+		governor_frame_sent(su->gov, su->captured);
+	} else {
+		fprintf(stderr, "ERROR: Could not send frame\n");
+	}
+
+	free(su);
+}
+
+static void stream_send(struct stream *st, struct rendition *rd, const struct frame *f,
+		uint64_t start, uint64_t captured)
+{
+	struct stream_upload *su;
+	uint64_t now;
+	bool keyframe = true;
+
+	if (!governor_take_frame(rd->gov))
+		return;
+	if (appbase_uploads_in_flight(rd->ab) >= MAX_UPLOADS) {
+		metrics_inc(METRIC_FRAMES_DROPPED);
+		st->upload_drops++;
+		return;
+	}
+
+	governor_observe(rd->gov, GOVERNOR_CAPTURE, captured - start);
+	now = governor_now();
+
+	trace_begin(TRACE_FRAME);
+	if (!frame_scale(f, &rd->scaled)) {
+		fprintf(stderr, "ERROR: Could not scale frame\n");
+		goto end;
+	}
+
+	if (st->jpeg) {
+		st->params.quality = governor_quality(rd->gov);
+		if (!rd->tiles)
+			frame_convert_yuyv_to_jpeg_ext(&rd->scaled, &st->params);
+		else if (!tiles_encode(rd->tiles, &rd->scaled, &st->params, &keyframe))
+			fprintf(stderr, "ERROR: Could not encode tiles\n");
+	}
+	governor_observe(rd->gov, GOVERNOR_ENCODE, governor_now() - now);
+
+	/* Whole JPEGs of the main stream are good for LAN viewers as they are */
+	if (rd == renditions && st->jpeg && keyframe)
+		st->lan_served = mjpeg_server_publish(st->lan, &rd->scaled);
+
+	framebus_publish(st->bus, FRAMEBUS_STREAM_RENDITION(rd - renditions),
+			(st->jpeg ? V4L2_PIX_FMT_JPEG : rd->scaled.format), &rd->scaled);
+
+	su = ec_malloc(sizeof(struct stream_upload));
+	su->gov = rd->gov;
+	su->captured = start;
+	su->submitted = governor_now();
+	if (!appbase_push_frame_async(rd->ab,
+			rd->scaled.frame_data, rd->scaled.frame_bytes_used,
+			&rd->scaled.capture_time,
+			&rd->scaled.stats,
+			stream_upload_done, su)) {
+		metrics_inc(METRIC_FRAMES_DROPPED);
+		st->upload_drops++;
+		free(su);
+	}
+
+end:
+	trace_end(TRACE_FRAME);
+}
+
+/*
+ * Encode a frame for LAN viewers alone, at the size of the main stream.
+ * Only while anybody's watching.
+ */
+static void stream_serve_lan(struct stream *st, const struct frame *f)
+{
+	struct jpeg_params params = st->params;
+
+	if (!frame_scale(f, &st->lan_frame)) {
+		fprintf(stderr, "ERROR: Could not scale frame\n");
+		return;
+	}
+
+	params.analyze = false;
+	frame_convert_yuyv_to_jpeg_ext(&st->lan_frame, &params);
+	mjpeg_server_publish(st->lan, &st->lan_frame);
+}
+
+static void stream_process(struct stream *st, struct frame *f, uint64_t start, uint64_t captured)
+{
+	/* Before anyone else gets to see the frame, since it's filtered in place */
+	if (st->denoise && !denoiser_apply(st->denoise, f))
+		fprintf(stderr, "ERROR: Could not reduce the noise of the frame\n");
+
+	/*
+	 * Go grayscale only once colour has been gone for a while,
+	 * but bring it back as soon as it's there again.
+	 */
+	if (st->jpeg && grayscale == GRAYSCALE_AUTO) {
+		if (frame_is_grayscale(f)) {
+			if (st->neutral_frames < GRAYSCALE_AFTER)
+				st->neutral_frames++;
+		} else {
+			st->neutral_frames = 0;
+		}
+
+		if (st->params.grayscale != (st->neutral_frames >= GRAYSCALE_AFTER)) {
+			st->params.grayscale = !st->params.grayscale;
+			if (st->params.grayscale)
+				fprintf(stderr, "No colour in the last %d frames. Sending grayscale frames.\n",
+						GRAYSCALE_AFTER);
+			else
+				fprintf(stderr, "Colour is back. Sending colour frames.\n");
+		}
+	}
+
+	framebus_publish(st->bus, FRAMEBUS_STREAM_CAPTURED, f->format, f);
+
+	/*
+	 * Always drain the camera, so that the frame we send is the freshest one,
+	 * even if no rendition wants it.
+	 */
+	st->lan_served = false;
+	for (unsigned int i = 0; i < num_renditions; i++)
+		stream_send(st, &renditions[i], f, start, captured);
+
+	/* LAN viewers get every frame, even those the main stream didn't take */
+	if (!st->lan_served && mjpeg_server_viewers(st->lan))
+		stream_serve_lan(st, f);
+}
+
+static void stream_frame_ready(int fd, uint32_t events, void *userdata)
+{
+	struct stream *st = userdata;
+	uint64_t start = governor_now(), captured;
+
+	if (!uvc_capture_frame(st->c)) {
+		fprintf(stderr, "ERROR: Could not capture frame\n");
+		reactor_stop(st->r);
+		return;
+	}
+	reactor_timer_arm(st->watchdog, UVC_CAPTURE_TIMEOUT_MS);
+	captured = governor_now();
+
+	stream_process(st, st->c->frame, start, captured);
+	st->c->frame->frame_bytes_used = 0;
+}
+
+/*
+ * With a capture thread, frames come already captured. We get a reference
+ * to each, while the thread goes on capturing into another buffer.
+ */
+static void stream_frame_handed_over(int fd, uint32_t events, void *userdata)
+{
+	struct stream *st = userdata;
+	struct capture_frame cf;
+
+	switch (capture_thread_take(st->capture, &cf)) {
+	case -1:
+		fprintf(stderr, "ERROR: Could not capture frame\n");
+		reactor_stop(st->r);
+		return;
+	case 0:
+		return;
+	}
+	reactor_timer_arm(st->watchdog, UVC_CAPTURE_TIMEOUT_MS);
+
+	stream_process(st, &cf.frame, cf.start, cf.captured);
+	pool_unref(cf.frame.frame_data);
+}
+
+static const char *policy_name(int policy)
+{
+	switch (policy) {
+	case SCHED_FIFO:
+		return "fifo";
+	case SCHED_RR:
+		return "rr";
+	default:
+		return "other";
+	}
+}
 
-	c = uvc_open();
-	if (!c)
+/*
+ * Print what the camera has been doing lately. If frames get lost or old
+ * while we wait very little for them, we're not keeping up with the camera.
+ * If we wait for them most of the time, but they're dropped before upload,
+ * it's the network that's not keeping up.
+ */
+static void stream_print_stats(void *userdata)
+{
+	struct stream *st = userdata;
+	struct uvc_stats stats;
+	struct capture_thread_stats handoff;
+	unsigned int consumers;
+	uint64_t lag;
+
+	uvc_get_stats(st->c, &stats);
+	fprintf(stderr, "CAPTURE secs=%.1f frames=%u fps=%.2f lost=%u errors=%u "
+			"interval_ms=%.2f jitter_ms=%.2f wait_ms=%.2f age_avg_ms=%.2f age_max_ms=%.2f "
+			"upload_drops=%u timestamps=\"%s\" format=%s\n",
+			stats.secs, stats.frames, stats.fps, stats.lost, stats.errors,
+			stats.interval, stats.jitter, stats.wait, stats.age_avg, stats.age_max,
+			st->upload_drops, stats.timestamp_source, stats.format);
+	st->upload_drops = 0;
+
+	if (st->bus) {
+		consumers = framebus_consumers(st->bus, &lag);
+		fprintf(stderr, "BUS consumers=%u max_lag=%llu\n", consumers, (unsigned long long) lag);
+	}
+	if (st->lan)
+		fprintf(stderr, "LAN viewers=%u\n", mjpeg_server_viewers(st->lan));
+	/* Frames dropped here were captured in time, but the event loop didn't get to them */
+	if (st->capture) {
+		capture_thread_get_stats(st->capture, &handoff);
+		fprintf(stderr, "HANDOFF policy=%s priority=%d frames=%u drops=%u avg_ms=%.3f max_ms=%.3f\n",
+				policy_name(capture_cfg.policy), capture_cfg.priority,
+				handoff.frames, handoff.drops, handoff.handoff_avg, handoff.handoff_max);
+	}
+
+	reactor_timer_arm(st->stats_timer, st->stats_interval * 1000UL);
+}
+
+static void stream_camera_timeout(void *userdata)
+{
+	struct stream *st = userdata;
+
+	fprintf(stderr, "ERROR: No frames from the camera in %d ms\n", UVC_CAPTURE_TIMEOUT_MS);
+	reactor_stop(st->r);
+}
+
+static void stream_signal(int signo, void *userdata)
+{
+	sighandler(signo);
+	reactor_stop((struct reactor *) userdata);
+}
+
+/*
+ * Tell clients which renditions there are, now that we know their actual sizes.
+ */
+static void publish_renditions()
+{
+	struct appbase_rendition list[AB_MAX_RENDITIONS];
+
+	for (unsigned int i = 0; i < num_renditions; i++) {
+		list[i] = renditions[i].info;
+		list[i].width = renditions[i].scaled.width;
+		list[i].height = renditions[i].scaled.height;
+	}
+
+	if (!appbase_publish_renditions(renditions[0].ab, list, num_renditions))
+		fprintf(stderr, "ERROR: Could not publish the list of renditions\n");
+}
+
+static void do_stream(struct reactor *r, bool jpeg, unsigned int stats_interval)
+{
+	struct rendition *rd;
+	struct stream st = {
+		.r = r,
+		.jpeg = jpeg,
+		.stats_interval = stats_interval,
+		.params = {
+			.quality = JPEG_DEFAULT_QUALITY,
+			.preset = jpeg_preset,
+			.grayscale = (grayscale == GRAYSCALE_ALWAYS),
+			.analyze = analyze
+		}
+	};
+
+	/* The capture thread inherits these, unless it's given CPUs of its own */
+	if (CPU_COUNT(&loop_cpus) &&
+			pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &loop_cpus) != 0)
+		fatal("Could not run on the requested CPUs");
+
+	st.c = open_camera();
+	if (!st.c)
 		fatal("Could not find any camera for capturing pictures");
 
-	c->frame = uvc_alloc_frame(320, 240, V4L2_PIX_FMT_YUYV);
-	if (!c->frame)
+	st.c->frame = uvc_alloc_frame(capture_width, capture_height, V4L2_PIX_FMT_YUYV);
+	if (!st.c->frame)
 		fatal("Could not allocate enough memory for frames");
 
-	if (!uvc_init(c))
+	if (!uvc_init(st.c))
 		fatal("Could not start camera for streaming");
 
-	while (!IS_STOPPED() && uvc_capture_frame(c)) {
-		if (jpeg)
-			frame_convert_yuyv_to_jpeg(c->frame);
-		if (!appbase_push_frame(ab,
-				c->frame->frame_data, c->frame->frame_bytes_used,
-				&c->frame->capture_time)) {
-			fprintf(stderr, "ERROR: Could not capture frame\n");
-			break;
-		}
+	/* Slots are as big as captured frames, which are the biggest we publish */
+	if (bus_path) {
+		st.bus = framebus_create(bus_path, FRAMEBUS_DEFAULT_SLOTS,
+				st.c->frame->width * st.c->frame->height * 2);
+		if (!st.bus || !framebus_attach_reactor(st.bus, r))
+			fatal("Could not create the frame bus");
+	}
+
+	if (lan_port) {
+		st.lan = mjpeg_server_new(r, NULL, lan_port);
+		if (!st.lan)
+			fatal("Could not serve MJPEG on the requested port");
+		setup_scaling(st.c, &st.lan_frame, renditions[0].info.width, renditions[0].info.height, true);
+	}
+
+	for (unsigned int i = 0; i < num_renditions; i++) {
+		rd = &renditions[i];
+		setup_scaling(st.c, &rd->scaled, rd->info.width, rd->info.height, jpeg);
+
+		if (!appbase_attach_reactor(rd->ab, r, MAX_UPLOADS))
+			fatal("Could not set up asynchronous uploads");
+	}
+	publish_renditions();
+
+	if (denoise_level)
+		st.denoise = denoiser_new(denoise_level);
+
+	st.watchdog = reactor_timer_new(r, stream_camera_timeout, &st);
+	if (!st.watchdog)
+		fatal("Could not start the event loop");
 
-		c->frame->frame_bytes_used = 0;
+	if (threaded_capture) {
+		st.capture = capture_thread_start(st.c, &capture_cfg);
+		if (!st.capture)
+			fatal("Could not start the capture thread (real-time policies need CAP_SYS_NICE)");
+		if (!reactor_add_fd(r, capture_thread_get_fd(st.capture), EPOLLIN, stream_frame_handed_over, &st))
+			fatal("Could not start the event loop");
+	} else if (!reactor_add_fd(r, uvc_get_fd(st.c), EPOLLIN, stream_frame_ready, &st)) {
+		fatal("Could not start the event loop");
 	}
 
-	uvc_close(c);
+	if (stats_interval) {
+		st.stats_timer = reactor_timer_new(r, stream_print_stats, &st);
+		if (!st.stats_timer)
+			fatal("Could not start the event loop");
+		reactor_timer_arm(st.stats_timer, stats_interval * 1000UL);
+	}
+
+	reactor_timer_arm(st.watchdog, UVC_CAPTURE_TIMEOUT_MS);
+	if (!reactor_run(r))
+		fprintf(stderr, "ERROR: The event loop failed\n");
+
+	if (stats_interval)
+		stream_print_stats(&st);
+
+	if (st.capture) {
+		reactor_del_fd(r, capture_thread_get_fd(st.capture));
+		capture_thread_stop(st.capture);
+	} else {
+		reactor_del_fd(r, uvc_get_fd(st.c));
+	}
+	framebus_close(st.bus);
+	mjpeg_server_free(st.lan);
+	denoiser_free(st.denoise);
+	pool_unref(st.lan_frame.frame_data);
+	reactor_timer_free(st.stats_timer);
+	reactor_timer_free(st.watchdog);
+	for (unsigned int i = 0; i < num_renditions; i++) {
+		pool_unref(renditions[i].scaled.frame_data);
+		renditions[i].scaled.frame_data = NULL;
+	}
+	uvc_close(st.c);
 }
 
-void do_capture(struct appbase *ab, unsigned int wait_time, bool oneshot, bool jpeg, bool debug)
+void do_capture(struct appbase *ab, unsigned long period_ms, unsigned long phase_ms,
+		bool oneshot, bool jpeg, bool debug)
 {
+	struct schedule schedule;
 	struct camera *c;
-	struct frame *f;
+	struct frame *f, scaled;
+	struct jpeg_params params = {
+		.quality = JPEG_DEFAULT_QUALITY,
+		.preset = jpeg_preset,
+		.analyze = analyze
+	};
+
+	/* The first shot is taken right away, and the rest on the schedule */
+	schedule_init(&schedule, period_ms, phase_ms);
 
 	while (!IS_STOPPED()) {
-		c = uvc_open();
+		c = open_camera();
 		if (!c)
 			fatal("Could not find any camera for capturing pictures");
 
-		c->frame = uvc_alloc_frame(320, 240, V4L2_PIX_FMT_YUYV);
+		c->frame = uvc_alloc_frame(capture_width, capture_height, V4L2_PIX_FMT_YUYV);
 		if (!c->frame)
 			fatal("Could not allocate enough memory for frames");
 
 		if (!uvc_init(c))
 			fatal("Could not start camera for streaming");
 
+		memset(&scaled, 0, sizeof(scaled));
+		if (scale_width)
+			setup_scaling(c, &scaled, scale_width, scale_height, jpeg);
+
 		if (uvc_capture_frame(c)) {
 			f = c->frame;
-			if (jpeg)
-				frame_convert_yuyv_to_jpeg(f);
+			trace_begin(TRACE_FRAME);
+			if (scaled.width) {
+				if (frame_scale(f, &scaled))
+					f = &scaled;
+				else
+					fprintf(stderr, "ERROR: Could not scale frame\n");
+			}
+			if (jpeg) {
+				/* We've got one frame only, so it's this one that decides */
+				params.grayscale = (grayscale == GRAYSCALE_ALWAYS ||
+						(grayscale == GRAYSCALE_AUTO && frame_is_grayscale(f)));
+				frame_convert_yuyv_to_jpeg_ext(f, &params);
+			}
 			if (!appbase_push_frame(ab,
 					f->frame_data, f->frame_bytes_used,
-					&f->capture_time))
+					&f->capture_time,
+					&f->stats))
 				fprintf(stderr, "ERROR: Could not send frame\n");
 
 			if (debug)
 				write_to_disk(f->frame_data, f->frame_bytes_used);
+			trace_end(TRACE_FRAME);
 
-			memset(f->frame_data, 0, f->frame_size);
-			f->frame_bytes_used = 0;
+			c->frame->frame_bytes_used = 0;
 		} else {
 			fprintf(stderr, "ERROR: Could not capture frame\n");
 		}
 
+		pool_unref(scaled.frame_data);
 		uvc_close(c);
 
 		if (oneshot)
 			break;
-		/*
-		 * sleep(3) should not interfere with our signal handlers,
-		 * unless we're also handling SIGALRM
-		 */
-		sleep(wait_time);
+		/* Our signal handlers wake us up early. Then we either stop, or go back to sleep */
+		while (!schedule_wait(&schedule) && !IS_STOPPED())
+			;
 	}
 
 }
@@ -187,17 +832,34 @@ int main(int argc, char **argv)
 {
 	int opt;
 	char *endptr;
-	long int wait_time = DEFAULT_WAIT_TIME;
-	bool debug = false, oneshot = false, stream = false, jpeg = false;
+	long int metrics_port = 0, stats_interval = 0, keyframe_secs = 0, latency_ms;
+	unsigned long period_ms = DEFAULT_WAIT_TIME, phase_ms = 0;
+	double secs;
+	struct governor_config gov_cfg = {
+		.target_latency_ms = DEFAULT_TARGET_LATENCY
+	};
+	struct governor *gov = NULL;
+	struct reactor *r = NULL;
+	sigset_t signals;
+	const char *metrics_file = NULL, *trace_file = NULL;
+	double min_quality, max_quality;
+	bool debug = false, oneshot = false, stream = false, jpeg = false, history = false, lock_memory = false;
 	struct sigaction sig;
 	struct appbase *ab;
+	struct rendition *rd;
 
 	/* Parse command-line options */
-	while ((opt = getopt(argc, argv, "w:dsSj")) != -1) {
+	while ((opt = getopt(argc, argv, "w:o:dsSjJ:gaAHTf:Lm:M:t:G:l:q:i:c:r:R:k:B:P:p:C:E:KN:")) != -1) {
 		switch (opt) {
 		case 'w':
-			wait_time = strtol(optarg, &endptr, 10);
-			if (*endptr || wait_time < 0)
+			secs = strtod(optarg, &endptr);
+			if (endptr == optarg || *endptr || secs < 0 || secs > ULONG_MAX / 1000)
+				print_usage_and_exit(argv[0]);
+			period_ms = (unsigned long) (secs * 1000 + 0.5);
+			break;
+		case 'o':
+			phase_ms = strtoul(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr)
 				print_usage_and_exit(argv[0]);
 			break;
 		case 'd':
@@ -212,12 +874,148 @@ int main(int argc, char **argv)
 		case 'j':
 			jpeg = true;
 			break;
+		case 'J':
+			if (!frame_jpeg_preset_find(optarg, &jpeg_preset))
+				print_usage_and_exit(argv[0]);
+			jpeg = true;
+			break;
+		case 'g':
+			grayscale = GRAYSCALE_ALWAYS;
+			jpeg = true;
+			break;
+		case 'a':
+			grayscale = GRAYSCALE_AUTO;
+			jpeg = true;
+			break;
+		case 'A':
+			analyze = true;
+			jpeg = true;
+			break;
+		case 'H':
+			history = true;
+			break;
+		case 'T':
+			test_pattern = true;
+			break;
+		case 'f':
+			source_format = pixfmt_find_name(optarg);
+			if (!source_format)
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'L':
+			if (!pool_init(true))
+				fatal("Could not set up huge pages for frame buffers");
+			break;
+		case 'm':
+			metrics_port = strtol(optarg, &endptr, 10);
+			if (*endptr || metrics_port <= 0 || metrics_port > 65535)
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'M':
+			metrics_file = optarg;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'G':
+			/* The governor only makes sense when streaming */
+			if (!parse_bounds(optarg, &gov_cfg.min_fps, &gov_cfg.max_fps) || gov_cfg.min_fps <= 0)
+				print_usage_and_exit(argv[0]);
+			stream = true;
+			break;
+		case 'l':
+			latency_ms = strtol(optarg, &endptr, 10);
+			if (*endptr || latency_ms <= 0 || latency_ms > UINT_MAX)
+				print_usage_and_exit(argv[0]);
+			gov_cfg.target_latency_ms = latency_ms;
+			break;
+		case 'i':
+			stats_interval = strtol(optarg, &endptr, 10);
+			if (*endptr || stats_interval <= 0)
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'c':
+			if (!parse_size(optarg, &capture_width, &capture_height))
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'r':
+			if (!parse_size(optarg, &scale_width, &scale_height))
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'R':
+			if (num_renditions == AB_MAX_RENDITIONS)
+				print_usage_and_exit(argv[0]);
+			rd = &renditions[num_renditions];
+			if (!parse_rendition(optarg, &rd->info))
+				print_usage_and_exit(argv[0]);
+			for (unsigned int i = 1; i < num_renditions; i++) {
+				if (strcmp(renditions[i].info.id, rd->info.id) == 0)
+					print_usage_and_exit(argv[0]);
+			}
+			num_renditions++;
+			stream = true;
+			break;
+		case 'B':
+			bus_path = optarg;
+			stream = true;
+			break;
+		case 'P':
+			lan_port = strtol(optarg, &endptr, 10);
+			if (*endptr || lan_port <= 0 || lan_port > 65535)
+				print_usage_and_exit(argv[0]);
+			stream = true;
+			break;
+		case 'p':
+			if (!parse_policy(optarg, &capture_cfg))
+				print_usage_and_exit(argv[0]);
+			threaded_capture = true;
+			stream = true;
+			break;
+		case 'C':
+			if (!parse_cpus(optarg, &capture_cfg.cpus))
+				print_usage_and_exit(argv[0]);
+			threaded_capture = true;
+			stream = true;
+			break;
+		case 'E':
+			if (!parse_cpus(optarg, &loop_cpus))
+				print_usage_and_exit(argv[0]);
+			stream = true;
+			break;
+		case 'K':
+			lock_memory = true;
+			break;
+		case 'N':
+			denoise_level = strtol(optarg, &endptr, 10);
+			if (*endptr || denoise_level <= 0 || denoise_level > DENOISE_MAX_LEVEL)
+				print_usage_and_exit(argv[0]);
+			stream = true;
+			break;
+		case 'k':
+			keyframe_secs = strtol(optarg, &endptr, 10);
+			if (*endptr || keyframe_secs <= 0)
+				print_usage_and_exit(argv[0]);
+			stream = true;
+			jpeg = true;
+			break;
+		case 'q':
+			if (!parse_bounds(optarg, &min_quality, &max_quality) ||
+					min_quality < 1 || max_quality > 100)
+				print_usage_and_exit(argv[0]);
+			gov_cfg.min_quality = min_quality;
+			gov_cfg.max_quality = max_quality;
+			jpeg = true;
+			break;
 		default:
 			print_usage_and_exit(argv[0]);
 			break;
 		}
 	}
 
+	/* There's only one metrics exporter */
+	if (metrics_port && metrics_file)
+		fatal("Metrics can either be served (-m) or written to a file (-M), not both");
+
 	/* Set signal handlers and set stop condition to zero */
 	SHOULD_STOP(0);
 
@@ -233,6 +1031,10 @@ int main(int argc, char **argv)
 	sigaction(SIGABRT, &sig, NULL);
 	sigaction(SIGTRAP, &sig, NULL);
 
+	/* Frame buffers come from the pool, so they're all locked as soon as they're allocated */
+	if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		fatal("Could not lock memory (is RLIMIT_MEMLOCK high enough?)");
+
 	/* Set up Appbase handle
 	 * We need the app name, username and password to build the REST URL, and these
 	 * should came now as parameters. We expect optind to point us to the first one.
@@ -253,12 +1055,87 @@ int main(int argc, char **argv)
 		appbase_enable_verbose(ab, true);
 	}
 
+	if (history && !appbase_enable_history(ab, true))
+		fatal("Could not enable history");
+
+	/* Every additional rendition gets its own handle, and its own document */
+	for (unsigned int i = 1; i < num_renditions; i++) {
+		rd = &renditions[i];
+		rd->ab = appbase_open(argv[optind], argv[optind + 1], argv[optind + 2], false);
+		if (!rd->ab || !appbase_set_rendition(rd->ab, rd->info.id))
+			fatal("Could not log into Appbase");
+
+		if (debug) {
+			appbase_enable_progress(rd->ab, true);
+			appbase_enable_verbose(rd->ab, true);
+		}
+	}
+
+	/*
+	 * When streaming, signals are handled by the event loop.
+	 * This has to be set up before starting any other thread (eg. metrics).
+	 */
+	if (stream) {
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGQUIT);
+		sigaddset(&signals, SIGTERM);
+
+		r = reactor_new();
+		if (!r || !reactor_watch_signals(r, &signals, stream_signal, r))
+			fatal("Could not create the event loop");
+	}
+
+	if (metrics_port && !metrics_serve(NULL, metrics_port))
+		fatal("Could not serve metrics on the requested port");
+	if (metrics_file && !metrics_write_file(metrics_file, METRICS_FILE_INTERVAL))
+		fatal("Could not write metrics to the requested file");
+	if (trace_file)
+		trace_start(trace_file);
+
+	if (gov_cfg.max_fps > 0) {
+		gov_cfg.verbose = debug;
+		gov = governor_new(&gov_cfg);
+		if (!gov)
+			fatal("Invalid bounds for the frame rate governor");
+	}
+
+	renditions[0].ab = ab;
+	renditions[0].gov = gov;
+	renditions[0].info.width = scale_width;
+	renditions[0].info.height = scale_height;
+	renditions[0].info.fps = gov_cfg.max_fps;
+	strcpy(renditions[0].info.id, AB_DEFAULT_RENDITION);
+
+	/* Additional renditions with a rate are paced by a governor that can't move it */
+	for (unsigned int i = 1; i < num_renditions; i++) {
+		struct governor_config cfg = {
+			.min_fps = renditions[i].info.fps,
+			.max_fps = renditions[i].info.fps,
+			.target_latency_ms = gov_cfg.target_latency_ms
+		};
+
+		if (cfg.max_fps > 0)
+			renditions[i].gov = governor_new(&cfg);
+	}
+
+	for (unsigned int i = 0; keyframe_secs && i < num_renditions; i++)
+		renditions[i].tiles = tiles_new(keyframe_secs);
+
 	if (stream)
-		do_stream(ab, jpeg);
+		do_stream(r, jpeg, stats_interval);
 	else
-		do_capture(ab, wait_time, oneshot, jpeg, debug);
+		do_capture(ab, period_ms, phase_ms, oneshot, jpeg, debug);
 
-	appbase_close(ab);
+	trace_stop();
+	metrics_stop();
+	/* In-flight uploads are tied to the event loop, so it goes last */
+	for (unsigned int i = 0; i < num_renditions; i++) {
+		governor_free(renditions[i].gov);
+		tiles_free(renditions[i].tiles);
+		appbase_close(renditions[i].ab);
+	}
+	reactor_free(r);
 
 	return 0;
 }
@@ -0,0 +1,136 @@
+/*
+ * denoise.c
+ *
+ * A recursive filter, with the strength adapted to motion for every sample.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "utils.h"
+#include "metrics.h"
+#include "trace.h"
+#include "denoise.h"
+
+/*
+ * Weight of the new sample, in 16ths. It goes up from DENOISE_MIN_WEIGHT
+ * for samples that didn't change at all, to the whole of it for those that changed
+ * by twice the level or more. Steps are rounded to the nearest, so where nothing
+ * moves the picture settles to within 1 of what the camera sees.
+ */
+#define DENOISE_MIN_WEIGHT	4
+
+struct denoiser {
+	unsigned int level;
+	/* Slope of the weight: (16 - DENOISE_MIN_WEIGHT) / (2 * level), times 256, rounded up */
+	unsigned int slope;
+	/* The last frame, as filtered */
+	unsigned char *ref;
+	size_t width;
+	size_t height;
+};
+
+struct denoiser *denoiser_new(unsigned int level)
+{
+	struct denoiser *d;
+
+	if (!level || level > DENOISE_MAX_LEVEL)
+		return NULL;
+
+	d = ec_malloc(sizeof(struct denoiser));
+	d->level = level;
+	d->slope = ((16 - DENOISE_MIN_WEIGHT) * 256 + 2 * level - 1) / (2 * level);
+	return d;
+}
+
+void denoiser_free(struct denoiser *d)
+{
+	if (d) {
+		free(d->ref);
+		free(d);
+	}
+}
+
+/*
+ * Filter 'len' samples of 'cur' against 'ref', and write the result to both.
+ * The differences are clamped to twice the level before working out the weight,
+ * so that all products fit in 16 bits.
+ */
+static void filter(struct denoiser *d, unsigned char *cur, unsigned char *ref, size_t len)
+{
+	int limit = 2 * d->level, slope = d->slope;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128(), min_weight = _mm_set1_epi16(DENOISE_MIN_WEIGHT),
+		round = _mm_set1_epi16(8), limits = _mm_set1_epi16(limit), slopes = _mm_set1_epi16(slope);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *) (cur + i)),
+			r = _mm_loadu_si128((const __m128i *) (ref + i)), out[2];
+
+		for (int half = 0; half < 2; half++) {
+			__m128i c16 = (half ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero)),
+				r16 = (half ? _mm_unpackhi_epi8(r, zero) : _mm_unpacklo_epi8(r, zero)),
+				diff = _mm_sub_epi16(c16, r16),
+				neg = _mm_srai_epi16(diff, 15),
+				ad = _mm_sub_epi16(_mm_xor_si128(diff, neg), neg),
+				weight, step;
+
+			weight = _mm_add_epi16(min_weight,
+					_mm_srli_epi16(_mm_mullo_epi16(_mm_min_epi16(ad, limits), slopes), 8));
+			step = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(ad, weight), round), 4);
+			out[half] = _mm_add_epi16(r16, _mm_sub_epi16(_mm_xor_si128(step, neg), neg));
+		}
+
+		c = _mm_packus_epi16(out[0], out[1]);
+		_mm_storeu_si128((__m128i *) (cur + i), c);
+		_mm_storeu_si128((__m128i *) (ref + i), c);
+	}
+#endif
+
+	for (; i < len; i++) {
+		int diff = cur[i] - ref[i], ad = (diff < 0 ? -diff : diff),
+			weight = DENOISE_MIN_WEIGHT + (((ad < limit ? ad : limit) * slope) >> 8),
+			step = (ad * weight + 8) >> 4;
+
+		cur[i] = ref[i] = ref[i] + (diff < 0 ? -step : step);
+	}
+}
+
+/*
+ * Filter a YUYV frame, in place. Call it right after capture, before anyone
+ * else takes a reference to it. When the size changes, it just becomes the new reference.
+ */
+bool denoiser_apply(struct denoiser *d, struct frame *f)
+{
+	size_t len;
+	uint64_t start = metrics_now();
+
+	if (!d || !f || !f->frame_data || f->format != V4L2_PIX_FMT_YUYV)
+		return false;
+
+	len = f->width * f->height * 2;
+	if (f->frame_bytes_used < len)
+		return false;
+
+	trace_begin(TRACE_DENOISE);
+	if (!d->ref || f->width != d->width || f->height != d->height) {
+		free(d->ref);
+		d->ref = ec_malloc(len);
+		d->width = f->width;
+		d->height = f->height;
+		memcpy(d->ref, f->frame_data, len);
+	} else {
+		filter(d, f->frame_data, d->ref, len);
+	}
+	trace_end(TRACE_DENOISE);
+	metrics_observe_since(METRIC_TIME_DENOISE, start);
+
+	return true;
+}
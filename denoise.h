@@ -0,0 +1,32 @@
+/*
+ * denoise.h
+ *
+ * Temporal noise reduction. In low light, sensor noise makes every frame
+ * different from the last one even where nothing moved, and the JPEG encoder
+ * spends most of its bits on it. Every sample is blended with the same one
+ * in the previous (already filtered) frame, the more the closer they are:
+ * small differences are taken as noise and mostly smoothed away, and big ones
+ * as motion, and let through as they are, so that moving things leave no trails.
+ *
+ * It works on YUYV frames, in place, and keeps one reference frame.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef DENOISE_H_
+#define DENOISE_H_
+#include "main.h"
+#include "frame.h"
+
+/* Differences of up to this many levels can be taken as noise */
+#define DENOISE_MAX_LEVEL	64
+
+struct denoiser;
+
+struct denoiser *denoiser_new(unsigned int level);
+void denoiser_free(struct denoiser *);
+
+bool denoiser_apply(struct denoiser *, struct frame *);
+
+#endif /* DENOISE_H_ */
@@ -5,20 +5,301 @@
  *      Author: ajuaristi <a@juaristi.eus>
  */
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <jpeglib.h>
+#include <linux/videodev2.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "main.h"
 #include "utils.h"
+#include "metrics.h"
+#include "pool.h"
+#include "trace.h"
 #include "frame.h"
 
+/* Running sums for struct frame_stats */
+struct frame_analysis {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t sum_squares;
+	uint64_t gradient;
+	uint32_t histogram[FRAME_HISTOGRAM_BINS];
+};
+
+static inline void analyze_luma(struct frame_analysis *a, int y, int prev)
+{
+	a->sum += y;
+	a->sum_squares += y * y;
+	a->gradient += (y > prev ? y - prev : prev - y);
+	a->histogram[y * FRAME_HISTOGRAM_BINS / 256]++;
+}
+
+/*
+ * Add up a row of contiguous lumas, just before libjpeg takes it.
+ */
+static void analyze_row(struct frame_analysis *a, const unsigned char *row, size_t width)
+{
+	size_t x = 0;
+
+	if (!a || !width)
+		return;
+	a->count += width;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = _mm_setzero_si128(), squares = _mm_setzero_si128(),
+		gradient = _mm_setzero_si128(), v, lo, hi;
+
+	/* Every lane of 'squares' takes at most 4 * 255^2 per iteration, so it won't overflow a row */
+	for (; x + 17 <= width; x += 16) {
+		v = _mm_loadu_si128((const __m128i *) (row + x));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+		gradient = _mm_add_epi64(gradient,
+				_mm_sad_epu8(v, _mm_loadu_si128((const __m128i *) (row + x + 1))));
+
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		squares = _mm_add_epi32(squares,
+				_mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+
+		for (int i = 0; i < 16; i++)
+			a->histogram[row[x + i] * FRAME_HISTOGRAM_BINS / 256]++;
+	}
+
+	a->sum += _mm_cvtsi128_si64(sum) + _mm_cvtsi128_si64(_mm_srli_si128(sum, 8));
+	a->gradient += _mm_cvtsi128_si64(gradient) + _mm_cvtsi128_si64(_mm_srli_si128(gradient, 8));
+	squares = _mm_add_epi64(_mm_unpacklo_epi32(squares, zero), _mm_unpackhi_epi32(squares, zero));
+	a->sum_squares += _mm_cvtsi128_si64(squares) + _mm_cvtsi128_si64(_mm_srli_si128(squares, 8));
+#endif
+
+	for (; x < width; x++)
+		analyze_luma(a, row[x], (x + 1 < width ? row[x + 1] : row[x]));
+}
+
+static void finish_analysis(const struct frame_analysis *a, struct frame_stats *stats)
+{
+	double variance;
+
+	memset(stats, 0, sizeof(struct frame_stats));
+	if (!a->count)
+		return;
+
+	stats->valid = true;
+	stats->luma = (double) a->sum / a->count;
+	variance = (double) a->sum_squares / a->count - stats->luma * stats->luma;
+	stats->contrast = (variance > 0 ? sqrt(variance) : 0);
+	stats->sharpness = (double) a->gradient / a->count;
+	stats->blank = (stats->contrast < FRAME_BLANK_CONTRAST);
+	memcpy(stats->histogram, a->histogram, sizeof(stats->histogram));
+}
+
+/*
+ * Planar 4:2:0 frames are handed to libjpeg as they are, since that's
+ * its default subsampling anyway. It wants whole MCUs (16x16 luma samples)
+ * at a time: rows past the bottom just repeat the last one, and if the width
+ * isn't a multiple of 16, rows are copied into a padded line first.
+ */
+static void write_raw_yuv420(struct jpeg_compress_struct *info, const unsigned char *data,
+		size_t width, size_t height, struct frame_analysis *a)
+{
+	JSAMPROW rows[3][2 * DCTSIZE];
+	JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+	size_t cwidth = width / 2, cheight = height / 2,
+		padded = (width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1), row;
+	const unsigned char *plane[3] = {
+		data,
+		data + width * height,
+		data + width * height + cwidth * cheight
+	};
+	unsigned char *pad = NULL, *line;
+
+	if (padded != width)
+		pad = pool_alloc(padded * 2 * DCTSIZE * 2);
+
+	while (info->next_scanline < info->image_height) {
+		line = pad;
+
+		for (int c = 0; c < 3; c++) {
+			size_t w = (c ? cwidth : width), h = (c ? cheight : height),
+				pw = (c ? padded / 2 : padded), n = (c ? DCTSIZE : 2 * DCTSIZE);
+
+			for (size_t i = 0; i < n; i++) {
+				row = (c ? info->next_scanline / 2 : info->next_scanline) + i;
+				if (row >= h)
+					row = h - 1;
+				else if (!c)
+					analyze_row(a, plane[0] + row * w, w);
+
+				rows[c][i] = (JSAMPROW) plane[c] + row * w;
+				if (pad) {
+					memcpy(line, rows[c][i], w);
+					memset(line + w, line[w - 1], pw - w);
+					rows[c][i] = line;
+					line += pw;
+				}
+			}
+		}
+
+		jpeg_write_raw_data(info, planes, 2 * DCTSIZE);
+	}
+
+	pool_unref(pad);
+}
+
+/*
+ * Copy the lumas of a YUYV row into 'out'.
+ */
+static void extract_luma(const unsigned char *in, unsigned char *out, size_t width)
+{
+	size_t x = 0;
+
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi16(0xff);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (in + x * 2)),
+			b = _mm_loadu_si128((const __m128i *) (in + x * 2 + 16));
+
+		_mm_storeu_si128((__m128i *) (out + x),
+				_mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+	}
+#endif
+
+	for (; x < width; x++)
+		out[x] = in[x * 2];
+}
+
+/*
+ * Grayscale JPEGs only take the luma. Planar frames already have it
+ * all together, so their rows are handed to libjpeg as they are.
+ */
+static void write_luma(struct jpeg_compress_struct *info, const unsigned char *data,
+		size_t width, size_t height, int format, struct frame_analysis *a)
+{
+	JSAMPROW rows[2 * DCTSIZE];
+	unsigned char *line;
+	unsigned int n;
+
+	if (format == V4L2_PIX_FMT_YUV420) {
+		while (info->next_scanline < info->image_height) {
+			for (n = 0; n < 2 * DCTSIZE && info->next_scanline + n < height; n++) {
+				rows[n] = (JSAMPROW) data + (info->next_scanline + n) * width;
+				analyze_row(a, rows[n], width);
+			}
+			jpeg_write_scanlines(info, rows, n);
+		}
+		return;
+	}
+
+	line = pool_alloc(width);
+	while (info->next_scanline < info->image_height) {
+		extract_luma(data + info->next_scanline * width * 2, line, width);
+		analyze_row(a, line, width);
+		jpeg_write_scanlines(info, (JSAMPARRAY) &line, 1);
+	}
+	pool_unref(line);
+}
+
+struct jpeg_preset_desc {
+	const char *name;
+	J_DCT_METHOD dct_method;
+	/* Work out Huffman tables for every picture, which takes a second pass over it */
+	bool optimize_coding;
+	/* Luma samples for every chroma sample, horizontally and vertically */
+	int h_samp;
+	int v_samp;
+	/* Restart markers every this many MCU rows, or none */
+	int restart_rows;
+};
+
+/*
+ * 'default' is what jpeg_set_defaults() gives. 'fastest' trades some accuracy in the DCT
+ * for speed, and 'streaming' also adds a restart marker every MCU row, so that a broken byte
+ * only ruins a strip of the picture. 'quality' keeps all the chroma (4:4:4), with the
+ * floating point DCT. 'smallest' is the default with optimized Huffman tables, for metered links.
+ */
+static const struct jpeg_preset_desc jpeg_presets[JPEG_PRESET_COUNT] = {
+	[JPEG_PRESET_DEFAULT]   = { "default",   JDCT_ISLOW, false, 2, 2, 0 },
+	[JPEG_PRESET_FASTEST]   = { "fastest",   JDCT_IFAST, false, 2, 2, 0 },
+	[JPEG_PRESET_STREAMING] = { "streaming", JDCT_IFAST, false, 2, 2, 1 },
+	[JPEG_PRESET_QUALITY]   = { "quality",   JDCT_FLOAT, true,  1, 1, 0 },
+	[JPEG_PRESET_SMALLEST]  = { "smallest",  JDCT_ISLOW, true,  2, 2, 0 }
+};
+
+const char *frame_jpeg_preset_name(enum jpeg_preset preset)
+{
+	return (preset >= 0 && preset < JPEG_PRESET_COUNT ? jpeg_presets[preset].name : NULL);
+}
+
+/*
+ * Whether the preset keeps all the chroma (4:4:4), which frames
+ * already subsampled to 4:2:0 can't give it.
+ */
+bool frame_jpeg_preset_full_chroma(enum jpeg_preset preset)
+{
+	return (preset >= 0 && preset < JPEG_PRESET_COUNT &&
+			jpeg_presets[preset].h_samp == 1 && jpeg_presets[preset].v_samp == 1);
+}
+
+bool frame_jpeg_preset_find(const char *name, enum jpeg_preset *preset)
+{
+	if (!name || !preset)
+		return false;
+
+	for (int i = 0; i < JPEG_PRESET_COUNT; i++) {
+		if (strcmp(jpeg_presets[i].name, name) == 0) {
+			*preset = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Call after jpeg_set_defaults(). Raw 4:2:0 data has to go out as 4:2:0,
+ * and grayscale has no chroma, so subsampling is only changed for YUYV.
+ */
+static void set_jpeg_preset(struct jpeg_compress_struct *info, enum jpeg_preset preset, int format)
+{
+	const struct jpeg_preset_desc *p =
+			&jpeg_presets[preset >= 0 && preset < JPEG_PRESET_COUNT ? preset : JPEG_PRESET_DEFAULT];
+
+	info->dct_method = p->dct_method;
+	info->optimize_coding = p->optimize_coding;
+	info->restart_in_rows = p->restart_rows;
+
+	if (info->num_components == 3 && format != V4L2_PIX_FMT_YUV420) {
+		info->comp_info[0].h_samp_factor = p->h_samp;
+		info->comp_info[0].v_samp_factor = p->v_samp;
+	}
+}
+
+static void start_compress(struct jpeg_compress_struct *info, const struct jpeg_params *params)
+{
+	jpeg_start_compress(info, true);
+	if (params->comment && params->comment_len)
+		jpeg_write_marker(info, JPEG_COM, params->comment, params->comment_len);
+}
+
 static void convert_to_jpeg(const unsigned char *data_in, size_t len_in,
-		size_t width, size_t height,
-		unsigned char **data_out, size_t *len_out)
+		size_t width, size_t height, int format,
+		const struct jpeg_params *params,
+		unsigned char **data_out, size_t *len_out,
+		struct frame_stats *stats)
 {
-#define JPEG_QUALITY 95
 	struct jpeg_compress_struct info;
 	struct jpeg_error_mgr error;
-	unsigned char *line = ec_malloc(width * 3), *ptr;
+	struct frame_analysis analysis, *a = NULL;
+	unsigned char *line, *ptr;
+
+	if (params->analyze) {
+		memset(&analysis, 0, sizeof(analysis));
+		a = &analysis;
+	}
 
 	info.err = jpeg_std_error(&error);
 	jpeg_create_compress(&info);
@@ -26,17 +307,32 @@ static void convert_to_jpeg(const unsigned char *data_in, size_t len_in,
 
 	info.image_width = width;
 	info.image_height = height;
-	info.input_components = 3;
-	info.in_color_space = JCS_YCbCr;
+	info.input_components = (params->grayscale ? 1 : 3);
+	info.in_color_space = (params->grayscale ? JCS_GRAYSCALE : JCS_YCbCr);
 
 	jpeg_set_defaults(&info);
-	jpeg_set_quality(&info, JPEG_QUALITY, true);
+	jpeg_set_quality(&info, params->quality, true);
+	set_jpeg_preset(&info, params->preset, format);
 
-	jpeg_start_compress(&info, true);
+	if (params->grayscale) {
+		start_compress(&info, params);
+		write_luma(&info, data_in, width, height, format, a);
+		goto end;
+	}
+
+	if (format == V4L2_PIX_FMT_YUV420) {
+		info.raw_data_in = true;
+		start_compress(&info, params);
+		write_raw_yuv420(&info, data_in, width, height, a);
+		goto end;
+	}
+
+	line = pool_alloc(width * 3);
+	start_compress(&info, params);
 	while (info.next_scanline < info.image_height) {
 		ptr = line;
 
-		for (int x = 0, z = 0; x < width; x++) {
+		for (int x = 0, z = 0, prev = data_in[0]; x < width; x++) {
 			int y, u, v;
 
 			y = (z == 0 ? data_in[0] : data_in[2]);
@@ -47,6 +343,11 @@ static void convert_to_jpeg(const unsigned char *data_in, size_t len_in,
 			*(ptr++) = u;
 			*(ptr++) = v;
 
+			if (a) {
+				analyze_luma(a, y, prev);
+				prev = y;
+			}
+
 			if (z++) {
 				z = 0;
 				data_in += 4;
@@ -55,44 +356,467 @@ static void convert_to_jpeg(const unsigned char *data_in, size_t len_in,
 
 		jpeg_write_scanlines(&info, (JSAMPARRAY) &line, 1);
 	}
+	pool_unref(line);
+	if (a)
+		a->count = (uint64_t) width * height;
 
+end:
 	jpeg_finish_compress(&info);
 	jpeg_destroy_compress(&info);
 
-	free(line);
-#undef JPEG_QUALITY
+	if (a)
+		finish_analysis(a, stats);
+	else
+		stats->valid = false;
 }
 
 /*
- * Overwrite 'frame_data' with the new image data in JPEG,
+ * Replace 'frame_data' with the new image data in JPEG,
  * and also overwrite 'frame_bytes_used' accordingly.
- * We assume a JPEG image will always need less space than a YUYV one,
- * so we shouldn't need to realloc 'frame_data', but we account for this
- * just in case.
+ * libjpeg writes straight into a new pool buffer as big as the YUYV one,
+ * which is swapped in afterwards. We assume a JPEG image will always
+ * need less space than a YUYV one, but if it didn't fit
+ * libjpeg will have malloc'ed a bigger buffer, and we copy from that.
+ *
+ * Frames scaled down to planar 4:2:0 by frame_scale() are taken as well,
+ * and are cheaper to encode, since libjpeg doesn't have to subsample them.
+ * In grayscale, only the luma is encoded, which is cheaper still.
+ * With 'analyze', the frame's 'stats' are filled in on the way.
  */
-void frame_convert_yuyv_to_jpeg(struct frame *f)
+void frame_convert_yuyv_to_jpeg_ext(struct frame *f, const struct jpeg_params *params)
 {
-	/* jpeglib expects these values initialized */
-	unsigned char *jpeg_frame = NULL;
-	size_t jpeg_frame_len = 0;
+	unsigned char *out, *jpeg_frame;
+	size_t jpeg_frame_len;
+	uint64_t start = metrics_now();
 
-	if (!f || !f->frame_data || !f->frame_bytes_used || !f->frame_size || !f->width || !f->height)
+	if (!f || !f->frame_data || !f->frame_bytes_used || !f->frame_size || !f->width || !f->height ||
+			!params)
 		return;
 
+	trace_begin(TRACE_ENCODE);
+	out = jpeg_frame = pool_alloc(f->frame_size);
+	jpeg_frame_len = pool_capacity(out);
+
 	convert_to_jpeg(f->frame_data, f->frame_bytes_used,
-			f->width, f->height,
-			&jpeg_frame, &jpeg_frame_len);
+			f->width, f->height, f->format,
+			params,
+			&jpeg_frame, &jpeg_frame_len,
+			&f->stats);
+
+	metrics_inc(METRIC_FRAMES_ENCODED);
+	metrics_add(METRIC_BYTES_RAW, f->frame_bytes_used);
+	metrics_add(METRIC_BYTES_JPEG, jpeg_frame_len);
+
+	if (jpeg_frame != out) {
+		/* Didn't fit */
+		pool_unref(out);
+		out = pool_alloc(jpeg_frame_len);
+		memcpy(out, jpeg_frame, jpeg_frame_len);
+		free(jpeg_frame);
+	}
+
+	pool_unref(f->frame_data);
+	f->frame_data = out;
+	f->frame_size = pool_capacity(out);
+	f->frame_bytes_used = jpeg_frame_len;
+
+	trace_end(TRACE_ENCODE);
+	metrics_observe_since(METRIC_TIME_ENCODE, start);
+}
+
+void frame_convert_yuyv_to_jpeg(struct frame *f)
+{
+	struct jpeg_params params = {
+		.quality = JPEG_DEFAULT_QUALITY
+	};
 
-	if (jpeg_frame_len <= f->frame_size) {
-		memcpy(f->frame_data, jpeg_frame, jpeg_frame_len);
-		f->frame_bytes_used = jpeg_frame_len;
+	frame_convert_yuyv_to_jpeg_ext(f, &params);
+}
+
+/*
+ * Make sure we're the only owners of 'frame_data' before writing into it.
+ * If some other stage still holds a reference to it, we leave it to them
+ * and get a fresh buffer of the same size from the pool.
+ */
+void frame_make_writable(struct frame *f)
+{
+	if (f->frame_data && pool_is_shared(f->frame_data)) {
+		pool_unref(f->frame_data);
+		f->frame_data = pool_alloc(f->frame_size);
+		f->frame_bytes_used = 0;
+	}
+}
+
+/*
+ * Downscaling
+ *
+ * Halving is a 2x2 box filter, and does most of the work: 1/2 and 1/4
+ * are just that, and any other ratio halves as long as the target is at most
+ * half the size, and finishes with a bilinear filter. That way every source
+ * pixel counts, and small targets don't alias. The inner loops use SSE2
+ * where available, and plain C elsewhere, with the very same rounding.
+ *
+ * All the intermediate images are pool buffers too.
+ */
+static inline unsigned char avg2(unsigned int a, unsigned int b)
+{
+	return (a + b + 1) >> 1;
+}
+
+static inline unsigned char lerp(unsigned int a, unsigned int b, unsigned int w)
+{
+	return (a * (256 - w) + b * w + 128) >> 8;
+}
+
+/*
+ * Average two YUYV rows into one with half the pixels. Each output macropixel
+ * (two pixels) comes from two input ones: lumas are averaged in pairs,
+ * and so are the chromas, which belong to the two input macropixels.
+ */
+static void halve_rows_yuyv(const unsigned char *r0, const unsigned char *r1,
+		unsigned char *out, size_t out_width)
+{
+	size_t x = 0;
+	unsigned char a[8];
+
+#ifdef __SSE2__
+	const __m128i luma_mask = _mm_set1_epi16(0xff), even_mask = _mm_set1_epi32(0xffff);
+
+	/* 16 input pixels (32 bytes) from each row, into 8 output pixels */
+	for (; x + 8 <= out_width; x += 8, r0 += 32, r1 += 32, out += 16) {
+		__m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) r0),
+				_mm_loadu_si128((const __m128i *) r1)),
+			v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) (r0 + 16)),
+				_mm_loadu_si128((const __m128i *) (r1 + 16)));
+		__m128i y0, y1, c0, c1;
+
+		/* Lumas as 16-bit words, then pairs of them as 32-bit ones */
+		y0 = _mm_and_si128(v0, luma_mask);
+		y1 = _mm_and_si128(v1, luma_mask);
+		y0 = _mm_avg_epu16(_mm_and_si128(y0, even_mask), _mm_srli_epi32(y0, 16));
+		y1 = _mm_avg_epu16(_mm_and_si128(y1, even_mask), _mm_srli_epi32(y1, 16));
+
+		/* Chromas go U V U V ..., so (U0 V0) pairs up with (U1 V1), 32 bits apart */
+		c0 = _mm_shuffle_epi32(_mm_srli_epi16(v0, 8), _MM_SHUFFLE(3, 1, 2, 0));
+		c1 = _mm_shuffle_epi32(_mm_srli_epi16(v1, 8), _MM_SHUFFLE(3, 1, 2, 0));
+		c0 = _mm_avg_epu16(c0, _mm_srli_si128(c0, 8));
+		c1 = _mm_avg_epu16(c1, _mm_srli_si128(c1, 8));
+
+		_mm_storeu_si128((__m128i *) out,
+				_mm_or_si128(_mm_packs_epi32(y0, y1),
+						_mm_slli_epi16(_mm_unpacklo_epi64(c0, c1), 8)));
+	}
+#endif
+
+	for (; x < out_width; x += 2, r0 += 8, r1 += 8, out += 4) {
+		for (int i = 0; i < 8; i++)
+			a[i] = avg2(r0[i], r1[i]);
+
+		out[0] = avg2(a[0], a[2]);
+		out[1] = avg2(a[1], a[5]);
+		out[2] = avg2(a[4], a[6]);
+		out[3] = avg2(a[3], a[7]);
+	}
+}
+
+static void halve_yuyv(const unsigned char *in, size_t width, size_t height,
+		unsigned char *out, size_t out_width, size_t out_height)
+{
+	for (size_t y = 0; y < out_height; y++)
+		halve_rows_yuyv(in + y * 2 * width * 2, in + (y * 2 + 1) * width * 2,
+				out + y * out_width * 2, out_width);
+}
+
+/*
+ * Bilinear filter taps, in 24.8 fixed point. Pixel centers are kept aligned,
+ * as if both images covered the same area.
+ */
+struct scale_tap {
+	unsigned int x0;
+	unsigned int x1;
+	unsigned int w;
+};
+
+static void scale_taps(struct scale_tap *taps, size_t n, size_t src_n)
+{
+	uint64_t step = ((uint64_t) src_n << 16) / n;
+	int64_t pos = step / 2 - 0x8000, p;
+
+	for (size_t i = 0; i < n; i++, pos += step) {
+		p = (pos < 0 ? 0 : pos);
+		taps[i].x0 = p >> 16;
+		taps[i].w = (p >> 8) & 0xff;
+		if (taps[i].x0 >= src_n - 1) {
+			taps[i].x0 = src_n - 1;
+			taps[i].w = 0;
+		}
+		taps[i].x1 = (taps[i].w ? taps[i].x0 + 1 : taps[i].x0);
+	}
+}
+
+static void blend_rows(const unsigned char *r0, const unsigned char *r1, unsigned int w,
+		unsigned char *out, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(128),
+		w0 = _mm_set1_epi16(256 - w), w1 = _mm_set1_epi16(w);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (r0 + i)),
+			b = _mm_loadu_si128((const __m128i *) (r1 + i)),
+			lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+				_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1)),
+			hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+				_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+		_mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+
+	for (; i < len; i++)
+		out[i] = lerp(r0[i], r1[i], w);
+}
+
+/*
+ * Rows are blended vertically first, which vectorizes well, and then
+ * sampled horizontally. Lumas are sampled per pixel, chromas per macropixel.
+ */
+static void bilinear_yuyv(const unsigned char *in, size_t width, size_t height,
+		unsigned char *out, size_t out_width, size_t out_height)
+{
+	/* The taps go right after the blended row, aligned */
+	size_t stride = width * 2, row_size = (stride + 7) & ~7;
+	unsigned char *scratch = pool_alloc(row_size +
+			(out_width + out_width / 2 + out_height) * sizeof(struct scale_tap));
+	struct scale_tap *xtaps = (struct scale_tap *) (scratch + row_size),
+		*ctaps = xtaps + out_width,
+		*ytaps = ctaps + out_width / 2;
+	const struct scale_tap *ya, *yb, *c;
+	const unsigned char *row;
+
+	scale_taps(xtaps, out_width, width);
+	scale_taps(ctaps, out_width / 2, width / 2);
+	scale_taps(ytaps, out_height, height);
+
+	for (size_t y = 0; y < out_height; y++) {
+		row = in + ytaps[y].x0 * stride;
+		if (ytaps[y].w) {
+			blend_rows(row, in + ytaps[y].x1 * stride, ytaps[y].w, scratch, stride);
+			row = scratch;
+		}
+
+		for (size_t x = 0; x < out_width; x += 2, out += 4) {
+			ya = &xtaps[x];
+			yb = &xtaps[x + 1];
+			c = &ctaps[x / 2];
+
+			out[0] = lerp(row[ya->x0 * 2], row[ya->x1 * 2], ya->w);
+			out[1] = lerp(row[c->x0 * 4 + 1], row[c->x1 * 4 + 1], c->w);
+			out[2] = lerp(row[yb->x0 * 2], row[yb->x1 * 2], yb->w);
+			out[3] = lerp(row[c->x0 * 4 + 3], row[c->x1 * 4 + 3], c->w);
+		}
+	}
+
+	pool_unref(scratch);
+}
+
+/*
+ * YUYV to planar 4:2:0 (I420): the lumas are just split off,
+ * and the chromas of every two rows are averaged.
+ */
+static void yuyv_to_yuv420(const unsigned char *in, size_t width, size_t height, unsigned char *out)
+{
+	unsigned char *py = out, *pu = out + width * height, *pv = pu + (width / 2) * (height / 2);
+	const unsigned char *r0, *r1;
+	unsigned char *y0, *y1;
+	size_t x;
+
+	for (size_t y = 0; y < height; y += 2, pu += width / 2, pv += width / 2) {
+		r0 = in + y * width * 2;
+		r1 = r0 + width * 2;
+		y0 = py + y * width;
+		y1 = y0 + width;
+		x = 0;
+
+#ifdef __SSE2__
+		const __m128i mask = _mm_set1_epi16(0xff), zero = _mm_setzero_si128();
+
+		/* 16 pixels at a time */
+		for (; x + 16 <= width; x += 16) {
+			__m128i a0 = _mm_loadu_si128((const __m128i *) (r0 + x * 2)),
+				a1 = _mm_loadu_si128((const __m128i *) (r0 + x * 2 + 16)),
+				b0 = _mm_loadu_si128((const __m128i *) (r1 + x * 2)),
+				b1 = _mm_loadu_si128((const __m128i *) (r1 + x * 2 + 16)),
+				c;
+
+			_mm_storeu_si128((__m128i *) (y0 + x),
+					_mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask)));
+			_mm_storeu_si128((__m128i *) (y1 + x),
+					_mm_packus_epi16(_mm_and_si128(b0, mask), _mm_and_si128(b1, mask)));
+
+			/* U V U V ... */
+			c = _mm_packus_epi16(_mm_srli_epi16(_mm_avg_epu8(a0, b0), 8),
+					_mm_srli_epi16(_mm_avg_epu8(a1, b1), 8));
+			_mm_storel_epi64((__m128i *) (pu + x / 2), _mm_packus_epi16(_mm_and_si128(c, mask), zero));
+			_mm_storel_epi64((__m128i *) (pv + x / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+		}
+#endif
+
+		for (; x < width; x += 2) {
+			y0[x] = r0[x * 2];
+			y0[x + 1] = r0[x * 2 + 2];
+			y1[x] = r1[x * 2];
+			y1[x + 1] = r1[x * 2 + 2];
+			pu[x / 2] = avg2(r0[x * 2 + 1], r1[x * 2 + 1]);
+			pv[x / 2] = avg2(r0[x * 2 + 3], r1[x * 2 + 3]);
+		}
+	}
+}
+
+/*
+ * Scale a YUYV frame down to the width, height and format given in 'out',
+ * which can be V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_YUV420. Its previous data,
+ * if any, is released, and replaced with a new pool buffer.
+ * 'in' is left untouched, so that the camera can keep capturing
+ * at full resolution while we send something cheaper.
+ *
+ * Only downscaling is supported. The target width must be even,
+ * and so must the height for planar frames.
+ */
+bool frame_scale(const struct frame *in, struct frame *out)
+{
+	size_t width, height, half_width;
+	unsigned char *src, *dst;
+	uint64_t start = metrics_now();
+
+	if (!in || !out || !in->frame_data || in->format != V4L2_PIX_FMT_YUYV ||
+			!in->width || !in->height || in->frame_bytes_used < in->width * in->height * 2 ||
+			!out->width || !out->height || out->width > in->width || out->height > in->height ||
+			out->width % 2 ||
+			(out->format != V4L2_PIX_FMT_YUYV && out->format != V4L2_PIX_FMT_YUV420) ||
+			(out->format == V4L2_PIX_FMT_YUV420 && out->height % 2))
+		return false;
+
+	trace_begin(TRACE_SCALE);
+	src = pool_ref(in->frame_data);
+	width = in->width;
+	height = in->height;
+
+	for (half_width = (width / 2) & ~1;
+			out->width <= half_width && out->height <= height / 2;
+			half_width = (width / 2) & ~1) {
+		dst = pool_alloc(half_width * (height / 2) * 2);
+		halve_yuyv(src, width, height, dst, half_width, height / 2);
+		pool_unref(src);
+		src = dst;
+		width = half_width;
+		height /= 2;
+	}
+
+	if (width != out->width || height != out->height) {
+		dst = pool_alloc(out->width * out->height * 2);
+		bilinear_yuyv(src, width, height, dst, out->width, out->height);
+		pool_unref(src);
+		src = dst;
+	}
+
+	if (out->format == V4L2_PIX_FMT_YUV420) {
+		dst = pool_alloc(out->width * out->height * 3 / 2);
+		yuyv_to_yuv420(src, out->width, out->height, dst);
+		pool_unref(src);
+		src = dst;
+		out->frame_bytes_used = out->width * out->height * 3 / 2;
+	} else {
+		out->frame_bytes_used = out->width * out->height * 2;
+	}
+
+	pool_unref(out->frame_data);
+	out->frame_data = src;
+	out->frame_size = pool_capacity(src);
+	out->capture_time = in->capture_time;
+	out->stats.valid = false;
+
+	trace_end(TRACE_SCALE);
+	metrics_observe_since(METRIC_TIME_SCALE, start);
+	return true;
+}
+
+/*
+ * Sum of the absolute deviations of 'len' chroma bytes from neutral.
+ * In YUYV, 'step' is 2, and every chroma byte comes after a luma byte.
+ */
+static uint64_t chroma_deviation(const unsigned char *p, size_t len, size_t step)
+{
+	uint64_t sum = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i neutral = _mm_set1_epi8((char) 128), luma_mask = _mm_set1_epi16(0xff);
+	__m128i acc = _mm_setzero_si128(), v;
+
+	/*
+	 * In YUYV, lumas are replaced with a neutral value first,
+	 * so that they don't add up to anything.
+	 */
+	for (; i + 16 <= len * step; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (p + i));
+		if (step == 2)
+			v = _mm_or_si128(_mm_andnot_si128(luma_mask, v), _mm_and_si128(luma_mask, neutral));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, neutral));
+	}
+	sum = _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_srli_si128(acc, 8));
+#endif
+
+	for (i += (step - 1); i < len * step; i += step)
+		sum += (p[i] > 128 ? p[i] - 128 : 128 - p[i]);
+
+	return sum;
+}
+
+/* Rows looked at to tell whether a picture has colour */
+#define GRAYSCALE_ROW_STEP	4
+
+/*
+ * Tells whether a picture has no colour to speak of (eg. from an IR camera
+ * at night), so that its chroma can be left out. Only one in every
+ * GRAYSCALE_ROW_STEP rows is looked at, which is plenty for this.
+ */
+bool frame_is_grayscale(const struct frame *f)
+{
+	const unsigned char *chroma;
+	uint64_t sum = 0, count = 0;
+	size_t cwidth, cheight;
+
+	if (!f || !f->frame_data || !f->width || !f->height)
+		return false;
+
+	if (f->format == V4L2_PIX_FMT_YUYV) {
+		if (f->frame_bytes_used < f->width * f->height * 2)
+			return false;
+
+		for (size_t y = 0; y < f->height; y += GRAYSCALE_ROW_STEP) {
+			sum += chroma_deviation(f->frame_data + y * f->width * 2, f->width, 2);
+			count += f->width;
+		}
+	} else if (f->format == V4L2_PIX_FMT_YUV420) {
+		cwidth = f->width / 2;
+		cheight = f->height / 2;
+		if (f->frame_bytes_used < f->width * f->height + cwidth * cheight * 2)
+			return false;
+
+		/* Both chroma planes, one after the other */
+		chroma = f->frame_data + f->width * f->height;
+		for (size_t y = 0; y < cheight * 2; y += GRAYSCALE_ROW_STEP) {
+			sum += chroma_deviation(chroma + y * cwidth, cwidth, 1);
+			count += cwidth;
+		}
 	} else {
-		/* We need to realloc */
-		free(f->frame_data);
-		f->frame_data = ec_malloc_fill(jpeg_frame_len, (char *) jpeg_frame);
-		f->frame_size = jpeg_frame_len;
-		f->frame_bytes_used = jpeg_frame_len;
+		return false;
 	}
 
-	free(jpeg_frame);
+	return (count && sum <= count * FRAME_NEUTRAL_CHROMA);
 }
@@ -7,7 +7,9 @@
 
 #ifndef FRAME_H_
 #define FRAME_H_
+#include <stdint.h>
 #include <time.h>
+#include "main.h"
 
 enum frame_format {
 	FRAME_FORMAT_FIRST,
@@ -21,6 +23,68 @@ enum frame_format {
 #define DEFAULT_WIDTH	320
 #define DEFAULT_HEIGHT	240
 
+#define JPEG_DEFAULT_QUALITY	95
+
+/*
+ * Mean absolute deviation of the chroma from neutral (128),
+ * under which a picture is considered to have no colour at all.
+ */
+#define FRAME_NEUTRAL_CHROMA	3
+
+/*
+ * Encoder settings, from the quickest to encode to the smallest output:
+ * DCT method, Huffman tables, chroma subsampling and restart markers.
+ * Planar 4:2:0 frames are always encoded as 4:2:0. See frame.c for what each one does.
+ */
+enum jpeg_preset {
+	JPEG_PRESET_DEFAULT,
+	JPEG_PRESET_FASTEST,
+	JPEG_PRESET_STREAMING,
+	JPEG_PRESET_QUALITY,
+	JPEG_PRESET_SMALLEST,
+	JPEG_PRESET_COUNT
+};
+
+/* Knobs for the JPEG encoder */
+struct jpeg_params {
+	int quality;
+	enum jpeg_preset preset;
+	/* Encode the luma only, as a single-component JPEG */
+	bool grayscale;
+	/* Fill in the frame's 'stats' while encoding it */
+	bool analyze;
+	/* If not NULL, written into the JPEG as a comment (COM marker) */
+	const unsigned char *comment;
+	size_t comment_len;
+};
+
+#define FRAME_HISTOGRAM_BINS	16
+/* Luma standard deviation under which the picture is blank (eg. the lens is covered) */
+#define FRAME_BLANK_CONTRAST	6
+
+/*
+ * What the picture looks like. It's worked out on the same pass
+ * that feeds the encoder, while the rows are still in cache.
+ */
+struct frame_stats {
+	bool valid;
+	/* Mean luma, and its standard deviation */
+	double luma;
+	double contrast;
+	/* Mean absolute difference between neighbouring lumas. Blurry pictures score low */
+	double sharpness;
+	bool blank;
+	/* Lumas, in bins of 256 / FRAME_HISTOGRAM_BINS, for exposure alarms */
+	uint32_t histogram[FRAME_HISTOGRAM_BINS];
+};
+
+/*
+ * 'frame_data' is a buffer from the frame pool (see pool.h).
+ * Stages that need to hold on to it take their own reference with pool_ref().
+ *
+ * 'format' is a V4L2 pixel format: V4L2_PIX_FMT_YUYV as captured,
+ * or V4L2_PIX_FMT_YUV420 (planar 4:2:0) when given by frame_scale().
+ */
 struct frame {
 	size_t frame_size;
 	size_t frame_bytes_used;
@@ -29,8 +93,18 @@ struct frame {
 	size_t width;
 	size_t height;
 	int format;
+	struct frame_stats stats;
 };
 
 void frame_convert_yuyv_to_jpeg(struct frame *);
+void frame_convert_yuyv_to_jpeg_ext(struct frame *, const struct jpeg_params *);
+void frame_make_writable(struct frame *);
+
+const char *frame_jpeg_preset_name(enum jpeg_preset);
+bool frame_jpeg_preset_find(const char *name, enum jpeg_preset *);
+bool frame_jpeg_preset_full_chroma(enum jpeg_preset);
+
+bool frame_scale(const struct frame *in, struct frame *out);
+bool frame_is_grayscale(const struct frame *);
 
 #endif /* FRAME_H_ */
@@ -0,0 +1,516 @@
+/*
+ * framebus.c
+ *
+ * A shared-memory bus to hand frames to other local processes.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "utils.h"
+#include "reactor.h"
+#include "framebus.h"
+
+#define FRAMEBUS_MAGIC		0x41424642	/* "ABFB" */
+#define FRAMEBUS_VERSION	1
+#define FRAMEBUS_ALIGN		64
+
+#define ALIGN_UP(n)	(((n) + FRAMEBUS_ALIGN - 1) & ~((size_t) FRAMEBUS_ALIGN - 1))
+
+/*
+ * Everything below lives in the shared memory. Consumers keep their
+ * cursors here, so that the publisher can tell how far behind they are.
+ */
+struct framebus_consumer {
+	atomic_int pid;
+	_Atomic uint64_t cursor;
+	_Atomic uint64_t lost;
+};
+
+struct framebus_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t reserved;
+	uint64_t slot_size;
+	uint64_t slot_stride;
+	/* Frames published so far. Frame 'n' goes in slot 'n % slots' */
+	_Atomic uint64_t head;
+	/* Bumped on every frame. Consumers with nothing to read sleep on it */
+	_Atomic uint32_t futex;
+	_Atomic uint32_t waiters;
+	struct framebus_consumer consumers[FRAMEBUS_MAX_CONSUMERS];
+};
+
+struct framebus_slot {
+	/* 2n + 1 while frame 'n' is being written, and 2n + 2 once it's there */
+	_Atomic uint64_t seq;
+	uint32_t stream;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	int64_t sec;
+	int64_t usec;
+	uint64_t len;
+	/* The data comes next, at FRAMEBUS_ALIGN */
+};
+
+struct framebus {
+	struct framebus_header *hdr;
+	size_t size;
+	int memfd;
+	/*
+	 * Our own copy of the geometry in 'hdr'. Everyone who has the bus
+	 * can write into the header, so it's only read once, and checked.
+	 */
+	unsigned int slots;
+	size_t slot_size;
+	size_t slot_stride;
+	/* Publisher */
+	int sock;
+	char *path;
+	struct reactor *r;
+	/* Consumer */
+	struct framebus_consumer *me;
+	uint64_t cursor;
+	uint64_t lost;
+};
+
+static inline struct framebus_slot *framebus_slot(struct framebus *bus, uint64_t n)
+{
+	return (struct framebus_slot *) ((unsigned char *) bus->hdr + ALIGN_UP(sizeof(struct framebus_header)) +
+			(n % bus->slots) * bus->slot_stride);
+}
+
+static inline const unsigned char *framebus_slot_data(struct framebus_slot *slot)
+{
+	return (const unsigned char *) slot + ALIGN_UP(sizeof(struct framebus_slot));
+}
+
+static int futex(_Atomic uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+	/* Not FUTEX_PRIVATE_FLAG: the waiters are in other processes */
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static bool framebus_map(struct framebus *bus, size_t size)
+{
+	bus->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, bus->memfd, 0);
+	if (bus->hdr == MAP_FAILED) {
+		bus->hdr = NULL;
+		return false;
+	}
+
+	bus->size = size;
+	return true;
+}
+
+static bool framebus_address(const char *path, struct sockaddr_un *addr)
+{
+	if (!path || strlen(path) >= sizeof(addr->sun_path))
+		return false;
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+static struct framebus *framebus_new()
+{
+	struct framebus *bus = ec_malloc(sizeof(struct framebus));
+
+	bus->memfd = -1;
+	bus->sock = -1;
+	return bus;
+}
+
+/*
+ * Create a bus with 'slots' slots of 'slot_size' bytes each, which
+ * consumers can get from the UNIX socket at 'path'. Frames bigger than that
+ * are not published.
+ */
+struct framebus *framebus_create(const char *path, unsigned int slots, size_t slot_size)
+{
+	struct framebus *bus;
+	struct sockaddr_un addr;
+	size_t stride, size;
+
+	if (!framebus_address(path, &addr) || slots < 2 || !slot_size)
+		return NULL;
+
+	bus = framebus_new();
+	stride = ALIGN_UP(sizeof(struct framebus_slot)) + ALIGN_UP(slot_size);
+	size = ALIGN_UP(sizeof(struct framebus_header)) + slots * stride;
+
+	bus->memfd = memfd_create("appbase-cctv-framebus", MFD_CLOEXEC);
+	if (bus->memfd == -1 || ftruncate(bus->memfd, size) == -1 || !framebus_map(bus, size))
+		goto fail;
+
+	/* ftruncate(2) gave us zeroes */
+	bus->hdr->magic = FRAMEBUS_MAGIC;
+	bus->hdr->version = FRAMEBUS_VERSION;
+	bus->hdr->slots = slots;
+	bus->hdr->slot_size = slot_size;
+	bus->hdr->slot_stride = stride;
+	bus->slots = slots;
+	bus->slot_size = slot_size;
+	bus->slot_stride = stride;
+
+	bus->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (bus->sock == -1)
+		goto fail;
+
+	/* Some previous run might have left it behind */
+	unlink(path);
+	if (bind(bus->sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+			listen(bus->sock, SOMAXCONN) == -1)
+		goto fail;
+	bus->path = strdup(path);
+
+	return bus;
+
+fail:
+	framebus_close(bus);
+	return NULL;
+}
+
+/*
+ * Every consumer that connects gets the memfd, and that's it.
+ */
+static void framebus_accept(int fd, uint32_t events, void *userdata)
+{
+	struct framebus *bus = userdata;
+	char buf[CMSG_SPACE(sizeof(int))], byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int conn;
+
+	while ((conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+		memset(&msg, 0, sizeof(msg));
+		memset(buf, 0, sizeof(buf));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = buf;
+		msg.msg_controllen = sizeof(buf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &bus->memfd, sizeof(int));
+
+		if (sendmsg(conn, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+			fprintf(stderr, "ERROR: Could not hand the frame bus to a consumer\n");
+		close(conn);
+	}
+}
+
+bool framebus_attach_reactor(struct framebus *bus, struct reactor *r)
+{
+	if (!bus || bus->sock == -1 || !r || bus->r)
+		return false;
+
+	if (!reactor_add_fd(r, bus->sock, EPOLLIN, framebus_accept, bus))
+		return false;
+
+	bus->r = r;
+	return true;
+}
+
+/*
+ * Copy a frame into the next slot, whoever might be reading it.
+ * Consumers will notice, thanks to the sequence numbers.
+ */
+bool framebus_publish(struct framebus *bus, uint32_t stream, uint32_t format, const struct frame *f)
+{
+	struct framebus_slot *slot;
+	uint64_t n;
+
+	if (!bus || !bus->path || !f || !f->frame_data || !f->frame_bytes_used ||
+			f->frame_bytes_used > bus->slot_size)
+		return false;
+
+	n = atomic_load_explicit(&bus->hdr->head, memory_order_relaxed);
+	slot = framebus_slot(bus, n);
+
+	atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->stream = stream;
+	slot->format = format;
+	slot->width = f->width;
+	slot->height = f->height;
+	slot->sec = f->capture_time.tv_sec;
+	slot->usec = f->capture_time.tv_usec;
+	slot->len = f->frame_bytes_used;
+	memcpy((unsigned char *) framebus_slot_data(slot), f->frame_data, f->frame_bytes_used);
+
+	atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+	atomic_store_explicit(&bus->hdr->head, n + 1, memory_order_release);
+
+	/* Only bother the kernel if somebody is asleep */
+	atomic_fetch_add_explicit(&bus->hdr->futex, 1, memory_order_release);
+	if (atomic_load(&bus->hdr->waiters))
+		futex(&bus->hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+
+	return true;
+}
+
+static bool framebus_alive(int pid)
+{
+	return (pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH));
+}
+
+/*
+ * Returns how many consumers there are, and in 'max_lag',
+ * how many frames the slowest one has yet to read.
+ */
+unsigned int framebus_consumers(struct framebus *bus, uint64_t *max_lag)
+{
+	struct framebus_consumer *c;
+	unsigned int count = 0;
+	uint64_t head, cursor, lag = 0;
+
+	if (!bus || !bus->hdr)
+		return 0;
+
+	head = atomic_load(&bus->hdr->head);
+	for (int i = 0; i < FRAMEBUS_MAX_CONSUMERS; i++) {
+		c = &bus->hdr->consumers[i];
+		if (!framebus_alive(atomic_load(&c->pid)))
+			continue;
+
+		count++;
+		cursor = atomic_load(&c->cursor);
+		if (head > cursor && head - cursor > lag)
+			lag = head - cursor;
+	}
+
+	if (max_lag)
+		*max_lag = lag;
+	return count;
+}
+
+static int framebus_receive_fd(int sock)
+{
+	char buf[CMSG_SPACE(sizeof(int))], byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return fd;
+}
+
+/*
+ * Join the bus published at 'path'. We start with the next frame published.
+ */
+struct framebus *framebus_connect(const char *path)
+{
+	struct framebus *bus;
+	struct framebus_consumer *c;
+	struct sockaddr_un addr;
+	struct stat st;
+	int sock, pid;
+
+	if (!framebus_address(path, &addr))
+		return NULL;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return NULL;
+
+	bus = framebus_new();
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		goto fail;
+
+	bus->memfd = framebus_receive_fd(sock);
+	if (bus->memfd == -1 || fstat(bus->memfd, &st) == -1 ||
+			st.st_size < (off_t) sizeof(struct framebus_header) ||
+			!framebus_map(bus, st.st_size))
+		goto fail;
+
+	if (bus->hdr->magic != FRAMEBUS_MAGIC || bus->hdr->version != FRAMEBUS_VERSION)
+		goto fail;
+
+	bus->slots = bus->hdr->slots;
+	bus->slot_size = bus->hdr->slot_size;
+	bus->slot_stride = bus->hdr->slot_stride;
+	if (bus->slots < 2 || bus->slot_size == 0 ||
+			bus->slot_stride < ALIGN_UP(sizeof(struct framebus_slot)) + bus->slot_size ||
+			bus->size < ALIGN_UP(sizeof(struct framebus_header)) ||
+			(bus->size - ALIGN_UP(sizeof(struct framebus_header))) / bus->slot_stride < bus->slots)
+		goto fail;
+
+	/* Take a free cursor, or one left behind by a consumer that's gone */
+	for (int i = 0; i < FRAMEBUS_MAX_CONSUMERS && !bus->me; i++) {
+		c = &bus->hdr->consumers[i];
+		pid = atomic_load(&c->pid);
+		if (!framebus_alive(pid) && atomic_compare_exchange_strong(&c->pid, &pid, getpid()))
+			bus->me = c;
+	}
+	if (!bus->me)
+		goto fail;
+
+	bus->cursor = atomic_load_explicit(&bus->hdr->head, memory_order_acquire);
+	atomic_store(&bus->me->cursor, bus->cursor);
+	atomic_store(&bus->me->lost, 0);
+
+	close(sock);
+	return bus;
+
+fail:
+	close(sock);
+	framebus_close(bus);
+	return NULL;
+}
+
+/*
+ * Get the next frame, waiting up to 'timeout_ms' for it (-1 waits forever).
+ * Returns false if there was none by then, or if a signal woke us up.
+ *
+ * The frame is not copied: it's still in the ring, and might get
+ * overwritten anytime. Whatever was made out of it is only good
+ * if framebus_release() says so afterwards.
+ */
+bool framebus_next(struct framebus *bus, struct framebus_frame *frame, int timeout_ms)
+{
+	struct framebus_slot *slot;
+	struct timespec timeout;
+	uint64_t head, seq;
+	uint32_t wake;
+
+	if (!bus || !bus->me || !frame)
+		return false;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+	for (;;) {
+		wake = atomic_load_explicit(&bus->hdr->futex, memory_order_acquire);
+		head = atomic_load_explicit(&bus->hdr->head, memory_order_acquire);
+
+		if (bus->cursor >= head) {
+			if (timeout_ms == 0)
+				return false;
+
+			atomic_fetch_add(&bus->hdr->waiters, 1);
+			if (futex(&bus->hdr->futex, FUTEX_WAIT, wake, (timeout_ms > 0 ? &timeout : NULL)) == -1 &&
+					(errno == ETIMEDOUT || errno == EINTR)) {
+				atomic_fetch_sub(&bus->hdr->waiters, 1);
+				return false;
+			}
+			atomic_fetch_sub(&bus->hdr->waiters, 1);
+			continue;
+		}
+
+		/*
+		 * If we're a whole ring behind, skip to the oldest frame that
+		 * is not about to be overwritten.
+		 */
+		if (head - bus->cursor >= bus->slots) {
+			bus->lost += head - bus->slots + 1 - bus->cursor;
+			bus->cursor = head - bus->slots + 1;
+		}
+
+		slot = framebus_slot(bus, bus->cursor);
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == 2 * bus->cursor + 2)
+			break;
+
+		/* Overwritten before we got to it */
+		bus->lost++;
+		bus->cursor++;
+	}
+
+	frame->seq = bus->cursor;
+	frame->stream = slot->stream;
+	frame->format = slot->format;
+	frame->width = slot->width;
+	frame->height = slot->height;
+	frame->capture_time.tv_sec = slot->sec;
+	frame->capture_time.tv_usec = slot->usec;
+	frame->len = (slot->len <= bus->slot_size ? slot->len : 0);
+	frame->data = framebus_slot_data(slot);
+
+	bus->cursor++;
+	atomic_store_explicit(&bus->me->cursor, bus->cursor, memory_order_relaxed);
+	atomic_store_explicit(&bus->me->lost, bus->lost, memory_order_relaxed);
+
+	return true;
+}
+
+/*
+ * Tells whether 'frame' was left alone while we were reading it.
+ */
+bool framebus_release(struct framebus *bus, const struct framebus_frame *frame)
+{
+	struct framebus_slot *slot;
+
+	if (!bus || !bus->me || !frame)
+		return false;
+
+	slot = framebus_slot(bus, frame->seq);
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == 2 * frame->seq + 2)
+		return true;
+
+	bus->lost++;
+	atomic_store_explicit(&bus->me->lost, bus->lost, memory_order_relaxed);
+	return false;
+}
+
+uint64_t framebus_lost(struct framebus *bus)
+{
+	return (bus ? bus->lost : 0);
+}
+
+void framebus_close(struct framebus *bus)
+{
+	if (!bus)
+		return;
+
+	if (bus->me)
+		atomic_store(&bus->me->pid, 0);
+	if (bus->r)
+		reactor_del_fd(bus->r, bus->sock);
+	if (bus->sock != -1)
+		close(bus->sock);
+	if (bus->path) {
+		unlink(bus->path);
+		free(bus->path);
+	}
+	if (bus->hdr)
+		munmap(bus->hdr, bus->size);
+	if (bus->memfd != -1)
+		close(bus->memfd);
+	free(bus);
+}
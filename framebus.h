@@ -0,0 +1,64 @@
+/*
+ * framebus.h
+ *
+ * A bus to hand frames to other processes on the same box (eg. a local
+ * recorder, or some analytics) without opening the camera again.
+ *
+ * Frames are published into a ring of slots, in a memfd that every consumer
+ * maps. Consumers get the memfd from a UNIX socket, and read frames
+ * right from the ring, without copying them. Each of them has its own
+ * cursor into the ring. The publisher never waits for anybody:
+ * consumers that fall behind a whole ring just lose frames.
+ * Every slot has a sequence number, so that they can tell whether
+ * the frame was overwritten while they were reading it.
+ * Consumers waiting for frames sleep on a futex.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef FRAMEBUS_H_
+#define FRAMEBUS_H_
+#include <stdint.h>
+#include <sys/time.h>
+#include "main.h"
+#include "frame.h"
+
+#define FRAMEBUS_DEFAULT_SLOTS	8
+#define FRAMEBUS_MAX_CONSUMERS	16
+
+/* What goes in 'stream': the frame as captured, or as sent for some rendition */
+#define FRAMEBUS_STREAM_CAPTURED	0
+#define FRAMEBUS_STREAM_RENDITION(i)	((i) + 1)
+
+struct framebus;
+struct reactor;
+
+/* A frame in the ring. 'data' points into the shared memory */
+struct framebus_frame {
+	uint64_t seq;
+	uint32_t stream;
+	/* V4L2 pixel format: V4L2_PIX_FMT_JPEG for JPEGs (and tiles, see tiles.h) */
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	struct timeval capture_time;
+	const unsigned char *data;
+	size_t len;
+};
+
+/* Publisher */
+struct framebus *framebus_create(const char *path, unsigned int slots, size_t slot_size);
+bool framebus_attach_reactor(struct framebus *, struct reactor *);
+bool framebus_publish(struct framebus *, uint32_t stream, uint32_t format, const struct frame *);
+unsigned int framebus_consumers(struct framebus *, uint64_t *max_lag);
+
+/* Consumer */
+struct framebus *framebus_connect(const char *path);
+bool framebus_next(struct framebus *, struct framebus_frame *, int timeout_ms);
+bool framebus_release(struct framebus *, const struct framebus_frame *);
+uint64_t framebus_lost(struct framebus *);
+
+void framebus_close(struct framebus *);
+
+#endif /* FRAMEBUS_H_ */
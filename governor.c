@@ -0,0 +1,235 @@
+/*
+ * governor.c
+ *
+ * Adaptive frame rate (and JPEG quality) governor for the daemon.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "utils.h"
+#include "frame.h"
+#include "governor.h"
+
+/* How often the targets are revised */
+#define GOVERNOR_WINDOW_MS	1000
+/* Weight of the newest sample in the moving averages */
+#define GOVERNOR_ALPHA		0.2
+#define GOVERNOR_QUALITY_STEP	5
+/* Fraction of the time the pipeline may be busy, and of the CPU that should stay idle */
+#define GOVERNOR_MAX_LOAD	0.9
+#define GOVERNOR_MIN_IDLE	0.1
+/* Frames that arrive a bit early for their slot are still taken, up to this fraction of it */
+#define GOVERNOR_EARLY		0.1
+/* We only speed up if there's plenty of slack, so that we don't oscillate */
+#define GOVERNOR_SLACK		0.7
+#define GOVERNOR_SLACK_IDLE	0.25
+
+struct governor {
+	struct governor_config cfg;
+	double fps;
+	int quality;
+	/* Timestamps in ns, from CLOCK_MONOTONIC */
+	uint64_t next_frame;
+	uint64_t window_start;
+	/* Moving averages, in seconds */
+	double stage_cost[GOVERNOR_STAGE_COUNT];
+	double latency;
+	/* System-wide CPU time at the beginning of the window, in ticks */
+	unsigned long long cpu_idle;
+	unsigned long long cpu_total;
+};
+
+uint64_t governor_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool read_cpu_times(unsigned long long *idle, unsigned long long *total)
+{
+	FILE *fp = fopen("/proc/stat", "r");
+	unsigned long long v[8] = { 0 };
+	int n;
+
+	if (!fp)
+		return false;
+
+	n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(fp);
+	if (n < 4)
+		return false;
+
+	/* idle + iowait */
+	*idle = v[3] + v[4];
+	*total = 0;
+	for (int i = 0; i < 8; i++)
+		*total += v[i];
+
+	return true;
+}
+
+static inline void update_average(double *avg, double sample)
+{
+	*avg = (*avg == 0 ? sample : *avg + GOVERNOR_ALPHA * (sample - *avg));
+}
+
+struct governor *governor_new(const struct governor_config *cfg)
+{
+	struct governor *g;
+
+	if (!cfg || cfg->min_fps <= 0 || cfg->max_fps < cfg->min_fps || !cfg->target_latency_ms ||
+			cfg->min_quality < 0 || cfg->max_quality > 100 || cfg->max_quality < cfg->min_quality)
+		return NULL;
+
+	g = ec_malloc(sizeof(struct governor));
+	memcpy(&g->cfg, cfg, sizeof(struct governor_config));
+
+	/* Start slow, and speed up as long as we can keep up */
+	g->fps = cfg->min_fps;
+	g->quality = (cfg->max_quality ? cfg->max_quality : JPEG_DEFAULT_QUALITY);
+	g->window_start = governor_now();
+	read_cpu_times(&g->cpu_idle, &g->cpu_total);
+
+	return g;
+}
+
+void governor_free(struct governor *g)
+{
+	if (g)
+		free(g);
+}
+
+/*
+ * Tells whether a frame that just came in should be sent,
+ * which is the case when it's time for the next one.
+ */
+bool governor_take_frame(struct governor *g)
+{
+	uint64_t now, period;
+
+	if (!g)
+		return true;
+
+	now = governor_now();
+	period = (uint64_t) (1e9 / g->fps);
+	if (now + (uint64_t) (period * GOVERNOR_EARLY) < g->next_frame)
+		return false;
+
+	/* Stay in phase, unless we're way behind */
+	g->next_frame += period;
+	if (g->next_frame < now)
+		g->next_frame = now + period;
+
+	return true;
+}
+
+/*
+ * Tell the governor how long a stage took for some frame.
+ */
+void governor_observe(struct governor *g, enum governor_stage stage, uint64_t ns)
+{
+	if (g && stage < GOVERNOR_STAGE_COUNT)
+		update_average(&g->stage_cost[stage], ns / 1e9);
+}
+
+static void governor_adjust(struct governor *g, uint64_t now)
+{
+	unsigned long long idle, total;
+	double idle_ratio = 1, load, target = g->cfg.target_latency_ms / 1000.0,
+		/*
+		 * Capture is left out: most of it is just waiting for the camera,
+		 * which doesn't take anything from us.
+		 */
+		busy = g->stage_cost[GOVERNOR_ENCODE] + g->stage_cost[GOVERNOR_UPLOAD];
+	bool manage_quality = (g->cfg.max_quality > 0);
+
+	if (read_cpu_times(&idle, &total)) {
+		if (total > g->cpu_total)
+			idle_ratio = (double) (idle - g->cpu_idle) / (total - g->cpu_total);
+		g->cpu_idle = idle;
+		g->cpu_total = total;
+	}
+
+	load = busy * g->fps;
+
+	if (g->latency > target || load > GOVERNOR_MAX_LOAD || idle_ratio < GOVERNOR_MIN_IDLE) {
+		/*
+		 * Frames take too long to get out: smaller frames will help that.
+		 * Otherwise, we're just too busy. Send less of them.
+		 */
+		if (manage_quality && g->latency > target && g->quality > g->cfg.min_quality)
+			g->quality -= GOVERNOR_QUALITY_STEP;
+		else
+			g->fps *= 0.75;
+	} else if (g->latency < target * GOVERNOR_SLACK && load < GOVERNOR_SLACK &&
+			idle_ratio > GOVERNOR_SLACK_IDLE) {
+		/* Faster first, then better looking */
+		if (g->fps < g->cfg.max_fps) {
+			g->fps += (g->fps * 0.25 > 1 ? g->fps * 0.25 : 1);
+			/* Don't go beyond what we can sustain */
+			if (busy > 0 && g->fps > GOVERNOR_SLACK / busy)
+				g->fps = GOVERNOR_SLACK / busy;
+		} else if (manage_quality && g->quality < g->cfg.max_quality) {
+			g->quality += GOVERNOR_QUALITY_STEP;
+		}
+	}
+
+	if (g->fps < g->cfg.min_fps)
+		g->fps = g->cfg.min_fps;
+	if (g->fps > g->cfg.max_fps)
+		g->fps = g->cfg.max_fps;
+	if (manage_quality && g->quality < g->cfg.min_quality)
+		g->quality = g->cfg.min_quality;
+	if (manage_quality && g->quality > g->cfg.max_quality)
+		g->quality = g->cfg.max_quality;
+
+	if (g->cfg.verbose)
+		fprintf(stderr, "GOVERNOR fps=%.1f quality=%d latency=%.0fms capture=%.1fms "
+				"encode=%.1fms upload=%.1fms load=%.2f idle=%.2f\n",
+				g->fps, g->quality, g->latency * 1000,
+				g->stage_cost[GOVERNOR_CAPTURE] * 1000,
+				g->stage_cost[GOVERNOR_ENCODE] * 1000,
+				g->stage_cost[GOVERNOR_UPLOAD] * 1000,
+				load, idle_ratio);
+
+	g->window_start = now;
+}
+
+/*
+ * Tell the governor that a frame captured at 'captured_at' has been sent.
+ * The targets are revised here, once every window.
+ */
+void governor_frame_sent(struct governor *g, uint64_t captured_at)
+{
+	uint64_t now;
+
+	if (!g)
+		return;
+
+	now = governor_now();
+	update_average(&g->latency, (now > captured_at ? now - captured_at : 0) / 1e9);
+
+	if (now - g->window_start >= GOVERNOR_WINDOW_MS * 1000000ULL)
+		governor_adjust(g, now);
+}
+
+double governor_fps(struct governor *g)
+{
+	return (g ? g->fps : 0);
+}
+
+/*
+ * The JPEG quality frames should be encoded with.
+ * If the governor does not manage it, that's just the default.
+ */
+int governor_quality(struct governor *g)
+{
+	return (g ? g->quality : JPEG_DEFAULT_QUALITY);
+}
@@ -0,0 +1,55 @@
+/*
+ * governor.h
+ *
+ * Adaptive frame rate (and JPEG quality) governor for the daemon.
+ * It measures what every frame costs to capture, encode and upload,
+ * and how much CPU is left on the box, and moves the target fps
+ * (and, optionally, the quality) within the configured bounds, so that
+ * frames are sent as often as possible while keeping latency under the target.
+ *
+ * The camera keeps delivering frames at its own pace. governor_take_frame()
+ * tells which of them should go out, and the rest are just dropped,
+ * so that whatever we send is always the freshest frame.
+ * Stages are reported as they finish, possibly out of order,
+ * so uploads can be asynchronous. All times are in ns from governor_now().
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef GOVERNOR_H_
+#define GOVERNOR_H_
+#include <stdint.h>
+#include "main.h"
+
+enum governor_stage {
+	GOVERNOR_CAPTURE,
+	GOVERNOR_ENCODE,
+	GOVERNOR_UPLOAD,
+	GOVERNOR_STAGE_COUNT
+};
+
+struct governor_config {
+	double min_fps;
+	double max_fps;
+	unsigned int target_latency_ms;
+	/* Set both to zero to leave the quality alone */
+	int min_quality;
+	int max_quality;
+	bool verbose;
+};
+
+struct governor;
+
+struct governor *governor_new(const struct governor_config *);
+void governor_free(struct governor *);
+
+uint64_t governor_now();
+bool governor_take_frame(struct governor *);
+void governor_observe(struct governor *, enum governor_stage, uint64_t ns);
+void governor_frame_sent(struct governor *, uint64_t captured_at);
+
+double governor_fps(struct governor *);
+int governor_quality(struct governor *);
+
+#endif /* GOVERNOR_H_ */
@@ -0,0 +1,417 @@
+/*
+ * ingest-main.c
+ *
+ * Headless receiver for lots of cameras at once (eg. to archive a whole site
+ * on one server). Streams are spread over one event loop per core, each of
+ * them driving hundreds of streams through a single curl multi handle.
+ * Frames are only decoded to be stored, in segments (see segment.h).
+ * Without somewhere to store them, they're just counted.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "main.h"
+#include "utils.h"
+#include "appbase.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "trace.h"
+#include "segment.h"
+
+#define DEFAULT_SEGMENT_SECS	60
+#define DEFAULT_STATS_SECS	5
+#define MAX_LOOPS		256
+#define CAMERA_FIELD_LEN	256
+
+struct ingest_loop;
+
+struct ingest_camera {
+	char name[2 * CAMERA_FIELD_LEN];
+	struct appbase *ab;
+	struct segment_writer *segments;
+	/* Where frames are decoded into, before storing them */
+	unsigned char *image;
+	size_t image_size;
+	unsigned long frames;
+	unsigned long errors;
+	struct ingest_loop *loop;
+};
+
+struct ingest_loop {
+	pthread_t thread;
+	struct reactor *r;
+	struct appbase_streams *streams;
+	unsigned int cpu;
+	/* Read from the main thread, for statistics */
+	atomic_ulong frames;
+	atomic_ullong bytes;
+};
+
+static struct ingest_camera *cameras = NULL;
+static unsigned int num_cameras = 0;
+static struct ingest_loop *loops = NULL;
+static unsigned int num_loops = 0;
+
+static void print_usage(const char *name)
+{
+	printf("Usage: %s [OPTIONS] <camera list>\n"
+			"Every line of the camera list is: <app name> <username> <password> [<rendition>]\n"
+			"Options:\n"
+			"    -o dir         Store frames under this directory, one subdirectory per camera\n"
+			"                   (default: just count them)\n"
+			"    -g secs        Start a new segment every this amount of seconds (default: %d)\n"
+			"    -c loops       Spread cameras over this many event loops (default: one per core)\n"
+			"    -i secs        Print statistics every this amount of seconds (default: %d)\n"
+			"    -d             Display debug messages\n"
+			"    -m port        Serve runtime metrics for Prometheus on this local port\n"
+			"    -M file        Write runtime metrics to this file every few seconds\n"
+			"    -t file        Trace every stage of the pipeline, and write it to this file on exit\n",
+			name, DEFAULT_SEGMENT_SECS, DEFAULT_STATS_SECS);
+}
+
+/*
+ * Frames come base64 encoded, and are only decoded if we store them.
+ * They're stored with the time they were captured, or the time they arrived
+ * if their document didn't say.
+ */
+static void ingest_frame(const char *image, size_t len,
+		const struct timeval *timestamp, void *userdata)
+{
+	struct ingest_camera *cam = userdata;
+	struct timeval now;
+	size_t size;
+
+	cam->frames++;
+	atomic_fetch_add_explicit(&cam->loop->frames, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&cam->loop->bytes, len, memory_order_relaxed);
+
+	if (!cam->segments)
+		return;
+
+	if (timestamp)
+		now = *timestamp;
+	else
+		gettimeofday(&now, NULL);
+	size = appbase_decoded_len(len);
+	if (size > cam->image_size) {
+		cam->image = ec_realloc(cam->image, size);
+		cam->image_size = size;
+	}
+
+	size = appbase_decode_image(image, len, cam->image);
+	if (!size || !segment_writer_append(cam->segments, &now, cam->image, size))
+		cam->errors++;
+}
+
+static void *loop_run(void *ptr)
+{
+	struct ingest_loop *loop = ptr;
+	cpu_set_t cpus;
+
+	/* One loop per core, and each one on its own */
+	CPU_ZERO(&cpus);
+	CPU_SET(loop->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	if (!reactor_run(loop->r))
+		fprintf(stderr, "ERROR: The event loop failed\n");
+	return NULL;
+}
+
+/*
+ * Returns false if the line is not empty, nor a comment, but not a camera either.
+ */
+static bool parse_camera(const char *line, bool debug, const char *dir, unsigned int segment_secs)
+{
+	char app[CAMERA_FIELD_LEN], user[CAMERA_FIELD_LEN], pass[CAMERA_FIELD_LEN],
+		rendition[AB_RENDITION_ID_LEN], *path;
+	struct ingest_camera *cam;
+	int fields;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (!*line || *line == '\n' || *line == '#')
+		return true;
+
+	fields = sscanf(line, "%255s %255s %255s %31s", app, user, pass, rendition);
+	if (fields < 3)
+		return false;
+
+	cameras = ec_realloc(cameras, (num_cameras + 1) * sizeof(struct ingest_camera));
+	cam = &cameras[num_cameras];
+	memset(cam, 0, sizeof(struct ingest_camera));
+
+	if (fields == 4)
+		snprintf(cam->name, sizeof(cam->name), "%s-%s", app, rendition);
+	else
+		snprintf(cam->name, sizeof(cam->name), "%s", app);
+
+	cam->ab = appbase_open(app, user, pass, true);
+	if (!cam->ab || (fields == 4 && !appbase_set_rendition(cam->ab, rendition))) {
+		fprintf(stderr, "ERROR: Could not set up camera '%s'\n", cam->name);
+		appbase_close(cam->ab);
+		return false;
+	}
+
+	if (debug) {
+		appbase_enable_progress(cam->ab, true);
+		appbase_enable_verbose(cam->ab, true);
+	}
+
+	if (dir) {
+		if (asprintf(&path, "%s/%s", dir, cam->name) == -1)
+			fatal("Could not allocate memory");
+		cam->segments = segment_writer_new(path, segment_secs);
+		if (!cam->segments)
+			fprintf(stderr, "ERROR: Could not store frames under '%s'\n", path);
+		free(path);
+		if (!cam->segments) {
+			appbase_close(cam->ab);
+			return false;
+		}
+	}
+
+	num_cameras++;
+	return true;
+}
+
+static bool read_cameras(const char *list, bool debug, const char *dir, unsigned int segment_secs)
+{
+	FILE *fp = fopen(list, "r");
+	char line[1024];
+	unsigned int n = 0;
+	bool ok = true;
+
+	if (!fp) {
+		fprintf(stderr, "ERROR: Could not open camera list '%s'\n", list);
+		return false;
+	}
+
+	while (ok && fgets(line, sizeof(line), fp)) {
+		n++;
+		ok = parse_camera(line, debug, dir, segment_secs);
+		if (!ok)
+			fprintf(stderr, "ERROR: Bad camera at line %u of '%s'\n", n, list);
+	}
+
+	fclose(fp);
+	return ok;
+}
+
+/*
+ * Every stream takes a socket, and there might be hundreds of them.
+ */
+static void raise_fd_limit()
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static double elapsed_secs(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void totals(unsigned long *frames, unsigned long long *bytes)
+{
+	*frames = 0;
+	*bytes = 0;
+	for (unsigned int i = 0; i < num_loops; i++) {
+		*frames += atomic_load_explicit(&loops[i].frames, memory_order_relaxed);
+		*bytes += atomic_load_explicit(&loops[i].bytes, memory_order_relaxed);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	char *endptr;
+	long metrics_port = 0, segment_secs = DEFAULT_SEGMENT_SECS, stats_secs = DEFAULT_STATS_SECS,
+		nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *dir = NULL, *metrics_file = NULL, *trace_file = NULL;
+	unsigned long frames, last_frames = 0, errors = 0;
+	unsigned long long bytes, last_bytes = 0;
+	struct timespec start, interval_start, timeout;
+	struct ingest_loop *loop;
+	sigset_t signals;
+	bool debug = false;
+	double secs;
+
+	while ((opt = getopt(argc, argv, "o:g:c:i:dm:M:t:")) != -1) {
+		switch (opt) {
+		case 'o':
+			dir = optarg;
+			break;
+		case 'g':
+			segment_secs = strtol(optarg, &endptr, 10);
+			if (*endptr || segment_secs <= 0)
+				goto exit_help;
+			break;
+		case 'c':
+			nloops = strtol(optarg, &endptr, 10);
+			if (*endptr || nloops <= 0 || nloops > MAX_LOOPS)
+				goto exit_help;
+			break;
+		case 'i':
+			stats_secs = strtol(optarg, &endptr, 10);
+			if (*endptr || stats_secs <= 0)
+				goto exit_help;
+			break;
+		case 'd':
+			debug = true;
+			break;
+		case 'm':
+			metrics_port = strtol(optarg, &endptr, 10);
+			if (*endptr || metrics_port <= 0 || metrics_port > 65535)
+				goto exit_help;
+			break;
+		case 'M':
+			metrics_file = optarg;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		default:
+			goto exit_help;
+		}
+	}
+
+	if (argc - optind < 1)
+		goto exit_help;
+	/* There's only one metrics exporter */
+	if (metrics_port && metrics_file)
+		fatal("Metrics can either be served (-m) or written to a file (-M), not both");
+
+	if (dir && mkdir(dir, 0755) == -1 && errno != EEXIST)
+		fatal("Could not create the storage directory");
+	if (!read_cameras(argv[optind], debug, dir, segment_secs))
+		return 1;
+	if (!num_cameras)
+		fatal("No cameras to receive from");
+
+	raise_fd_limit();
+
+	/* Signals are only taken by this thread. Every other one inherits this */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if (metrics_port && !metrics_serve(NULL, metrics_port))
+		fatal("Could not serve metrics on the requested port");
+	if (metrics_file && !metrics_write_file(metrics_file, METRICS_FILE_INTERVAL))
+		fatal("Could not write metrics to the requested file");
+	if (trace_file)
+		trace_start(trace_file);
+
+	/* No point in loops without cameras */
+	num_loops = (nloops < num_cameras ? nloops : num_cameras);
+	loops = ec_malloc(num_loops * sizeof(struct ingest_loop));
+
+	for (unsigned int i = 0; i < num_loops; i++) {
+		loop = &loops[i];
+		loop->cpu = i % sysconf(_SC_NPROCESSORS_ONLN);
+		atomic_init(&loop->frames, 0);
+		atomic_init(&loop->bytes, 0);
+		loop->r = reactor_new();
+		loop->streams = appbase_streams_new(loop->r);
+		if (!loop->r || !loop->streams)
+			fatal("Could not create the event loops");
+	}
+
+	/* Cameras are dealt out to the loops, before they start */
+	for (unsigned int i = 0; i < num_cameras; i++) {
+		cameras[i].loop = &loops[i % num_loops];
+		if (!appbase_streams_add(cameras[i].loop->streams, cameras[i].ab, ingest_frame, &cameras[i]))
+			fprintf(stderr, "ERROR: Could not stream from camera '%s'\n", cameras[i].name);
+	}
+
+	for (unsigned int i = 0; i < num_loops; i++) {
+		if (pthread_create(&loops[i].thread, NULL, loop_run, &loops[i]) != 0)
+			fatal("Could not start the event loops");
+	}
+
+	fprintf(stderr, "Receiving from %u cameras in %u event loops\n", num_cameras, num_loops);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	interval_start = start;
+	timeout.tv_sec = stats_secs;
+	timeout.tv_nsec = 0;
+
+	while (sigtimedwait(&signals, NULL, &timeout) == -1) {
+		if (errno != EAGAIN)
+			continue;
+
+		secs = elapsed_secs(&interval_start);
+		clock_gettime(CLOCK_MONOTONIC, &interval_start);
+		totals(&frames, &bytes);
+		printf("STATS cameras=%u frames=%lu fps=%.2f mbps=%.2f\n",
+				num_cameras, frames,
+				(frames - last_frames) / secs,
+				(bytes - last_bytes) * 8 / secs / 1e6);
+		fflush(stdout);
+		last_frames = frames;
+		last_bytes = bytes;
+	}
+
+	for (unsigned int i = 0; i < num_loops; i++)
+		reactor_stop(loops[i].r);
+	for (unsigned int i = 0; i < num_loops; i++)
+		pthread_join(loops[i].thread, NULL);
+
+	secs = elapsed_secs(&start);
+	totals(&frames, &bytes);
+
+	/* The loops are gone, so their cameras are ours now */
+	for (unsigned int i = 0; i < num_cameras; i++) {
+		if (!cameras[i].frames)
+			printf("IDLE camera=%s\n", cameras[i].name);
+		errors += cameras[i].errors;
+	}
+	printf("SUMMARY cameras=%u frames=%lu secs=%.2f fps=%.2f errors=%lu\n",
+			num_cameras, frames, secs, frames / secs, errors);
+	fflush(stdout);
+
+	trace_stop();
+	metrics_stop();
+
+	/* Streams go before the handles they use */
+	for (unsigned int i = 0; i < num_loops; i++)
+		appbase_streams_free(loops[i].streams);
+	for (unsigned int i = 0; i < num_cameras; i++) {
+		appbase_close(cameras[i].ab);
+		segment_writer_free(cameras[i].segments);
+		free(cameras[i].image);
+	}
+	for (unsigned int i = 0; i < num_loops; i++)
+		reactor_free(loops[i].r);
+	free(loops);
+	free(cameras);
+
+	return 0;
+
+exit_help:
+	print_usage(argv[0]);
+	return 1;
+}
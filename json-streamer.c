@@ -7,142 +7,326 @@
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 #include <string.h>
+#include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "main.h"
 #include "utils.h"
 #include "appbase.h"
+#include "arena.h"
 #include "json-streamer.h"
 
-struct json_streamer {
-	yajl_handle yajl;
-	json_streamer_frame_cb_t frame_callback;
-	void *userdata;
-	struct json_streamer_state_ctx *ctx;
-};
+/* Enough for the parser itself. Documents with frames grow it to their size */
+#define JSON_STREAMER_ARENA_SIZE	(64 * 1024)
 
-enum json_streamer_state {
-	waiting,
-	string_parsed,
-	integer_parsed,
-	usec_key_parsed,
-	image_key_parsed,
-	usec_key_waiting,
-	image_key_waiting
+enum json_streamer_key {
+	key_none,
+	key_image,
+	key_sec,
+	key_usec
 };
 
-struct json_streamer_state_ctx {
+/*
+ * Documents come one after another on the same connection, and they're
+ * all parsed by the same parser. We find where each of them ends by ourselves,
+ * by keeping track of the braces that aren't inside strings. Then we know when
+ * we've got all the fields of a frame, and if a document turns out to be broken,
+ * we can skip the rest of it and go on with the next one.
+ */
+struct json_streamer {
+	yajl_handle yajl;
+	/*
+	 * Everything yajl allocates, including the buffer where values split
+	 * across reads are put back together. Released at once whenever
+	 * the parser is set up again.
+	 */
+	struct arena *arena;
+	yajl_alloc_funcs alloc_funcs;
 	json_streamer_frame_cb_t frame_callback;
 	void *userdata;
-	enum json_streamer_state cur_state;
-	char *data;
-	size_t len;
-	long long val;
+
+	/* Where we are in the current document */
+	unsigned int depth;
+	bool in_string;
+	bool escaped;
+	/* The current document is broken, and is being skipped */
+	bool skipping;
+	char error[256];
+
+	/* Fields of the current document, so far */
+	enum json_streamer_key key;
+	char *image;
+	size_t image_len;
+	size_t image_size;
+	bool has_image;
+	long long sec;
+	long long usec;
+	bool has_sec;
+	bool has_usec;
 };
 
 /*
  * yajl callbacks
  *
  * Return non-zero to let the parsing continue.
- * Return zero to signal an error (yajl_parse() will return 'yajl_status_client_canceled').
+ * Frames are only handed over once their document ends, since their fields
+ * might come in any order. yajl only keeps strings around until it tells us
+ * about them, so the image is copied.
  */
-static int json_streamer_new_state(struct json_streamer_state_ctx *state_ctx,
-		enum json_streamer_state new_state)
+static int yajl_json_integer_cb(void *ctx, long long val)
 {
-	int retval = 1;
+	struct json_streamer *json = ctx;
+
+	if (json->key == key_sec) {
+		json->sec = val;
+		json->has_sec = true;
+	} else if (json->key == key_usec) {
+		json->usec = val;
+		json->has_usec = true;
+	}
 
-	switch (new_state) {
-	case string_parsed:
-		if (state_ctx->cur_state == image_key_waiting) {
-			state_ctx->frame_callback(state_ctx->data, state_ctx->len, state_ctx->userdata);
-			state_ctx->cur_state = waiting;
-		}
-		break;
-	case integer_parsed:
-		if (state_ctx->cur_state == usec_key_waiting) {
-			fprintf(stderr, "Received usec: %lld\n", state_ctx->val);
-			retval = 0;
-			state_ctx->cur_state = waiting;
+	json->key = key_none;
+	return 1;
+}
+
+static int yajl_json_string_cb(void *ctx, const unsigned char *str, size_t len)
+{
+	struct json_streamer *json = ctx;
+
+	if (json->key == key_image) {
+		if (len > json->image_size) {
+			json->image = ec_realloc(json->image, len);
+			json->image_size = len;
 		}
-		break;
-	case usec_key_parsed:
-		state_ctx->cur_state = usec_key_waiting;
-		break;
-	case image_key_parsed:
-		state_ctx->cur_state = image_key_waiting;
-		break;
-	case image_key_waiting:
-	case usec_key_waiting:
-	default:
-		break;
+
+		memcpy(json->image, str, len);
+		json->image_len = len;
+		json->has_image = true;
 	}
 
-	return retval;
+	json->key = key_none;
+	return 1;
 }
 
-static int yajl_json_integer_cb(void *ctx, long long val)
+static int yajl_json_map_key_cb(void *ctx, const unsigned char *key, size_t len)
 {
-	struct json_streamer_state_ctx *state_ctx = ctx;
+	struct json_streamer *json = ctx;
+
+	json->key = key_none;
+	if (len == 3 && strncmp((const char *) key, AB_KEY_SEC, len) == 0)
+		json->key = key_sec;
+	else if (len == 4 && strncmp((const char *) key, AB_KEY_USEC, len) == 0)
+		json->key = key_usec;
+	else if (len == 5 && strncmp((const char *) key, AB_KEY_IMAGE, len) == 0)
+		json->key = key_image;
 
-	state_ctx->val = val;
-	return json_streamer_new_state(ctx, integer_parsed);
+	return 1;
 }
 
-static int yajl_json_string_cb(void *ctx, const unsigned char *str, size_t len)
+static int yajl_json_value_cb(void *ctx)
 {
-	struct json_streamer_state_ctx *state_ctx = ctx;
+	struct json_streamer *json = ctx;
 
-	state_ctx->data = (char *) str;
-	state_ctx->len = len;
-	return json_streamer_new_state(state_ctx, string_parsed);
+	json->key = key_none;
+	return 1;
 }
 
-static int yajl_json_map_key_cb(void *ctx, const unsigned char *key, size_t len)
+static int yajl_json_bool_cb(void *ctx, int val)
 {
-	int retval = 1;
-	if (len == 4) {
-		if (strncmp((const char *) key, AB_KEY_USEC, len) == 0)
-			retval = json_streamer_new_state(ctx, usec_key_parsed);
-	} else if (len == 5) {
-		if (strncmp((const char *) key, AB_KEY_IMAGE, len) == 0)
-			retval = json_streamer_new_state(ctx, image_key_parsed);
-	}
+	return yajl_json_value_cb(ctx);
+}
 
-	return retval;
+static int yajl_json_double_cb(void *ctx, double val)
+{
+	return yajl_json_value_cb(ctx);
 }
 
 static yajl_callbacks yajl_cbs = {
-		NULL,
-		NULL,
+		yajl_json_value_cb,
+		yajl_json_bool_cb,
 		yajl_json_integer_cb,
-		NULL,
+		yajl_json_double_cb,
 		NULL,
 		yajl_json_string_cb,
-		NULL,
+		yajl_json_value_cb,
 		yajl_json_map_key_cb,
-		NULL,
-		NULL,
-		NULL
+		yajl_json_value_cb,
+		yajl_json_value_cb,
+		yajl_json_value_cb
 };
 
-static void yajl_init(struct json_streamer *json, json_streamer_frame_cb_t fcb, void *userdata, bool reinit)
+static void *yajl_arena_malloc(void *ctx, size_t size)
 {
-	struct json_streamer_state_ctx *ctx = json->ctx;
+	return arena_alloc(ctx, size);
+}
 
-	if (!ctx)
-		ctx = ec_malloc(sizeof(struct json_streamer_state_ctx));
+static void *yajl_arena_realloc(void *ctx, void *ptr, size_t size)
+{
+	return arena_realloc(ctx, ptr, size);
+}
 
-	ctx->cur_state = waiting;
-	ctx->frame_callback = fcb;
-	ctx->userdata = userdata;
+static void yajl_arena_free(void *ctx, void *ptr)
+{
+	arena_release(ctx, ptr);
+}
 
-	/* Save pointer so that we can free it later in json_streamer_destroy() */
-	json->ctx = ctx;
+static void json_streamer_clear_document(struct json_streamer *json)
+{
+	json->key = key_none;
+	json->has_image = false;
+	json->has_sec = false;
+	json->has_usec = false;
+}
 
-	if (reinit) {
-		yajl_complete_parse(json->yajl);
+/*
+ * Set up a fresh parser, for a new connection, or after a broken document.
+ * Documents parsed fine just go on with the same one.
+ */
+static bool yajl_init(struct json_streamer *json)
+{
+	if (json->yajl)
 		yajl_free(json->yajl);
+
+	/* Nothing from the last parser is alive anymore */
+	arena_reset(json->arena);
+	json->yajl = yajl_alloc(&yajl_cbs, &json->alloc_funcs, json);
+	if (!json->yajl)
+		return false;
+
+	yajl_config(json->yajl, yajl_allow_multiple_values, 1);
+
+	json->depth = 0;
+	json->in_string = false;
+	json->escaped = false;
+	json->skipping = false;
+	json_streamer_clear_document(json);
+	return true;
+}
+
+/*
+ * Framing, one byte at a time. Only called for the bytes that matter,
+ * see json_streamer_special(). Returns true if 'c' ends the current document.
+ */
+static inline bool json_streamer_track(struct json_streamer *json, unsigned char c)
+{
+	if (json->in_string) {
+		if (c == '\\')
+			json->escaped = true;
+		else if (c == '"')
+			json->in_string = false;
+		return false;
+	}
+
+	switch (c) {
+	case '"':
+		json->in_string = true;
+		break;
+	case '{':
+		json->depth++;
+		break;
+	case '}':
+		if (json->depth && --json->depth == 0)
+			return true;
+		break;
+	case '\n':
+		/* Documents come one per line. A broken one ends here, whatever we thought */
+		if (json->skipping) {
+			json->depth = 0;
+			return true;
+		}
+		break;
+	}
+
+	return false;
+}
+
+static inline bool json_streamer_special(unsigned char c)
+{
+	return (c == '{' || c == '}' || c == '"' || c == '\\' || c == '\n');
+}
+
+/*
+ * Find where the current document ends in 'data'. Returns how many bytes
+ * of 'data' belong to it, and sets 'end' if it ends there.
+ *
+ * Most of a frame document is its image, which has none of the bytes
+ * we look for. With SSE2, it's skipped 16 bytes at a time.
+ */
+static size_t json_streamer_scan(struct json_streamer *json,
+		const unsigned char *data, size_t size, bool *end)
+{
+	size_t i = 0, skip = SIZE_MAX;
+
+	*end = false;
+
+	/* The last read ended right after a backslash */
+	if (json->escaped) {
+		json->escaped = false;
+		i = 1;
+	}
+
+#ifdef __SSE2__
+	const __m128i lbrace = _mm_set1_epi8('{'), rbrace = _mm_set1_epi8('}'),
+			quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'),
+			newline = _mm_set1_epi8('\n');
+	__m128i v, m;
+	unsigned int mask;
+	size_t pos;
+
+	for (; i + 16 <= size; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (data + i));
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lbrace), _mm_cmpeq_epi8(v, rbrace)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, newline));
+
+		for (mask = _mm_movemask_epi8(m); mask; mask &= mask - 1) {
+			pos = i + __builtin_ctz(mask);
+			if (pos == skip)
+				continue;
+
+			if (json_streamer_track(json, data[pos])) {
+				*end = true;
+				return pos + 1;
+			}
+			if (json->escaped && pos + 1 < size) {
+				json->escaped = false;
+				skip = pos + 1;
+			}
+		}
+	}
+#endif
+
+	for (; i < size; i++) {
+		if (i == skip || !json_streamer_special(data[i]))
+			continue;
+
+		if (json_streamer_track(json, data[i])) {
+			*end = true;
+			return i + 1;
+		}
+		if (json->escaped && i + 1 < size) {
+			json->escaped = false;
+			skip = i + 1;
+		}
+	}
+
+	return size;
+}
+
+static void json_streamer_deliver(struct json_streamer *json)
+{
+	struct timeval timestamp;
+
+	if (json->has_image) {
+		timestamp.tv_sec = json->sec;
+		timestamp.tv_usec = json->usec;
+		json->frame_callback(json->image, json->image_len,
+				(json->has_sec && json->has_usec ? &timestamp : NULL),
+				json->userdata);
 	}
 
-	json->yajl = yajl_alloc(&yajl_cbs, NULL, ctx);
+	json_streamer_clear_document(json);
 }
 
 /*
@@ -158,13 +342,22 @@ struct json_streamer *json_streamer_init(json_streamer_frame_cb_t fcb, void *use
 
 	json->frame_callback = fcb;
 	json->userdata = userdata;
-	json->ctx = NULL;
-	yajl_init(json, fcb, userdata, false);
+
+	json->arena = arena_new(JSON_STREAMER_ARENA_SIZE);
+	if (!json->arena)
+		goto fail;
+	json->alloc_funcs.malloc = yajl_arena_malloc;
+	json->alloc_funcs.realloc = yajl_arena_realloc;
+	json->alloc_funcs.free = yajl_arena_free;
+	json->alloc_funcs.ctx = json->arena;
+
+	if (!yajl_init(json))
+		goto fail;
 
 	return json;
 
 fail:
-	free(json);
+	json_streamer_destroy(json);
 	return NULL;
 }
 
@@ -173,41 +366,68 @@ void json_streamer_destroy(struct json_streamer *json)
 	if (json) {
 		if (json->yajl)
 			yajl_free(json->yajl);
-		if (json->ctx)
-			free(json->ctx);
+		arena_free(json->arena);
+		free(json->image);
 
 		free(json);
 	}
 }
 
+/*
+ * Drop any partially parsed document and start over with a fresh parser.
+ * Meant to be called when the underlying connection is re-established.
+ */
+void json_streamer_reset(struct json_streamer *json)
+{
+	if (json)
+		yajl_init(json);
+}
+
+/*
+ * Returns false if a document was broken. It's skipped, and parsing
+ * goes on with the next one.
+ */
 bool json_streamer_push(struct json_streamer *json, const unsigned char *data, size_t size)
 {
 	yajl_status status;
+	unsigned char *err;
+	size_t len;
+	bool end, ok = true;
 
 	if (!json || !json->yajl || !data || !size)
 		return false;
 
-	status = yajl_parse(json->yajl, data, size);
-	if (status == yajl_status_client_canceled)
-		yajl_init(json, json->frame_callback, json->userdata, true);
+	while (size) {
+		len = json_streamer_scan(json, data, size, &end);
 
-	return (status != yajl_status_error);
-}
+		if (!json->skipping) {
+			status = yajl_parse(json->yajl, data, len);
+			if (status != yajl_status_ok) {
+				err = yajl_get_error(json->yajl, 1, data, len);
+				snprintf(json->error, sizeof(json->error), "%s", (err ? (char *) err : "unknown error"));
+				if (err)
+					yajl_free_error(json->yajl, err);
 
-unsigned char *json_streamer_get_last_error(struct json_streamer *json,
-		unsigned char *data, size_t size)
-{
-	if (!json || !json->yajl || !data || !size)
-		return false;
+				json->skipping = true;
+				ok = false;
+			}
+		}
+
+		if (end) {
+			if (json->skipping)
+				yajl_init(json);
+			else
+				json_streamer_deliver(json);
+		}
+
+		data += len;
+		size -= len;
+	}
 
-	return yajl_get_error(json->yajl,
-			1,
-			data,
-			size);
+	return ok;
 }
 
-void json_streamer_free_last_error(struct json_streamer *json, unsigned char *err)
+const char *json_streamer_get_last_error(struct json_streamer *json)
 {
-	if (json && err)
-		yajl_free_error(json->yajl, err);
+	return (json && *json->error ? json->error : "no error");
 }
@@ -7,23 +7,26 @@
 
 #ifndef JSON_STREAMER_H_
 #define JSON_STREAMER_H_
+#include <sys/time.h>
 #include "main.h"
 #include "appbase.h"
 
 struct json_streamer;
 
-typedef void (* json_streamer_frame_cb_t) (const char *, size_t, void *);
+/*
+ * Called once per document with an image, with its base64 data, and its
+ * capture time (NULL if the document didn't have it). Both are only valid
+ * until the callback returns.
+ */
+typedef void (* json_streamer_frame_cb_t) (const char *, size_t, const struct timeval *, void *);
 struct json_streamer *json_streamer_init(json_streamer_frame_cb_t, void *);
 void json_streamer_destroy(struct json_streamer *);
+void json_streamer_reset(struct json_streamer *);
 
 bool json_streamer_push(struct json_streamer *json,
 		const unsigned char *data,
 		size_t size);
 
-unsigned char *json_streamer_get_last_error(struct json_streamer *json,
-		unsigned char *data,
-		size_t size);
-void json_streamer_free_last_error(struct json_streamer *json,
-		unsigned char *err);
+const char *json_streamer_get_last_error(struct json_streamer *json);
 
 #endif /* JSON_STREAMER_H_ */
@@ -0,0 +1,145 @@
+#!/bin/sh
+#
+# loadtest.sh
+#
+# End-to-end load test against the local mock server (appbase-cctv-mock).
+# Runs a number of daemons capturing from the synthetic test pattern,
+# and a number of headless clients streaming from them, for a while.
+# Then reports the sustained frame rate, latency, and CPU usage of every process.
+#
+#  Created on: 19 Oct 2026
+#      Author: ajuaristi <a@juaristi.eus>
+#
+
+BUILD_DIR=./build
+DAEMONS=1
+CLIENTS=1
+DURATION=30
+LATENCY=0
+BANDWIDTH=0
+PORT=9200
+DAEMON_OPTS="-S"
+
+usage() {
+	cat <<EOF
+Usage: $0 [OPTIONS]
+Options:
+    -b dir         Directory where the executables were built (default: $BUILD_DIR)
+    -d num         Number of daemons (default: $DAEMONS)
+    -c num         Number of clients, spread over the daemons (default: $CLIENTS)
+    -t secs        Test duration (default: $DURATION)
+    -l msecs       Latency added by the mock server (default: $LATENCY)
+    -B kbps        Bandwidth limit per connection, in kbit/s (default: unlimited)
+    -p port        Port for the mock server (default: $PORT)
+    -j             Have the daemons convert frames to JPEG
+    -H             Have the daemons keep history documents too
+EOF
+	exit 1
+}
+
+while getopts "b:d:c:t:l:B:p:jH" opt; do
+	case $opt in
+	b) BUILD_DIR=$OPTARG ;;
+	d) DAEMONS=$OPTARG ;;
+	c) CLIENTS=$OPTARG ;;
+	t) DURATION=$OPTARG ;;
+	l) LATENCY=$OPTARG ;;
+	B) BANDWIDTH=$OPTARG ;;
+	p) PORT=$OPTARG ;;
+	j) DAEMON_OPTS="$DAEMON_OPTS -j" ;;
+	H) DAEMON_OPTS="$DAEMON_OPTS -H" ;;
+	*) usage ;;
+	esac
+done
+
+for exe in appbase-cctv-mock appbase-cctv-daemon appbase-cctv-client; do
+	if [ ! -x "$BUILD_DIR/$exe" ]; then
+		echo "Could not find $BUILD_DIR/$exe. Did you build the project?" >&2
+		exit 1
+	fi
+done
+
+OUT=$(mktemp -d)
+PIDS=""
+CLK_TCK=$(getconf CLK_TCK)
+
+cleanup() {
+	for pid in $PIDS; do
+		kill -INT $pid 2>/dev/null
+	done
+	wait 2>/dev/null
+}
+trap cleanup EXIT
+
+# Prints the CPU time of a process, in clock ticks (user + system)
+cpu_ticks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+"$BUILD_DIR/appbase-cctv-mock" -p $PORT -l $LATENCY -b $BANDWIDTH -i $DURATION \
+	> "$OUT/mock.out" 2> "$OUT/mock.err" &
+MOCK_PID=$!
+PIDS="$MOCK_PID"
+sleep 1
+
+export APPBASE_API_URL="http://127.0.0.1:$PORT"
+
+i=0
+while [ $i -lt $CLIENTS ]; do
+	"$BUILD_DIR/appbase-cctv-client" -n app$((i % DAEMONS)) user password \
+		> "$OUT/client$i.out" 2> "$OUT/client$i.err" &
+	eval CLIENT_PID_$i=$!
+	PIDS="$PIDS $!"
+	i=$((i + 1))
+done
+
+i=0
+while [ $i -lt $DAEMONS ]; do
+	"$BUILD_DIR/appbase-cctv-daemon" -T $DAEMON_OPTS app$i user password \
+		> "$OUT/daemon$i.out" 2> "$OUT/daemon$i.err" &
+	eval DAEMON_PID_$i=$!
+	PIDS="$PIDS $!"
+	i=$((i + 1))
+done
+
+echo "Running $DAEMONS daemon(s) and $CLIENTS client(s) for $DURATION seconds (logs in $OUT)"
+
+for pid in $PIDS; do
+	eval START_TICKS_$pid=$(cpu_ticks $pid)
+done
+
+sleep $DURATION
+
+printf "\n%-10s %8s %8s\n" "PROCESS" "PID" "CPU%"
+report_cpu() {
+	eval start=\$START_TICKS_$2
+	end=$(cpu_ticks $2)
+	printf "%-10s %8d %8s\n" $1 $2 \
+		$(awk -v s=$start -v e=$end -v t=$CLK_TCK -v d=$DURATION 'BEGIN { printf "%.1f", (e - s) * 100 / t / d }')
+}
+report_cpu mock $MOCK_PID
+i=0
+while [ $i -lt $DAEMONS ]; do
+	eval report_cpu daemon$i \$DAEMON_PID_$i
+	i=$((i + 1))
+done
+i=0
+while [ $i -lt $CLIENTS ]; do
+	eval report_cpu client$i \$CLIENT_PID_$i
+	i=$((i + 1))
+done
+
+cleanup
+PIDS=""
+
+echo
+echo "Server side (uploads and fan-out):"
+grep '^SUMMARY' "$OUT/mock.out" | sed 's/^SUMMARY /    /'
+
+echo
+echo "Client side:"
+i=0
+while [ $i -lt $CLIENTS ]; do
+	printf "    client%d %s\n" $i "$(grep '^SUMMARY' "$OUT/client$i.out" | sed 's/^SUMMARY //')"
+	i=$((i + 1))
+done
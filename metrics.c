@@ -0,0 +1,472 @@
+/*
+ * metrics.c
+ *
+ * Runtime counters and histograms, cheap enough to be updated
+ * on every frame. Every thread updates its own copy of them without
+ * locks or atomic read-modify-write operations. They are only added up
+ * when exported, either as a Prometheus text page served on a local port,
+ * or as a file that is rewritten periodically.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "utils.h"
+#include "metrics.h"
+
+/*
+ * Histogram buckets are powers of two, in microseconds:
+ * bucket 'i' counts the observations of at most 2^i us. The last one is +Inf.
+ * 26 buckets get us from 1 us up to ~33 seconds.
+ */
+#define METRICS_BUCKETS		26
+#define METRICS_PREFIX		"appbase_cctv_"
+#define METRICS_PAGE_SIZE	16384
+#define METRICS_POLL_MS		100
+/* Scrapers that take longer than this to ask, or to read the answer, are hung up on */
+#define METRICS_CLIENT_TIMEOUT_MS	1000
+
+struct histogram {
+	atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum_ns;
+};
+
+/*
+ * Each thread gets one of these the first time it touches a metric.
+ * They're linked together so that the exporter can walk through them,
+ * and never freed, so that the counts of threads that exit are not lost.
+ */
+struct metrics_block {
+	atomic_uint_fast64_t counters[METRIC_COUNTER_COUNT];
+	struct histogram histograms[METRIC_HISTOGRAM_COUNT];
+	struct metrics_block *next;
+};
+
+struct histogram_totals {
+	uint64_t buckets[METRICS_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+};
+
+struct metric_desc {
+	const char *name;
+	const char *help;
+};
+
+static const struct metric_desc counter_descs[METRIC_COUNTER_COUNT] = {
+	[METRIC_FRAMES_CAPTURED] = { "frames_captured_total", "Frames captured from the camera" },
+	[METRIC_FRAMES_DROPPED] = { "frames_dropped_total", "Frames dropped because some stage could not keep up" },
+	[METRIC_FRAMES_ENCODED] = { "frames_encoded_total", "Frames converted to JPEG" },
+	[METRIC_FRAMES_UPLOADED] = { "frames_uploaded_total", "Frames successfully uploaded to Appbase" },
+	[METRIC_FRAMES_RECEIVED] = { "frames_received_total", "Frames received from the Appbase stream" },
+	[METRIC_BYTES_RAW] = { "bytes_raw_total", "Bytes of raw frames, before JPEG conversion" },
+	[METRIC_BYTES_JPEG] = { "bytes_jpeg_total", "Bytes of frames after JPEG conversion" },
+	[METRIC_BYTES_BASE64] = { "bytes_base64_total", "Bytes of frames after base64 encoding" },
+	[METRIC_BYTES_RECEIVED] = { "bytes_received_total", "Bytes received from the Appbase stream" },
+	[METRIC_UPLOAD_ERRORS] = { "upload_errors_total", "Frames that could not be uploaded" },
+	[METRIC_RETRIES] = { "retries_total", "Reconnections and retried requests" },
+	[METRIC_FRAMES_LOST] = { "frames_lost_total", "Frames the camera dropped before we could take them, from gaps in their sequence numbers" },
+	[METRIC_TILES_SENT] = { "tiles_sent_total", "Tiles sent instead of whole frames, because only they changed" },
+	[METRIC_DEADLINES_MISSED] = { "deadlines_missed_total", "Periodic shots skipped because the previous ones took too long" },
+	[METRIC_LAN_FRAMES_SKIPPED] = { "lan_frames_skipped_total", "Frames LAN viewers skipped, because they were still receiving an older one" },
+	[METRIC_ARENA_ALLOCS] = { "arena_allocs_total", "Calls to malloc(3) made by per-frame arenas, because frames outgrew them" }
+};
+
+static const struct metric_desc histogram_descs[METRIC_HISTOGRAM_COUNT] = {
+	[METRIC_TIME_CAPTURE] = { "capture_seconds", "Time spent waiting for a frame from the camera" },
+	[METRIC_TIME_ENCODE] = { "encode_seconds", "Time spent converting a frame to JPEG" },
+	[METRIC_TIME_SERIALIZE] = { "serialize_seconds", "Time spent base64-encoding a frame and building its JSON document" },
+	[METRIC_TIME_UPLOAD] = { "upload_seconds", "Time spent sending a frame to Appbase" },
+	[METRIC_TIME_DECODE] = { "decode_seconds", "Time spent decoding a received frame from base64" },
+	[METRIC_TIME_RENDER] = { "render_seconds", "Time spent rendering a frame" },
+	[METRIC_TIME_FRAME_AGE] = { "frame_age_seconds", "Time frames waited in the camera driver until we took them" },
+	[METRIC_TIME_FRAME_INTERVAL] = { "frame_interval_seconds", "Time between consecutive frames, as timestamped by the camera" },
+	[METRIC_TIME_SCALE] = { "scale_seconds", "Time spent scaling a frame down" },
+	[METRIC_TIME_DENOISE] = { "denoise_seconds", "Time spent reducing the noise of a frame" }
+};
+
+static const struct metric_desc gauge_descs[METRIC_GAUGE_COUNT] = {
+	[METRIC_QUEUE_DEPTH] = { "queue_depth", "Frames waiting in the queue between threads" },
+	[METRIC_LAN_VIEWERS] = { "lan_viewers", "Viewers watching the MJPEG stream (or waiting for a snapshot) on the LAN" }
+};
+
+static __thread struct metrics_block *local_block = NULL;
+static struct metrics_block *blocks = NULL;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int_fast64_t gauges[METRIC_GAUGE_COUNT];
+
+static pthread_t exporter;
+static bool exporter_running = false;
+static atomic_bool exporter_stop;
+static int listen_fd = -1;
+static char *stats_path = NULL;
+static unsigned int stats_interval;
+
+static struct metrics_block *metrics_local()
+{
+	struct metrics_block *b = local_block;
+
+	if (!b) {
+		b = ec_malloc(sizeof(struct metrics_block));
+
+		pthread_mutex_lock(&blocks_lock);
+		b->next = blocks;
+		blocks = b;
+		pthread_mutex_unlock(&blocks_lock);
+
+		local_block = b;
+	}
+
+	return b;
+}
+
+/*
+ * Only the owner thread ever writes to its block, so a plain
+ * load and store is enough. The atomics are only there so that
+ * the exporter never reads a torn value.
+ */
+static inline void local_add(atomic_uint_fast64_t *v, uint64_t n)
+{
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+			memory_order_relaxed);
+}
+
+void metrics_add(enum metrics_counter c, uint64_t n)
+{
+	if (c < METRIC_COUNTER_COUNT)
+		local_add(&metrics_local()->counters[c], n);
+}
+
+void metrics_observe_ns(enum metrics_histogram h, uint64_t ns)
+{
+	struct histogram *hist;
+	uint64_t us = ns / 1000;
+	int bucket = (us ? 64 - __builtin_clzll(us) : 0);
+
+	if (h >= METRIC_HISTOGRAM_COUNT)
+		return;
+
+	if (bucket >= METRICS_BUCKETS)
+		bucket = METRICS_BUCKETS - 1;
+
+	hist = &metrics_local()->histograms[h];
+	local_add(&hist->buckets[bucket], 1);
+	local_add(&hist->count, 1);
+	local_add(&hist->sum_ns, ns);
+}
+
+void metrics_set(enum metrics_gauge g, int64_t val)
+{
+	if (g < METRIC_GAUGE_COUNT)
+		atomic_store_explicit(&gauges[g], val, memory_order_relaxed);
+}
+
+/*
+ * Exporting
+ */
+struct page {
+	char *buf;
+	size_t len;
+	size_t written;
+};
+
+static void page_printf(struct page *p, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(p->buf + (p->written < p->len ? p->written : p->len),
+			(p->written < p->len ? p->len - p->written : 0),
+			fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		p->written += n;
+}
+
+static uint64_t sum_counter(enum metrics_counter c)
+{
+	uint64_t total = 0;
+
+	for (struct metrics_block *b = blocks; b; b = b->next)
+		total += atomic_load_explicit(&b->counters[c], memory_order_relaxed);
+
+	return total;
+}
+
+static void sum_histogram(enum metrics_histogram h, struct histogram_totals *out)
+{
+	struct histogram *hist;
+
+	memset(out, 0, sizeof(struct histogram_totals));
+
+	for (struct metrics_block *b = blocks; b; b = b->next) {
+		hist = &b->histograms[h];
+		for (int i = 0; i < METRICS_BUCKETS; i++)
+			out->buckets[i] += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		out->count += atomic_load_explicit(&hist->count, memory_order_relaxed);
+		out->sum_ns += atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+	}
+}
+
+/*
+ * Format all metrics in the Prometheus text exposition format.
+ * Returns the length of the whole page, which might be larger than 'len',
+ * in which case the output was truncated (just like snprintf(3)).
+ */
+size_t metrics_format(char *buf, size_t len)
+{
+	struct page p = { .buf = buf, .len = len, .written = 0 };
+	struct histogram_totals hist;
+	uint64_t cumulative;
+
+	if (buf && len)
+		buf[0] = 0;
+
+	pthread_mutex_lock(&blocks_lock);
+
+	for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+		page_printf(&p, "# HELP " METRICS_PREFIX "%s %s\n"
+				"# TYPE " METRICS_PREFIX "%s counter\n"
+				METRICS_PREFIX "%s %llu\n",
+				counter_descs[c].name, counter_descs[c].help,
+				counter_descs[c].name,
+				counter_descs[c].name, (unsigned long long) sum_counter(c));
+	}
+
+	for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+		sum_histogram(h, &hist);
+		page_printf(&p, "# HELP " METRICS_PREFIX "%s %s\n"
+				"# TYPE " METRICS_PREFIX "%s histogram\n",
+				histogram_descs[h].name, histogram_descs[h].help,
+				histogram_descs[h].name);
+
+		cumulative = 0;
+		for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+			cumulative += hist.buckets[i];
+			page_printf(&p, METRICS_PREFIX "%s_bucket{le=\"%g\"} %llu\n",
+					histogram_descs[h].name, (double) (1ULL << i) / 1e6,
+					(unsigned long long) cumulative);
+		}
+		page_printf(&p, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n"
+				METRICS_PREFIX "%s_sum %.9f\n"
+				METRICS_PREFIX "%s_count %llu\n",
+				histogram_descs[h].name, (unsigned long long) hist.count,
+				histogram_descs[h].name, hist.sum_ns / 1e9,
+				histogram_descs[h].name, (unsigned long long) hist.count);
+	}
+
+	pthread_mutex_unlock(&blocks_lock);
+
+	for (int g = 0; g < METRIC_GAUGE_COUNT; g++) {
+		page_printf(&p, "# HELP " METRICS_PREFIX "%s %s\n"
+				"# TYPE " METRICS_PREFIX "%s gauge\n"
+				METRICS_PREFIX "%s %lld\n",
+				gauge_descs[g].name, gauge_descs[g].help,
+				gauge_descs[g].name,
+				gauge_descs[g].name, (long long) atomic_load(&gauges[g]));
+	}
+
+	return p.written;
+}
+
+static char *metrics_page(size_t *len)
+{
+	size_t size = METRICS_PAGE_SIZE;
+	char *buf = ec_malloc(size);
+
+	while ((*len = metrics_format(buf, size)) >= size) {
+		size = *len + 1;
+		free(buf);
+		buf = ec_malloc(size);
+	}
+
+	return buf;
+}
+
+/*
+ * A minimal HTTP server. Whatever is asked for, we answer with the metrics page.
+ */
+static void *serve_loop(void *unused)
+{
+	struct timeval timeout = {
+		.tv_sec = METRICS_CLIENT_TIMEOUT_MS / 1000,
+		.tv_usec = (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000
+	};
+	char request[1024], *page, header[128];
+	size_t page_len;
+	int fd, header_len;
+
+	while (!atomic_load(&exporter_stop)) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+
+		/*
+		 * A client that connects and says nothing would otherwise
+		 * keep us here, and metrics_stop() waiting for us, forever.
+		 */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		/* We don't really care about the request */
+		if (recv(fd, request, sizeof(request), 0) > 0) {
+			page = metrics_page(&page_len);
+			header_len = snprintf(header, sizeof(header),
+					"HTTP/1.0 200 OK\r\n"
+					"Content-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %zu\r\n"
+					"\r\n", page_len);
+
+			send(fd, header, header_len, MSG_NOSIGNAL | MSG_MORE);
+			send(fd, page, page_len, MSG_NOSIGNAL);
+			free(page);
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+static void write_stats_file()
+{
+	char *page, *tmp_path;
+	size_t page_len;
+	FILE *f;
+
+	if (asprintf(&tmp_path, "%s.tmp", stats_path) == -1)
+		return;
+
+	page = metrics_page(&page_len);
+
+	/* Write to a temporary file and rename it, so readers never see a partial file */
+	f = fopen(tmp_path, "w");
+	if (f) {
+		fwrite(page, page_len, 1, f);
+		fclose(f);
+		if (rename(tmp_path, stats_path) == -1)
+			fprintf(stderr, "ERROR: Could not write stats file '%s'\n", stats_path);
+	}
+
+	free(page);
+	free(tmp_path);
+}
+
+static void *file_loop(void *unused)
+{
+	struct timespec poll = { .tv_sec = 0, .tv_nsec = METRICS_POLL_MS * 1000000L };
+	unsigned int elapsed_ms = 0;
+
+	while (!atomic_load(&exporter_stop)) {
+		nanosleep(&poll, NULL);
+		elapsed_ms += METRICS_POLL_MS;
+
+		if (elapsed_ms >= stats_interval * 1000) {
+			write_stats_file();
+			elapsed_ms = 0;
+		}
+	}
+
+	/* One last time, so that the final counts are kept */
+	write_stats_file();
+	return NULL;
+}
+
+/*
+ * Serve the metrics page on 'addr':'port'. Only one exporter
+ * (either this or metrics_write_file()) can be running at the same time.
+ */
+bool metrics_serve(const char *addr, int port)
+{
+	struct sockaddr_in sin;
+	int one = 1;
+
+	if (exporter_running || port <= 0 || port > 65535)
+		return false;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, (addr ? addr : "127.0.0.1"), &sin.sin_addr) != 1)
+		return false;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1)
+		return false;
+
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(listen_fd, (struct sockaddr *) &sin, sizeof(sin)) == -1 ||
+			listen(listen_fd, 8) == -1)
+		goto fail;
+
+	atomic_store(&exporter_stop, false);
+	if (pthread_create(&exporter, NULL, serve_loop, NULL) != 0)
+		goto fail;
+
+	exporter_running = true;
+	return true;
+
+fail:
+	close(listen_fd);
+	listen_fd = -1;
+	return false;
+}
+
+/*
+ * Rewrite the metrics page to 'path' every 'interval_secs' seconds.
+ */
+bool metrics_write_file(const char *path, unsigned int interval_secs)
+{
+	if (exporter_running || !path || !interval_secs)
+		return false;
+
+	stats_path = ec_malloc_fill(strlen(path) + 1, path);
+	stats_interval = interval_secs;
+
+	atomic_store(&exporter_stop, false);
+	if (pthread_create(&exporter, NULL, file_loop, NULL) != 0) {
+		free(stats_path);
+		stats_path = NULL;
+		return false;
+	}
+
+	exporter_running = true;
+	return true;
+}
+
+void metrics_stop()
+{
+	if (!exporter_running)
+		return;
+
+	atomic_store(&exporter_stop, true);
+
+	/* Wake up the server thread, if it's blocked on accept() */
+	if (listen_fd != -1)
+		shutdown(listen_fd, SHUT_RDWR);
+
+	pthread_join(exporter, NULL);
+	exporter_running = false;
+
+	if (listen_fd != -1) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (stats_path) {
+		free(stats_path);
+		stats_path = NULL;
+	}
+}
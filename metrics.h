@@ -0,0 +1,93 @@
+/*
+ * metrics.h
+ *
+ * Runtime counters and histograms, cheap enough to be updated
+ * on every frame. Every thread updates its own copy of them without
+ * locks or atomic read-modify-write operations. They are only added up
+ * when exported, either as a Prometheus text page served on a local port,
+ * or as a file that is rewritten periodically.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "main.h"
+
+/* How often the stats file is rewritten, in seconds */
+#define METRICS_FILE_INTERVAL	5
+
+enum metrics_counter {
+	METRIC_FRAMES_CAPTURED,
+	METRIC_FRAMES_DROPPED,
+	METRIC_FRAMES_ENCODED,
+	METRIC_FRAMES_UPLOADED,
+	METRIC_FRAMES_RECEIVED,
+	METRIC_BYTES_RAW,
+	METRIC_BYTES_JPEG,
+	METRIC_BYTES_BASE64,
+	METRIC_BYTES_RECEIVED,
+	METRIC_UPLOAD_ERRORS,
+	METRIC_RETRIES,
+	METRIC_FRAMES_LOST,
+	METRIC_TILES_SENT,
+	METRIC_DEADLINES_MISSED,
+	METRIC_LAN_FRAMES_SKIPPED,
+	METRIC_ARENA_ALLOCS,
+	METRIC_COUNTER_COUNT
+};
+
+enum metrics_histogram {
+	METRIC_TIME_CAPTURE,
+	METRIC_TIME_ENCODE,
+	METRIC_TIME_SERIALIZE,
+	METRIC_TIME_UPLOAD,
+	METRIC_TIME_DECODE,
+	METRIC_TIME_RENDER,
+	METRIC_TIME_FRAME_AGE,
+	METRIC_TIME_FRAME_INTERVAL,
+	METRIC_TIME_SCALE,
+	METRIC_TIME_DENOISE,
+	METRIC_HISTOGRAM_COUNT
+};
+
+enum metrics_gauge {
+	METRIC_QUEUE_DEPTH,
+	METRIC_LAN_VIEWERS,
+	METRIC_GAUGE_COUNT
+};
+
+void metrics_add(enum metrics_counter, uint64_t);
+void metrics_observe_ns(enum metrics_histogram, uint64_t ns);
+void metrics_set(enum metrics_gauge, int64_t);
+
+static inline void metrics_inc(enum metrics_counter c)
+{
+	metrics_add(c, 1);
+}
+
+/* Monotonic timestamp in nanoseconds, for timing stages */
+static inline uint64_t metrics_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void metrics_observe_since(enum metrics_histogram h, uint64_t start)
+{
+	metrics_observe_ns(h, metrics_now() - start);
+}
+
+size_t metrics_format(char *buf, size_t len);
+
+bool metrics_serve(const char *addr, int port);
+bool metrics_write_file(const char *path, unsigned int interval_secs);
+void metrics_stop();
+
+#endif /* METRICS_H_ */
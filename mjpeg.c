@@ -0,0 +1,524 @@
+/*
+ * mjpeg.c
+ *
+ * MJPEG over HTTP, for viewers on the LAN.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "utils.h"
+#include "pool.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "mjpeg.h"
+
+#define MJPEG_BOUNDARY		"appbase-cctv-frame"
+#define MJPEG_REQUEST_MAX	2048
+#define MJPEG_HEAD_MAX		512
+/* Viewers that haven't sent a whole request by then are hung up on */
+#define MJPEG_REQUEST_TIMEOUT_MS	5000
+#define MJPEG_EVENTS		(EPOLLIN | EPOLLRDHUP)
+
+static const char stream_response[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+	"Cache-Control: no-cache, no-store\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char index_page[] =
+	"<!DOCTYPE html><html><head><title>appbase-cctv</title></head>"
+	"<body style=\"margin:0;background:#000\">"
+	"<img src=\"/stream\" style=\"display:block;margin:auto;max-width:100%\">"
+	"</body></html>\n";
+
+enum viewer_state {
+	/* Still reading the request */
+	VIEWER_REQUEST,
+	/* Sending a response that's not a frame, and then closing */
+	VIEWER_RESPONSE,
+	VIEWER_STREAM,
+	VIEWER_SNAPSHOT
+};
+
+struct mjpeg_viewer {
+	struct mjpeg_server *srv;
+	int fd;
+	enum viewer_state state;
+	/* When they connected (in ns, see metrics_now()) */
+	uint64_t accepted;
+	bool started;
+	bool want_out;
+	char request[MJPEG_REQUEST_MAX];
+	size_t request_len;
+	/*
+	 * What's being sent: headers, then the frame (a reference to the shared
+	 * buffer, or a static page), then a trailer. 'sent' counts all of them.
+	 */
+	char head[MJPEG_HEAD_MAX];
+	size_t head_len;
+	unsigned char *frame;
+	const void *body;
+	size_t body_len;
+	const char *tail;
+	size_t tail_len;
+	size_t sent;
+	/* The last frame we sent, and whether we're done after this */
+	uint64_t seq;
+	bool last;
+};
+
+struct mjpeg_server {
+	struct reactor *r;
+	int sock;
+	/* Fires when the oldest request still coming is due */
+	struct reactor_timer *request_timer;
+	struct mjpeg_viewer *viewers[MJPEG_MAX_VIEWERS];
+	/* The newest frame. Only kept while somebody's watching */
+	unsigned char *latest;
+	size_t latest_len;
+	struct timeval latest_time;
+	uint64_t latest_seq;
+};
+
+static void viewer_send(struct mjpeg_viewer *);
+
+unsigned int mjpeg_server_viewers(struct mjpeg_server *srv)
+{
+	unsigned int count = 0;
+
+	if (!srv)
+		return 0;
+
+	for (unsigned int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+		if (srv->viewers[i] &&
+				(srv->viewers[i]->state == VIEWER_STREAM || srv->viewers[i]->state == VIEWER_SNAPSHOT))
+			count++;
+	}
+
+	return count;
+}
+
+static void viewers_changed(struct mjpeg_server *srv)
+{
+	unsigned int count = mjpeg_server_viewers(srv);
+
+	metrics_set(METRIC_LAN_VIEWERS, count);
+
+	/* Once nobody's watching, frames stop coming, so the last one would go stale */
+	if (!count) {
+		pool_unref(srv->latest);
+		srv->latest = NULL;
+	}
+}
+
+static void viewer_drop(struct mjpeg_viewer *v)
+{
+	struct mjpeg_server *srv = v->srv;
+	bool watching = (v->state == VIEWER_STREAM || v->state == VIEWER_SNAPSHOT);
+
+	for (unsigned int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+		if (srv->viewers[i] == v)
+			srv->viewers[i] = NULL;
+	}
+
+	reactor_del_fd(srv->r, v->fd);
+	close(v->fd);
+	pool_unref(v->frame);
+	free(v);
+
+	if (watching)
+		viewers_changed(srv);
+}
+
+static void viewer_want_out(struct mjpeg_viewer *v, bool want)
+{
+	if (v->want_out != want &&
+			reactor_mod_fd(v->srv->r, v->fd, MJPEG_EVENTS | (want ? EPOLLOUT : 0)))
+		v->want_out = want;
+}
+
+/*
+ * Queue a response that's not a frame. The connection is closed once it's sent.
+ */
+static void viewer_respond(struct mjpeg_viewer *v, const char *status,
+		const char *type, const void *body, size_t len)
+{
+	v->state = VIEWER_RESPONSE;
+	v->head_len = snprintf(v->head, sizeof(v->head),
+			"HTTP/1.0 %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			status, type, len);
+	v->body = body;
+	v->body_len = len;
+	v->last = true;
+	viewer_send(v);
+}
+
+/*
+ * Set up the next frame to send, if there's a newer one than the last we sent.
+ * Frames in between are skipped.
+ */
+static bool viewer_next_frame(struct mjpeg_viewer *v)
+{
+	struct mjpeg_server *srv = v->srv;
+	size_t len = 0;
+
+	if ((v->state != VIEWER_STREAM && v->state != VIEWER_SNAPSHOT) ||
+			!srv->latest || v->seq == srv->latest_seq)
+		return false;
+
+	if (v->seq)
+		metrics_add(METRIC_LAN_FRAMES_SKIPPED, srv->latest_seq - v->seq - 1);
+
+	if (v->state == VIEWER_STREAM) {
+		if (!v->started)
+			len = snprintf(v->head, sizeof(v->head), "%s", stream_response);
+		len += snprintf(v->head + len, sizeof(v->head) - len,
+				"--" MJPEG_BOUNDARY "\r\n"
+				"Content-Type: image/jpeg\r\n"
+				"Content-Length: %zu\r\n"
+				"X-Timestamp: %ld.%06ld\r\n"
+				"\r\n",
+				srv->latest_len,
+				(long) srv->latest_time.tv_sec, (long) srv->latest_time.tv_usec);
+		v->tail = "\r\n";
+		v->tail_len = 2;
+	} else {
+		len = snprintf(v->head, sizeof(v->head),
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: image/jpeg\r\n"
+				"Content-Length: %zu\r\n"
+				"Cache-Control: no-cache, no-store\r\n"
+				"Connection: close\r\n"
+				"\r\n",
+				srv->latest_len);
+		v->last = true;
+	}
+
+	v->head_len = len;
+	v->frame = pool_ref(srv->latest);
+	v->body = v->frame;
+	v->body_len = srv->latest_len;
+	v->seq = srv->latest_seq;
+	v->started = true;
+
+	return true;
+}
+
+/*
+ * Send as much as the socket takes, without blocking, and move on
+ * to the next frame whenever one is done. The headers, the frame and the trailer
+ * go in a single call, right from where they are.
+ */
+static void viewer_send(struct mjpeg_viewer *v)
+{
+	struct iovec iov[3];
+	struct msghdr msg;
+	size_t offset, total;
+	ssize_t n;
+	int count;
+
+	for (;;) {
+		total = v->head_len + v->body_len + v->tail_len;
+		if (v->sent == total) {
+			if (!v->head_len && !viewer_next_frame(v))
+				break;
+			continue;
+		}
+
+		count = 0;
+		offset = v->sent;
+		if (offset < v->head_len) {
+			iov[count].iov_base = v->head + offset;
+			iov[count++].iov_len = v->head_len - offset;
+			offset = 0;
+		} else {
+			offset -= v->head_len;
+		}
+		if (offset < v->body_len) {
+			iov[count].iov_base = (unsigned char *) v->body + offset;
+			iov[count++].iov_len = v->body_len - offset;
+			offset = 0;
+		} else {
+			offset -= v->body_len;
+		}
+		if (offset < v->tail_len) {
+			iov[count].iov_base = (char *) v->tail + offset;
+			iov[count++].iov_len = v->tail_len - offset;
+		}
+
+		/* Like writev(2), but without getting SIGPIPE if the viewer went away */
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		n = sendmsg(v->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				viewer_want_out(v, true);
+				return;
+			}
+			viewer_drop(v);
+			return;
+		}
+
+		v->sent += n;
+		if (v->sent < total)
+			continue;
+
+		/* Done with this one */
+		if (v->last) {
+			viewer_drop(v);
+			return;
+		}
+		pool_unref(v->frame);
+		v->frame = NULL;
+		v->body = NULL;
+		v->head_len = v->body_len = v->tail_len = v->sent = 0;
+	}
+
+	viewer_want_out(v, false);
+}
+
+static void viewer_handle_request(struct mjpeg_viewer *v)
+{
+	char method[8], path[256], *query;
+
+	if (sscanf(v->request, "%7s %255s", method, path) != 2) {
+		viewer_respond(v, "400 Bad Request", "text/plain", "Bad request\n", 12);
+		return;
+	}
+	if (strcmp(method, "GET") != 0) {
+		viewer_respond(v, "405 Method Not Allowed", "text/plain", "Method not allowed\n", 19);
+		return;
+	}
+
+	query = strchr(path, '?');
+	if (query)
+		*query = 0;
+
+	if (strcmp(path, "/") == 0) {
+		viewer_respond(v, "200 OK", "text/html", index_page, sizeof(index_page) - 1);
+	} else if (strcmp(path, "/stream") == 0 || strcmp(path, "/snapshot.jpg") == 0) {
+		/* If somebody else is watching already, the newest frame is fresh, so it goes right away */
+		v->state = (strcmp(path, "/stream") == 0 ? VIEWER_STREAM : VIEWER_SNAPSHOT);
+		viewers_changed(v->srv);
+		viewer_send(v);
+	} else {
+		viewer_respond(v, "404 Not Found", "text/plain", "Not found\n", 10);
+	}
+}
+
+static void viewer_event(int fd, uint32_t events, void *userdata)
+{
+	struct mjpeg_viewer *v = userdata;
+	char discard[256];
+	ssize_t n;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		viewer_drop(v);
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		viewer_send(v);
+		/* It might be gone now */
+		return;
+	}
+
+	if (v->state != VIEWER_REQUEST) {
+		/* Nothing else should come. Just find out whether they closed */
+		n = recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+		if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			viewer_drop(v);
+		return;
+	}
+
+	n = recv(fd, v->request + v->request_len, sizeof(v->request) - v->request_len - 1, MSG_DONTWAIT);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (n <= 0) {
+		viewer_drop(v);
+		return;
+	}
+
+	v->request_len += n;
+	v->request[v->request_len] = 0;
+	if (strstr(v->request, "\r\n\r\n") || strstr(v->request, "\n\n"))
+		viewer_handle_request(v);
+	else if (v->request_len == sizeof(v->request) - 1)
+		viewer_drop(v);
+}
+
+/*
+ * Arm the timer for the first viewer whose request is due, if any.
+ */
+static void requests_schedule(struct mjpeg_server *srv)
+{
+	uint64_t now = metrics_now(), due, next = 0;
+	struct mjpeg_viewer *v;
+
+	for (unsigned int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+		v = srv->viewers[i];
+		if (!v || v->state != VIEWER_REQUEST)
+			continue;
+
+		due = v->accepted + MJPEG_REQUEST_TIMEOUT_MS * 1000000ULL;
+		if (!next || due < next)
+			next = due;
+	}
+
+	if (next)
+		reactor_timer_arm(srv->request_timer, (next > now ? (next - now + 999999) / 1000000 : 0));
+}
+
+/*
+ * Connections that never get to send a whole request (eg. port scanners,
+ * or clients gone silent) would otherwise take up a viewer slot for good.
+ */
+static void requests_expire(void *userdata)
+{
+	struct mjpeg_server *srv = userdata;
+	uint64_t now = metrics_now();
+	struct mjpeg_viewer *v;
+
+	for (unsigned int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+		v = srv->viewers[i];
+		if (v && v->state == VIEWER_REQUEST &&
+				now - v->accepted >= MJPEG_REQUEST_TIMEOUT_MS * 1000000ULL)
+			viewer_drop(v);
+	}
+
+	requests_schedule(srv);
+}
+
+static void mjpeg_accept(int fd, uint32_t events, void *userdata)
+{
+	struct mjpeg_server *srv = userdata;
+	struct mjpeg_viewer *v;
+	unsigned int i;
+	int conn;
+
+	while ((conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		for (i = 0; i < MJPEG_MAX_VIEWERS && srv->viewers[i]; i++)
+			;
+		if (i == MJPEG_MAX_VIEWERS) {
+			close(conn);
+			continue;
+		}
+
+		v = ec_malloc(sizeof(struct mjpeg_viewer));
+		v->srv = srv;
+		v->fd = conn;
+		v->accepted = metrics_now();
+		if (!reactor_add_fd(srv->r, conn, MJPEG_EVENTS, viewer_event, v)) {
+			close(conn);
+			free(v);
+			continue;
+		}
+		srv->viewers[i] = v;
+	}
+
+	requests_schedule(srv);
+}
+
+/*
+ * Listen on 'port' of 'addr' (all of them, if NULL).
+ */
+struct mjpeg_server *mjpeg_server_new(struct reactor *r, const char *addr, int port)
+{
+	struct mjpeg_server *srv;
+	struct sockaddr_in sin;
+	int one = 1;
+
+	if (!r || port <= 0 || port > 65535)
+		return NULL;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, (addr ? addr : "0.0.0.0"), &sin.sin_addr) != 1)
+		return NULL;
+
+	srv = ec_malloc(sizeof(struct mjpeg_server));
+	srv->r = r;
+	srv->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (srv->sock == -1)
+		goto fail;
+
+	srv->request_timer = reactor_timer_new(r, requests_expire, srv);
+	if (!srv->request_timer)
+		goto fail;
+
+	setsockopt(srv->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(srv->sock, (struct sockaddr *) &sin, sizeof(sin)) == -1 ||
+			listen(srv->sock, SOMAXCONN) == -1)
+		goto fail;
+
+	if (!reactor_add_fd(r, srv->sock, EPOLLIN, mjpeg_accept, srv))
+		goto fail;
+
+	return srv;
+
+fail:
+	if (srv->sock != -1)
+		close(srv->sock);
+	reactor_timer_free(srv->request_timer);
+	free(srv);
+	return NULL;
+}
+
+void mjpeg_server_free(struct mjpeg_server *srv)
+{
+	if (!srv)
+		return;
+
+	for (unsigned int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+		if (srv->viewers[i])
+			viewer_drop(srv->viewers[i]);
+	}
+
+	reactor_del_fd(srv->r, srv->sock);
+	close(srv->sock);
+	reactor_timer_free(srv->request_timer);
+	pool_unref(srv->latest);
+	free(srv);
+}
+
+/*
+ * Hand a JPEG to every viewer. They take their own reference to its buffer,
+ * so the caller can go on with it as usual. Returns false if nobody's watching.
+ */
+bool mjpeg_server_publish(struct mjpeg_server *srv, const struct frame *f)
+{
+	if (!srv || !f || !f->frame_data || !f->frame_bytes_used || !mjpeg_server_viewers(srv))
+		return false;
+
+	pool_unref(srv->latest);
+	srv->latest = pool_ref(f->frame_data);
+	srv->latest_len = f->frame_bytes_used;
+	srv->latest_time = f->capture_time;
+	srv->latest_seq++;
+
+	for (unsigned int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+		if (srv->viewers[i])
+			viewer_send(srv->viewers[i]);
+	}
+
+	return true;
+}
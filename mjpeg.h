@@ -0,0 +1,35 @@
+/*
+ * mjpeg.h
+ *
+ * A small HTTP server for viewers on the LAN, so that they can watch
+ * the camera without going through Appbase. It serves two things:
+ *
+ *     /stream        an MJPEG stream (multipart/x-mixed-replace)
+ *     /snapshot.jpg  the next frame, as a single JPEG
+ *
+ * It runs on the event loop. Every frame is published once, and all viewers
+ * send it right from the same buffer (they just take a reference to it).
+ * Viewers that can't keep up don't queue frames: once they're done with
+ * the one they're sending, they skip to the newest.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef MJPEG_H_
+#define MJPEG_H_
+#include "main.h"
+#include "frame.h"
+
+#define MJPEG_MAX_VIEWERS	32
+
+struct mjpeg_server;
+struct reactor;
+
+struct mjpeg_server *mjpeg_server_new(struct reactor *, const char *addr, int port);
+void mjpeg_server_free(struct mjpeg_server *);
+
+bool mjpeg_server_publish(struct mjpeg_server *, const struct frame *);
+unsigned int mjpeg_server_viewers(struct mjpeg_server *);
+
+#endif /* MJPEG_H_ */
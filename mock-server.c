@@ -0,0 +1,882 @@
+/*
+ * mock-server.c
+ *
+ * A local stand-in for the Appbase REST API, good enough for
+ * load testing the daemon and the client without an Appbase account.
+ *
+ * It understands:
+ *  - PUT /<app>/<type>/<id>                Store a document (what appbase_push_frame() sends)
+ *  - POST /<app>/_bulk                     Bulk "index" actions (what the daemon sends with -H)
+ *  - GET /<app>/<type>/<id>/?stream=true   Stream a document's updates (what appbase_stream_loop() reads)
+ *  - GET /<app>/<type>/<id>                Get the latest version of a document (eg. the list of renditions)
+ *
+ * Every update of a document is fanned out to all of its subscribers.
+ * Documents are shared by reference across subscribers, never copied.
+ * Latency and bandwidth limits can be imposed on every connection to emulate a WAN link.
+ *
+ * Only plain HTTP is supported. Point the daemon and the client to it
+ * with the APPBASE_API_URL environment variable, eg. APPBASE_API_URL=http://127.0.0.1:9200.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "main.h"
+#include "utils.h"
+
+#define DEFAULT_PORT		9200
+#define MAX_CONNS		1024
+#define MAX_HEADER_SIZE		8192
+#define MAX_KEY_LEN		256
+/* Slow subscribers get their oldest pending documents dropped beyond this */
+#define MAX_PENDING_DOCS	8
+#define READ_CHUNK		65536
+#define DEFAULT_STATS_SECS	5
+
+/*
+ * A reference-counted message. Documents fanned out to
+ * subscribers are shared this way.
+ */
+struct msg {
+	unsigned int refcount;
+	size_t len;
+	long long capture_us;	/* capture timestamp of the document, if any */
+	char data[];
+};
+
+struct outq {
+	struct msg *msg;
+	size_t offset;
+	long long ready_at;	/* don't start sending before this time (emulated latency) */
+	bool is_doc;
+	struct outq *next;
+};
+
+enum conn_state {
+	CONN_READ_HEADERS,
+	CONN_READ_BODY,
+	CONN_STREAMING,
+	CONN_CLOSING
+};
+
+struct doc;
+
+struct conn {
+	int fd;
+	enum conn_state state;
+	char *in;
+	size_t in_len;
+	size_t in_size;
+
+	/* Current request */
+	char method[8];
+	char path[MAX_KEY_LEN];
+	size_t content_length;
+	size_t header_len;
+
+	/* Outgoing data */
+	struct outq *out_head, *out_tail;
+	unsigned int out_docs;
+
+	/* Token bucket for the bandwidth limit, in bytes */
+	double tokens;
+	long long tokens_at;
+
+	/* Document this connection is subscribed to, when streaming */
+	struct doc *doc;
+};
+
+/*
+ * A document, identified by "<app>/<type>/<id>".
+ * We keep the last version, so that new subscribers get it straight away,
+ * and some statistics.
+ */
+struct doc {
+	char key[MAX_KEY_LEN];
+	struct msg *last;
+	unsigned int subscribers;
+
+	unsigned long puts;
+	unsigned long long put_bytes;
+	unsigned long delivered;
+	unsigned long dropped;
+	double latency_sum_ms;
+	double latency_max_ms;
+
+	/* Same, for the current stats interval */
+	unsigned long interval_puts;
+	unsigned long interval_delivered;
+	double interval_latency_sum_ms;
+	double interval_latency_max_ms;
+
+	struct doc *next;
+};
+
+static struct conn *conns[MAX_CONNS];
+static struct pollfd pfds[MAX_CONNS + 1];
+static struct doc *docs = NULL;
+
+static long latency_ms = 0;
+static long bandwidth = 0;	/* bytes per second per connection, 0 = unlimited */
+static volatile sig_atomic_t stop = 0;
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+static long long wallclock_us()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long) tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void sighandler(int s)
+{
+	stop = 1;
+}
+
+/*
+ * Messages
+ */
+static struct msg *msg_new(size_t len)
+{
+	struct msg *m = ec_malloc(sizeof(struct msg) + len + 1);
+
+	m->refcount = 1;
+	m->len = len;
+	m->capture_us = 0;
+	return m;
+}
+
+static struct msg *msg_ref(struct msg *m)
+{
+	m->refcount++;
+	return m;
+}
+
+static void msg_unref(struct msg *m)
+{
+	if (m && --m->refcount == 0)
+		free(m);
+}
+
+static struct msg *msg_printf(const char *fmt, ...)
+{
+	va_list ap;
+	char *str;
+	int len;
+	struct msg *m;
+
+	va_start(ap, fmt);
+	len = vasprintf(&str, fmt, ap);
+	va_end(ap);
+	if (len == -1)
+		fatal("Out of memory");
+
+	m = msg_new(len);
+	memcpy(m->data, str, len);
+	free(str);
+
+	return m;
+}
+
+/*
+ * Look for the integer value of '"<key>":' in a JSON document.
+ * We don't want to parse a whole document just for this.
+ */
+static bool find_json_int(const char *data, size_t len, const char *key, long long *val)
+{
+	char pattern[32];
+	const char *p;
+	size_t plen = snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+
+	p = memmem(data, len, pattern, plen);
+	if (!p)
+		return false;
+
+	*val = strtoll(p + plen, NULL, 10);
+	return true;
+}
+
+/*
+ * Connections
+ */
+static void conn_queue(struct conn *c, struct msg *m, long long ready_at, bool is_doc)
+{
+	struct outq *q = ec_malloc(sizeof(struct outq)), *old;
+
+	/*
+	 * If the subscriber can't keep up, drop the oldest documents not yet started.
+	 * The first one in the queue might be half-sent, so leave it alone.
+	 */
+	if (is_doc && c->out_docs >= MAX_PENDING_DOCS && c->out_head && c->out_head->next) {
+		old = c->out_head->next;
+		c->out_head->next = old->next;
+		if (c->out_tail == old)
+			c->out_tail = c->out_head;
+		msg_unref(old->msg);
+		free(old);
+		c->out_docs--;
+		if (c->doc)
+			c->doc->dropped++;
+	}
+
+	q->msg = m;
+	q->offset = 0;
+	q->ready_at = ready_at;
+	q->is_doc = is_doc;
+	q->next = NULL;
+
+	if (c->out_tail)
+		c->out_tail->next = q;
+	else
+		c->out_head = q;
+	c->out_tail = q;
+
+	if (is_doc)
+		c->out_docs++;
+}
+
+static void conn_reply(struct conn *c, int code, const char *status, const char *body)
+{
+	conn_queue(c, msg_printf("HTTP/1.1 %d %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n%s",
+			code, status, strlen(body), body),
+			now_ms() + latency_ms,
+			false);
+}
+
+static void conn_free(int idx)
+{
+	struct conn *c = conns[idx];
+	struct outq *q, *next;
+
+	if (!c)
+		return;
+
+	for (q = c->out_head; q; q = next) {
+		next = q->next;
+		msg_unref(q->msg);
+		free(q);
+	}
+
+	if (c->doc)
+		c->doc->subscribers--;
+
+	close(c->fd);
+	free(c->in);
+	free(c);
+	conns[idx] = NULL;
+}
+
+static struct doc *doc_find(const char *key)
+{
+	for (struct doc *d = docs; d; d = d->next) {
+		if (strcmp(d->key, key) == 0)
+			return d;
+	}
+
+	return NULL;
+}
+
+static struct doc *doc_get(const char *key)
+{
+	struct doc *d = doc_find(key);
+
+	if (d)
+		return d;
+
+	d = ec_malloc(sizeof(struct doc));
+	snprintf(d->key, sizeof(d->key), "%s", key);
+	d->next = docs;
+	docs = d;
+
+	return d;
+}
+
+/*
+ * A new version of a document. Wrap it as the streaming endpoint would,
+ * and send it off to all of its subscribers.
+ */
+static void doc_update(const char *app, const char *type, const char *id,
+		const char *body, size_t body_len)
+{
+	char key[MAX_KEY_LEN];
+	struct doc *d;
+	struct msg *m;
+	long long sec, usec, ready_at = now_ms() + latency_ms;
+
+	snprintf(key, sizeof(key), "%s/%s/%s", app, type, id);
+	d = doc_get(key);
+
+	m = msg_printf("{\"_index\":\"%s\",\"_type\":\"%s\",\"_id\":\"%s\",\"_source\":%.*s}\n",
+			app, type, id, (int) body_len, body);
+	if (find_json_int(body, body_len, "sec", &sec) && find_json_int(body, body_len, "usec", &usec))
+		m->capture_us = sec * 1000000LL + usec;
+
+	d->puts++;
+	d->interval_puts++;
+	d->put_bytes += body_len;
+
+	msg_unref(d->last);
+	d->last = m;
+
+	for (int i = 0; i < MAX_CONNS; i++) {
+		if (conns[i] && conns[i]->doc == d)
+			conn_queue(conns[i], msg_ref(m), ready_at, true);
+	}
+}
+
+/*
+ * Split "/<app>/<type>/<id>" into its pieces.
+ * Any of them can come out empty.
+ */
+static void split_path(char *path, char **app, char **type, char **id)
+{
+	char *saveptr = NULL;
+
+	*app = strtok_r(path, "/", &saveptr);
+	*type = (*app ? strtok_r(NULL, "/", &saveptr) : NULL);
+	*id = (*type ? strtok_r(NULL, "/", &saveptr) : NULL);
+}
+
+/*
+ * Handle an Elasticsearch-style bulk request: pairs of lines,
+ * an action, and then the document. We only support "index".
+ */
+static void handle_bulk(struct conn *c, const char *app, char *body, size_t len)
+{
+	char *line = body, *doc, *end = body + len, *nl, type[MAX_KEY_LEN], id[MAX_KEY_LEN];
+	const char *p;
+	int items = 0;
+
+	while (line < end) {
+		nl = memchr(line, '\n', end - line);
+		if (!nl)
+			break;
+		doc = nl + 1;
+		nl = memchr(doc, '\n', end - doc);
+		if (!nl)
+			nl = end;
+
+		type[0] = id[0] = 0;
+		p = memmem(line, doc - line, "\"_type\":\"", 9);
+		if (p)
+			sscanf(p + 9, "%255[^\"]", type);
+		p = memmem(line, doc - line, "\"_id\":\"", 7);
+		if (p)
+			sscanf(p + 7, "%255[^\"]", id);
+
+		if (type[0] && id[0]) {
+			doc_update(app, type, id, doc, nl - doc);
+			items++;
+		}
+
+		line = nl + 1;
+	}
+
+	conn_reply(c, 200, "OK", (items ? "{\"took\":0,\"errors\":false}" : "{\"took\":0,\"errors\":true}"));
+}
+
+static void handle_request(struct conn *c)
+{
+	char path[MAX_KEY_LEN], *query, *app, *type, *id;
+	char *body = c->in + c->header_len;
+	char reply[MAX_KEY_LEN * 2];
+	struct doc *d;
+
+	snprintf(path, sizeof(path), "%s", c->path);
+	query = strchr(path, '?');
+	if (query)
+		*(query++) = 0;
+	split_path(path, &app, &type, &id);
+
+	if (!app || !type) {
+		conn_reply(c, 404, "Not Found", "{\"error\":\"not found\"}");
+		return;
+	}
+
+	if (strcmp(c->method, "POST") == 0 && strcmp(type, "_bulk") == 0) {
+		handle_bulk(c, app, body, c->content_length);
+	} else if (strcmp(c->method, "PUT") == 0 && id) {
+		doc_update(app, type, id, body, c->content_length);
+		snprintf(reply, sizeof(reply),
+				"{\"_index\":\"%s\",\"_type\":\"%s\",\"_id\":\"%s\",\"created\":false}",
+				app, type, id);
+		conn_reply(c, 200, "OK", reply);
+	} else if (strcmp(c->method, "GET") == 0 && id && query && strstr(query, "stream=true")) {
+		/*
+		 * Long-lived stream. No Content-Length: the stream
+		 * goes on until one of us closes the connection.
+		 */
+		snprintf(reply, sizeof(reply), "%s/%s/%s", app, type, id);
+		d = doc_get(reply);
+		d->subscribers++;
+		c->doc = d;
+		c->state = CONN_STREAMING;
+
+		conn_queue(c, msg_printf("HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/json\r\n"
+				"Connection: close\r\n"
+				"\r\n"),
+				now_ms() + latency_ms,
+				false);
+		if (d->last)
+			conn_queue(c, msg_ref(d->last), now_ms() + latency_ms, true);
+	} else if (strcmp(c->method, "GET") == 0 && id) {
+		snprintf(reply, sizeof(reply), "%s/%s/%s", app, type, id);
+		d = doc_find(reply);
+		if (!d || !d->last) {
+			conn_reply(c, 404, "Not Found", "{\"found\":false}");
+			return;
+		}
+
+		conn_queue(c, msg_printf("HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/json\r\n"
+				"Content-Length: %zu\r\n"
+				"\r\n%.*s",
+				d->last->len, (int) d->last->len, d->last->data),
+				now_ms() + latency_ms,
+				false);
+	} else {
+		conn_reply(c, 400, "Bad Request", "{\"error\":\"unsupported request\"}");
+	}
+}
+
+/*
+ * Parse the request line and the headers we care about.
+ * Returns false if the request is malformed.
+ */
+static bool parse_headers(struct conn *c, char *end)
+{
+	char *line, *saveptr = NULL, *value;
+	bool expect_continue = false;
+
+	*end = 0;
+	c->header_len = end - c->in + 4;
+	c->content_length = 0;
+
+	line = strtok_r(c->in, "\r\n", &saveptr);
+	if (!line || sscanf(line, "%7s %255s", c->method, c->path) != 2)
+		return false;
+
+	while ((line = strtok_r(NULL, "\r\n", &saveptr))) {
+		value = strchr(line, ':');
+		if (!value)
+			continue;
+		*(value++) = 0;
+		while (*value == ' ')
+			value++;
+
+		if (strcasecmp(line, "Content-Length") == 0)
+			c->content_length = strtoul(value, NULL, 10);
+		else if (strcasecmp(line, "Expect") == 0 && strcasecmp(value, "100-continue") == 0)
+			expect_continue = true;
+	}
+
+	/* libcurl asks for this before sending large bodies */
+	if (expect_continue)
+		conn_queue(c, msg_printf("HTTP/1.1 100 Continue\r\n\r\n"), now_ms(), false);
+
+	return true;
+}
+
+static void conn_process_input(struct conn *c)
+{
+	char *end;
+	size_t consumed;
+
+	for (;;) {
+		if (c->state == CONN_READ_HEADERS) {
+			end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+			if (!end) {
+				if (c->in_len > MAX_HEADER_SIZE)
+					c->state = CONN_CLOSING;
+				return;
+			}
+
+			if (!parse_headers(c, end)) {
+				c->state = CONN_CLOSING;
+				return;
+			}
+			c->state = CONN_READ_BODY;
+		}
+
+		if (c->state != CONN_READ_BODY)
+			return;
+
+		if (c->in_len < c->header_len + c->content_length)
+			return;
+
+		c->state = CONN_READ_HEADERS;
+		handle_request(c);
+
+		/* Keep-alive: there might be another request right after this one */
+		consumed = c->header_len + c->content_length;
+		memmove(c->in, c->in + consumed, c->in_len - consumed);
+		c->in_len -= consumed;
+
+		if (c->state == CONN_STREAMING)
+			return;
+	}
+}
+
+/*
+ * Returns how many bytes we're allowed to transfer on this connection now.
+ */
+static size_t conn_allowance(struct conn *c, long long now)
+{
+	double burst;
+
+	if (!bandwidth)
+		return SIZE_MAX;
+
+	burst = (bandwidth / 10 > READ_CHUNK ? bandwidth / 10 : READ_CHUNK);
+	c->tokens += (now - c->tokens_at) * bandwidth / 1000.0;
+	if (c->tokens > burst)
+		c->tokens = burst;
+	c->tokens_at = now;
+
+	return (c->tokens > 0 ? (size_t) c->tokens : 0);
+}
+
+static void conn_read(struct conn *c, long long now)
+{
+	size_t allowed = conn_allowance(c, now), want;
+	ssize_t got;
+
+	if (c->in_size - c->in_len < READ_CHUNK) {
+		c->in_size = c->in_len + READ_CHUNK * 2;
+		c->in = ec_realloc(c->in, c->in_size + 1);
+	}
+
+	want = c->in_size - c->in_len;
+	if (want > allowed)
+		want = allowed;
+	if (!want)
+		return;
+
+	got = recv(c->fd, c->in + c->in_len, want, 0);
+	if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+		c->state = CONN_CLOSING;
+		return;
+	}
+	if (got < 0)
+		return;
+
+	c->in_len += got;
+	c->tokens -= got;
+	c->in[c->in_len] = 0;
+
+	if (c->state != CONN_STREAMING)
+		conn_process_input(c);
+}
+
+static void doc_delivered(struct doc *d, const struct msg *m)
+{
+	double latency;
+
+	d->delivered++;
+	d->interval_delivered++;
+
+	if (m->capture_us) {
+		latency = (wallclock_us() - m->capture_us) / 1000.0;
+		d->latency_sum_ms += latency;
+		d->interval_latency_sum_ms += latency;
+		if (latency > d->latency_max_ms)
+			d->latency_max_ms = latency;
+		if (latency > d->interval_latency_max_ms)
+			d->interval_latency_max_ms = latency;
+	}
+}
+
+static void conn_write(struct conn *c, long long now)
+{
+	struct outq *q;
+	size_t allowed = conn_allowance(c, now), len;
+	ssize_t sent;
+
+	while ((q = c->out_head) && q->ready_at <= now && allowed) {
+		len = q->msg->len - q->offset;
+		if (len > allowed)
+			len = allowed;
+
+		sent = send(c->fd, q->msg->data + q->offset, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				c->state = CONN_CLOSING;
+			return;
+		}
+
+		q->offset += sent;
+		c->tokens -= sent;
+		allowed -= sent;
+
+		if (q->offset < q->msg->len)
+			return;
+
+		/* Fully sent */
+		if (q->is_doc) {
+			doc_delivered(c->doc, q->msg);
+			c->out_docs--;
+		}
+
+		c->out_head = q->next;
+		if (!c->out_head)
+			c->out_tail = NULL;
+		msg_unref(q->msg);
+		free(q);
+	}
+}
+
+/*
+ * Statistics
+ * One line per document per interval on stdout, in "key=value" format.
+ */
+static void print_stats(double secs, bool summary)
+{
+	struct doc *d;
+	unsigned long delivered;
+	double latency_sum, latency_max;
+
+	for (d = docs; d; d = d->next) {
+		if (summary) {
+			delivered = d->delivered;
+			latency_sum = d->latency_sum_ms;
+			latency_max = d->latency_max_ms;
+			printf("SUMMARY doc=%s secs=%.2f puts=%lu put_fps=%.2f put_kbps=%.1f subscribers=%u "
+					"delivered=%lu delivered_fps=%.2f dropped=%lu latency_avg_ms=%.1f latency_max_ms=%.1f\n",
+					d->key, secs, d->puts, d->puts / secs, d->put_bytes * 8 / 1000.0 / secs, d->subscribers,
+					delivered, delivered / secs, d->dropped,
+					(delivered ? latency_sum / delivered : 0), latency_max);
+		} else {
+			delivered = d->interval_delivered;
+			latency_sum = d->interval_latency_sum_ms;
+			latency_max = d->interval_latency_max_ms;
+			printf("STATS doc=%s put_fps=%.2f subscribers=%u delivered_fps=%.2f "
+					"latency_avg_ms=%.1f latency_max_ms=%.1f\n",
+					d->key, d->interval_puts / secs, d->subscribers, delivered / secs,
+					(delivered ? latency_sum / delivered : 0), latency_max);
+
+			d->interval_puts = 0;
+			d->interval_delivered = 0;
+			d->interval_latency_sum_ms = 0;
+			d->interval_latency_max_ms = 0;
+		}
+	}
+
+	fflush(stdout);
+}
+
+static int open_listener(const char *addr, int port)
+{
+	struct sockaddr_in sin;
+	int fd, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+		fatal("Invalid listen address");
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		fatal("Could not create socket");
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1 || listen(fd, 128) == -1)
+		fatal("Could not listen on the requested address");
+
+	return fd;
+}
+
+static void accept_conns(int lfd, long long now)
+{
+	struct conn *c;
+	int fd, one = 1, idx;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		for (idx = 0; idx < MAX_CONNS && conns[idx]; idx++);
+		if (idx == MAX_CONNS) {
+			close(fd);
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c = ec_malloc(sizeof(struct conn));
+		c->fd = fd;
+		c->state = CONN_READ_HEADERS;
+		c->tokens_at = now;
+		conns[idx] = c;
+	}
+}
+
+static void print_usage_and_exit(const char *name)
+{
+	if (name) {
+		printf("Usage: %s [OPTIONS]\n"
+				"Options:\n"
+				"    -a addr        Listen on this address (default: 127.0.0.1)\n"
+				"    -p port        Listen on this port (default: %d)\n"
+				"    -l msecs       Delay every response and stream update this much\n"
+				"    -b kbps        Limit every connection to this bandwidth, in kbit/s, each way\n"
+				"    -i secs        Print statistics every this many seconds (default: %d)\n",
+				name, DEFAULT_PORT, DEFAULT_STATS_SECS);
+	}
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, lfd, timeout, nfds;
+	char *endptr;
+	const char *addr = "127.0.0.1";
+	long port = DEFAULT_PORT, stats_secs = DEFAULT_STATS_SECS;
+	long long now, start, last_stats, next_event;
+	struct sigaction sig;
+	struct conn *c;
+	struct outq *q;
+
+	while ((opt = getopt(argc, argv, "a:p:l:b:i:")) != -1) {
+		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = strtol(optarg, &endptr, 10);
+			if (*endptr || port <= 0 || port > 65535)
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'l':
+			latency_ms = strtol(optarg, &endptr, 10);
+			if (*endptr || latency_ms < 0)
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'b':
+			bandwidth = strtol(optarg, &endptr, 10) * 1000 / 8;
+			if (*endptr || bandwidth < 0)
+				print_usage_and_exit(argv[0]);
+			break;
+		case 'i':
+			stats_secs = strtol(optarg, &endptr, 10);
+			if (*endptr || stats_secs <= 0)
+				print_usage_and_exit(argv[0]);
+			break;
+		default:
+			print_usage_and_exit(argv[0]);
+			break;
+		}
+	}
+
+	memset(&sig, 0, sizeof(sig));
+	sig.sa_handler = sighandler;
+	sigemptyset(&sig.sa_mask);
+	sigaction(SIGINT, &sig, NULL);
+	sigaction(SIGTERM, &sig, NULL);
+
+	lfd = open_listener(addr, port);
+	fprintf(stderr, "Listening on http://%s:%ld\n", addr, port);
+
+	start = last_stats = now_ms();
+
+	while (!stop) {
+		now = now_ms();
+		next_event = last_stats + stats_secs * 1000;
+
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		nfds = 1;
+
+		for (int i = 0; i < MAX_CONNS; i++) {
+			c = conns[i];
+			pfds[i + 1].fd = -1;
+			pfds[i + 1].events = 0;
+			pfds[i + 1].revents = 0;
+			if (!c)
+				continue;
+
+			/* Out of tokens: come back in a bit, when the bucket has refilled */
+			pfds[i + 1].fd = c->fd;
+			if (conn_allowance(c, now) == 0) {
+				if (now + 10 < next_event)
+					next_event = now + 10;
+				nfds = i + 2;
+				continue;
+			}
+
+			if (c->state != CONN_CLOSING)
+				pfds[i + 1].events |= POLLIN;
+
+			q = c->out_head;
+			if (q) {
+				if (q->ready_at <= now)
+					pfds[i + 1].events |= POLLOUT;
+				else if (q->ready_at < next_event)
+					next_event = q->ready_at;
+			}
+			nfds = i + 2;
+		}
+
+		timeout = (next_event > now ? (int) (next_event - now) : 0);
+		if (poll(pfds, nfds, timeout) == -1 && errno != EINTR)
+			fatal("poll() failed");
+
+		now = now_ms();
+
+		if (pfds[0].revents & POLLIN)
+			accept_conns(lfd, now);
+
+		for (int i = 0; i < MAX_CONNS; i++) {
+			c = conns[i];
+			if (!c)
+				continue;
+
+			if (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				conn_read(c, now);
+			if (c->out_head && c->state != CONN_CLOSING)
+				conn_write(c, now);
+
+			if (c->state == CONN_CLOSING)
+				conn_free(i);
+		}
+
+		if (now - last_stats >= stats_secs * 1000) {
+			print_stats((now - last_stats) / 1000.0, false);
+			last_stats = now;
+		}
+	}
+
+	print_stats((now_ms() - start) / 1000.0, true);
+
+	for (int i = 0; i < MAX_CONNS; i++)
+		conn_free(i);
+	close(lfd);
+
+	return 0;
+}
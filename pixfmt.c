@@ -0,0 +1,230 @@
+/*
+ * pixfmt.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <linux/videodev2.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "pixfmt.h"
+
+static void yuyv_to_yuyv(const unsigned char *in, size_t stride,
+		size_t width, size_t height, unsigned char *out)
+{
+	if (stride == width * 2) {
+		memcpy(out, in, width * height * 2);
+		return;
+	}
+
+	for (size_t y = 0; y < height; y++, in += stride, out += width * 2)
+		memcpy(out, in, width * 2);
+}
+
+/* Same as YUYV, with the bytes of every pair swapped */
+static void uyvy_to_yuyv(const unsigned char *in, size_t stride,
+		size_t width, size_t height, unsigned char *out)
+{
+	for (size_t y = 0; y < height; y++, in += stride, out += width * 2) {
+		size_t x = 0;
+
+#ifdef __SSE2__
+		for (; x + 8 <= width; x += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (in + x * 2));
+
+			_mm_storeu_si128((__m128i *) (out + x * 2),
+					_mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+		}
+#endif
+
+		for (; x < width; x++) {
+			out[x * 2] = in[x * 2 + 1];
+			out[x * 2 + 1] = in[x * 2];
+		}
+	}
+}
+
+/*
+ * A row of lumas, and a row of interleaved chroma (U, V, U, V...) for every pair of them.
+ * The chroma row is already in the order YUYV wants it, so they just need to be interleaved.
+ */
+static void interleave_row(const unsigned char *luma, const unsigned char *chroma,
+		size_t width, unsigned char *out)
+{
+	size_t x = 0;
+
+#ifdef __SSE2__
+	for (; x + 16 <= width; x += 16) {
+		__m128i y = _mm_loadu_si128((const __m128i *) (luma + x)),
+			c = _mm_loadu_si128((const __m128i *) (chroma + x));
+
+		_mm_storeu_si128((__m128i *) (out + x * 2), _mm_unpacklo_epi8(y, c));
+		_mm_storeu_si128((__m128i *) (out + x * 2 + 16), _mm_unpackhi_epi8(y, c));
+	}
+#endif
+
+	for (; x < width; x++) {
+		out[x * 2] = luma[x];
+		out[x * 2 + 1] = chroma[x];
+	}
+}
+
+/* 4:2:0 chroma has half the rows: every one of them goes with two rows of lumas */
+static void nv12_to_yuyv(const unsigned char *in, size_t stride,
+		size_t width, size_t height, unsigned char *out)
+{
+	const unsigned char *chroma = in + stride * height;
+
+	for (size_t y = 0; y < height; y++, out += width * 2)
+		interleave_row(in + y * stride, chroma + (y / 2) * stride, width, out);
+}
+
+static void yuv420_to_yuyv(const unsigned char *in, size_t stride,
+		size_t width, size_t height, unsigned char *out)
+{
+	size_t cstride = stride / 2;
+	const unsigned char *u_plane = in + stride * height,
+		*v_plane = u_plane + cstride * (height / 2);
+
+	for (size_t y = 0; y < height; y++, out += width * 2) {
+		const unsigned char *luma = in + y * stride,
+			*u = u_plane + (y / 2) * cstride,
+			*v = v_plane + (y / 2) * cstride;
+		size_t x = 0;
+
+#ifdef __SSE2__
+		for (; x + 16 <= width; x += 16) {
+			__m128i l = _mm_loadu_si128((const __m128i *) (luma + x)),
+				c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (u + x / 2)),
+						_mm_loadl_epi64((const __m128i *) (v + x / 2)));
+
+			_mm_storeu_si128((__m128i *) (out + x * 2), _mm_unpacklo_epi8(l, c));
+			_mm_storeu_si128((__m128i *) (out + x * 2 + 16), _mm_unpackhi_epi8(l, c));
+		}
+#endif
+
+		for (; x + 2 <= width; x += 2) {
+			out[x * 2] = luma[x];
+			out[x * 2 + 1] = u[x / 2];
+			out[x * 2 + 2] = luma[x + 1];
+			out[x * 2 + 3] = v[x / 2];
+		}
+	}
+}
+
+static void grey_to_yuyv(const unsigned char *in, size_t stride,
+		size_t width, size_t height, unsigned char *out)
+{
+	for (size_t y = 0; y < height; y++, in += stride, out += width * 2) {
+		size_t x = 0;
+
+#ifdef __SSE2__
+		const __m128i neutral = _mm_set1_epi8((char) 128);
+
+		for (; x + 16 <= width; x += 16) {
+			__m128i l = _mm_loadu_si128((const __m128i *) (in + x));
+
+			_mm_storeu_si128((__m128i *) (out + x * 2), _mm_unpacklo_epi8(l, neutral));
+			_mm_storeu_si128((__m128i *) (out + x * 2 + 16), _mm_unpackhi_epi8(l, neutral));
+		}
+#endif
+
+		for (; x < width; x++) {
+			out[x * 2] = in[x];
+			out[x * 2 + 1] = 128;
+		}
+	}
+}
+
+static inline unsigned char clamp_byte(int v)
+{
+	return (v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+/*
+ * Full range BT.601, which is what JPEG expects, in 16-bit fixed point.
+ * Chroma is worked out from the sum of each pair of pixels, hence the extra bit of shift.
+ * There's no SIMD version: deinterleaving 3-byte pixels takes shuffles SSE2 doesn't have.
+ */
+static void rgb24_to_yuyv(const unsigned char *in, size_t stride,
+		size_t width, size_t height, unsigned char *out)
+{
+	for (size_t y = 0; y < height; y++, in += stride) {
+		const unsigned char *p = in;
+
+		for (size_t x = 0; x + 2 <= width; x += 2, p += 6, out += 4) {
+			int r = p[0] + p[3], g = p[1] + p[4], b = p[2] + p[5];
+
+			out[0] = (19595 * p[0] + 38470 * p[1] + 7471 * p[2] + 32768) >> 16;
+			out[2] = (19595 * p[3] + 38470 * p[4] + 7471 * p[5] + 32768) >> 16;
+			out[1] = clamp_byte(((128 << 17) + 65536 - 11059 * r - 21709 * g + 32768 * b) >> 17);
+			out[3] = clamp_byte(((128 << 17) + 65536 + 32768 * r - 27439 * g - 5329 * b) >> 17);
+		}
+	}
+}
+
+/* In order of preference: the ones that are cheapest to convert go first */
+static const struct pixfmt formats[] = {
+	{ V4L2_PIX_FMT_YUYV, "YUYV", 1, 2, 16, yuyv_to_yuyv },
+	{ V4L2_PIX_FMT_UYVY, "UYVY", 1, 2, 16, uyvy_to_yuyv },
+	{ V4L2_PIX_FMT_NV12, "NV12", 2, 1, 12, nv12_to_yuyv },
+	{ V4L2_PIX_FMT_YUV420, "YUV420", 3, 1, 12, yuv420_to_yuyv },
+	{ V4L2_PIX_FMT_GREY, "GREY", 1, 1, 8, grey_to_yuyv },
+	{ V4L2_PIX_FMT_RGB24, "RGB24", 1, 3, 24, rgb24_to_yuyv }
+};
+
+const struct pixfmt *pixfmt_find(uint32_t fourcc)
+{
+	for (unsigned int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (formats[i].fourcc == fourcc)
+			return &formats[i];
+	}
+
+	return NULL;
+}
+
+const struct pixfmt *pixfmt_find_name(const char *name)
+{
+	if (!name)
+		return NULL;
+
+	for (unsigned int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (strcasecmp(formats[i].name, name) == 0)
+			return &formats[i];
+	}
+
+	return NULL;
+}
+
+/* For going through all of them, in order of preference. NULL past the last one */
+const struct pixfmt *pixfmt_get(unsigned int index)
+{
+	return (index < sizeof(formats) / sizeof(formats[0]) ? &formats[index] : NULL);
+}
+
+size_t pixfmt_min_stride(const struct pixfmt *fmt, size_t width)
+{
+	return (fmt ? width * fmt->bytes_per_pixel : 0);
+}
+
+/*
+ * 4:2:0 formats have a row of chroma for every two of luma, so their frames
+ * must have an even number of rows. Otherwise the last one would have no chroma.
+ */
+bool pixfmt_height_ok(const struct pixfmt *fmt, size_t height)
+{
+	return (fmt && (fmt->planes == 1 || height % 2 == 0));
+}
+
+/* Bytes taken by a frame with rows of 'stride' bytes, in all its planes */
+size_t pixfmt_frame_size(const struct pixfmt *fmt, size_t stride, size_t height)
+{
+	if (!fmt)
+		return 0;
+
+	return stride * height * fmt->bits_per_pixel / (8 * fmt->bytes_per_pixel);
+}
@@ -0,0 +1,50 @@
+/*
+ * pixfmt.h
+ *
+ * The pixel formats we can take from cameras. Everything past capture
+ * (scaling, analysis, the encoder) works on YUYV, so every format comes
+ * with its own kernel that converts a whole frame to it. The kernel is
+ * picked once, when the camera starts streaming, and then it's just
+ * called for every frame, straight from the driver's buffer.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef PIXFMT_H_
+#define PIXFMT_H_
+#include <stdint.h>
+#include <stddef.h>
+#include "main.h"
+
+/*
+ * Converts a 'width' x 'height' frame to YUYV in 'out', which is always packed
+ * (width * 2 bytes per row). 'stride' is the length of a row of the first plane of 'in'.
+ * Chroma planes follow it, with rows of 'stride' bytes for NV12, and half that for YUV420.
+ * Widths must be even, like for YUYV itself, and so must heights be for 4:2:0 formats
+ * (see pixfmt_height_ok()).
+ */
+typedef void (* pixfmt_convert_t) (const unsigned char *in, size_t stride,
+		size_t width, size_t height, unsigned char *out);
+
+struct pixfmt {
+	/* V4L2 fourcc, and a name for humans */
+	uint32_t fourcc;
+	const char *name;
+	/* 1 for packed formats, or the number of planes, which follow each other in the buffer */
+	unsigned int planes;
+	/* Bytes per pixel in the first plane, and bits per pixel in all planes together */
+	unsigned int bytes_per_pixel;
+	unsigned int bits_per_pixel;
+	pixfmt_convert_t to_yuyv;
+};
+
+const struct pixfmt *pixfmt_find(uint32_t fourcc);
+const struct pixfmt *pixfmt_find_name(const char *name);
+const struct pixfmt *pixfmt_get(unsigned int index);
+
+size_t pixfmt_min_stride(const struct pixfmt *, size_t width);
+bool pixfmt_height_ok(const struct pixfmt *, size_t height);
+size_t pixfmt_frame_size(const struct pixfmt *, size_t stride, size_t height);
+
+#endif /* PIXFMT_H_ */
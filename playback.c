@@ -0,0 +1,380 @@
+/*
+ * playback.c
+ *
+ * Playback of frames stored with history enabled.
+ * A background thread pages through the stored frames and decodes them
+ * ahead of the playhead, so that the render loop only has to pick them up
+ * when they are due.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "main.h"
+#include "utils.h"
+#include "cb.h"
+#include "playback.h"
+
+/* How many decoded frames we keep ready ahead of the playhead */
+#define PLAYBACK_PREFETCH	64
+/*
+ * If the next frame is further than this away from the playhead (in stream time),
+ * we consider there's a hole in the recording (eg. the daemon was stopped)
+ * and jump straight to it instead of showing a frozen picture.
+ */
+#define PLAYBACK_MAX_GAP_US	2000000LL
+#define PLAYBACK_IDLE_MS	50
+
+struct playback_frame {
+	struct frame frame;
+	unsigned int generation;
+};
+
+struct playback {
+	struct appbase *ab;
+	struct cb *cb;
+	pthread_t thread;
+	unsigned int batch;
+	time_t until;
+	atomic_bool stop;
+
+	/*
+	 * Every seek bumps 'generation'. Frames fetched before a seek
+	 * carry an older generation and are discarded by the reader.
+	 * 'seek_to' and 'generation' are protected by 'lock'.
+	 * 'exhausted' holds the generation for which we've already
+	 * reached the end of the requested range.
+	 */
+	pthread_mutex_t lock;
+	atomic_uint generation;
+	atomic_uint exhausted;
+	struct timeval seek_to;
+
+	/* Only touched by the render thread */
+	struct playback_frame *pending;
+	bool anchored;
+	long long anchor_ts;
+	long long anchor_wall;
+	long long playhead;
+	double speed;
+};
+
+static long long tv_to_us(const struct timeval *tv)
+{
+	return (long long) tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static void us_to_tv(long long us, struct timeval *tv)
+{
+	tv->tv_sec = us / 1000000LL;
+	tv->tv_usec = us % 1000000LL;
+}
+
+static long long monotonic_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+static void free_playback_frame(struct playback_frame *pf)
+{
+	if (pf) {
+		if (pf->frame.frame_data)
+			free(pf->frame.frame_data);
+		free(pf);
+	}
+}
+
+struct fetch_ctx {
+	struct playback *pb;
+	unsigned int generation;
+	struct timeval last;
+};
+
+/*
+ * Called by appbase_history_query() for every frame in a batch.
+ * We're already given the base64-decoded image, so just queue it up.
+ * This blocks when the prefetch queue is full, which is how we
+ * keep from running too far ahead of the playhead.
+ */
+static bool fetch_frame_cb(char *data, size_t len, const struct timeval *ts, void *userdata)
+{
+	struct fetch_ctx *ctx = userdata;
+	struct playback *pb = ctx->pb;
+	struct playback_frame *pf;
+
+	if (atomic_load(&pb->stop) || atomic_load(&pb->generation) != ctx->generation) {
+		free(data);
+		return false;
+	}
+
+	pf = ec_malloc(sizeof(struct playback_frame));
+	pf->frame.frame_data = (unsigned char *) data;
+	pf->frame.frame_size = len;
+	pf->frame.frame_bytes_used = len;
+	pf->frame.capture_time = *ts;
+	pf->generation = ctx->generation;
+
+	cb_append_wait(pb->cb, (const char *) pf, sizeof(struct playback_frame));
+	ctx->last = *ts;
+
+	return true;
+}
+
+static void *prefetch_loop(void *ptr)
+{
+	struct playback *pb = ptr;
+	struct fetch_ctx ctx;
+	int count;
+
+	ctx.pb = pb;
+	ctx.generation = ~0U;
+
+	while (!atomic_load(&pb->stop)) {
+		if (ctx.generation != atomic_load(&pb->generation)) {
+			/* First round, or the render thread asked us to seek */
+			pthread_mutex_lock(&pb->lock);
+			ctx.generation = atomic_load(&pb->generation);
+			ctx.last = pb->seek_to;
+			pthread_mutex_unlock(&pb->lock);
+		}
+
+		if (atomic_load(&pb->exhausted) == ctx.generation) {
+			sleep_ms(PLAYBACK_IDLE_MS);
+			continue;
+		}
+
+		count = appbase_history_query(pb->ab, &ctx.last, pb->until, pb->batch,
+				fetch_frame_cb, &ctx);
+		if (count == 0) {
+			atomic_store(&pb->exhausted, ctx.generation);
+		} else if (count == -1) {
+			fprintf(stderr, "ERROR: Could not retrieve frames from Appbase\n");
+			sleep_ms(PLAYBACK_IDLE_MS * 10);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Pull the next frame of the current generation out of the prefetch queue,
+ * dropping any leftovers from before the last seek.
+ */
+static struct playback_frame *playback_dequeue(struct playback *pb)
+{
+	struct playback_frame *pf;
+	size_t len;
+
+	while (cb_try_next(pb->cb, (const char **) &pf, &len)) {
+		if (pf->generation == atomic_load(&pb->generation))
+			return pf;
+		free_playback_frame(pf);
+	}
+
+	return NULL;
+}
+
+static void playback_drain(struct playback *pb)
+{
+	struct playback_frame *pf;
+	size_t len;
+
+	while (cb_try_next(pb->cb, (const char **) &pf, &len))
+		free_playback_frame(pf);
+}
+
+struct playback *playback_start(struct appbase *ab,
+		const struct timeval *from, time_t until,
+		unsigned int batch)
+{
+	struct playback *pb;
+
+	if (!ab || !from || !batch)
+		return NULL;
+
+	pb = ec_malloc(sizeof(struct playback));
+	pb->ab = ab;
+	pb->batch = batch;
+	pb->until = until;
+	pb->speed = 1.0;
+	pb->pending = NULL;
+	pb->anchored = false;
+
+	/* Queries are exclusive, so start one microsecond before 'from' */
+	us_to_tv(tv_to_us(from) - 1, &pb->seek_to);
+	pb->playhead = tv_to_us(from);
+
+	atomic_init(&pb->stop, false);
+	atomic_init(&pb->generation, 0);
+	atomic_init(&pb->exhausted, ~0U);
+	pthread_mutex_init(&pb->lock, NULL);
+
+	pb->cb = cb_start(PLAYBACK_PREFETCH);
+	if (!pb->cb)
+		goto fail;
+
+	if (pthread_create(&pb->thread, NULL, prefetch_loop, pb) != 0)
+		goto fail;
+
+	return pb;
+
+fail:
+	if (pb->cb)
+		cb_destroy(pb->cb);
+	pthread_mutex_destroy(&pb->lock);
+	free(pb);
+	return NULL;
+}
+
+void playback_stop(struct playback *pb)
+{
+	if (pb) {
+		atomic_store(&pb->stop, true);
+
+		/* Make sure the prefetcher is not blocked on a full queue */
+		while (pthread_tryjoin_np(pb->thread, NULL) != 0) {
+			playback_drain(pb);
+			sleep_ms(1);
+		}
+
+		playback_drain(pb);
+		free_playback_frame(pb->pending);
+		cb_destroy(pb->cb);
+		pthread_mutex_destroy(&pb->lock);
+		free(pb);
+	}
+}
+
+/*
+ * Non-blocking. Returns true and fills in 'f' if a frame is due for rendering now.
+ * The caller should free 'f->frame_data' afterwards.
+ */
+bool playback_next(struct playback *pb, struct frame *f)
+{
+	long long now, ts;
+
+	if (!pb || !f)
+		return false;
+
+	if (!pb->pending)
+		pb->pending = playback_dequeue(pb);
+	if (!pb->pending)
+		return false;
+
+	now = monotonic_us();
+	ts = tv_to_us(&pb->pending->frame.capture_time);
+
+	if (pb->anchored)
+		pb->playhead = pb->anchor_ts + (long long) ((now - pb->anchor_wall) * pb->speed);
+
+	if (!pb->anchored || ts - pb->playhead > PLAYBACK_MAX_GAP_US) {
+		/* Start of playback, right after a seek, or a hole in the recording */
+		pb->anchor_ts = ts;
+		pb->anchor_wall = now;
+		pb->playhead = ts;
+		pb->anchored = true;
+	}
+
+	if (ts > pb->playhead)
+		return false;
+
+	f->frame_data = pb->pending->frame.frame_data;
+	f->frame_size = pb->pending->frame.frame_size;
+	f->frame_bytes_used = pb->pending->frame.frame_bytes_used;
+	f->capture_time = pb->pending->frame.capture_time;
+
+	free(pb->pending);
+	pb->pending = NULL;
+
+	return true;
+}
+
+bool playback_finished(struct playback *pb)
+{
+	size_t len;
+	const char *data;
+
+	if (!pb)
+		return true;
+
+	if (pb->pending || atomic_load(&pb->exhausted) != atomic_load(&pb->generation))
+		return false;
+
+	if (cb_try_next(pb->cb, &data, &len)) {
+		/* Not quite. Keep it for the next call to playback_next() */
+		pb->pending = (struct playback_frame *) data;
+		if (pb->pending->generation != atomic_load(&pb->generation)) {
+			free_playback_frame(pb->pending);
+			pb->pending = NULL;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Move the playhead 'delta_ms' milliseconds (of stream time) forward, or backwards
+ * if negative. Whatever was prefetched is thrown away, and the prefetcher
+ * starts over from the new position.
+ */
+void playback_seek(struct playback *pb, long delta_ms)
+{
+	long long target;
+
+	if (!pb)
+		return;
+
+	target = pb->playhead + (long long) delta_ms * 1000LL;
+
+	pthread_mutex_lock(&pb->lock);
+	us_to_tv(target - 1, &pb->seek_to);
+	atomic_fetch_add(&pb->generation, 1);
+	pthread_mutex_unlock(&pb->lock);
+
+	free_playback_frame(pb->pending);
+	pb->pending = NULL;
+	pb->anchored = false;
+	pb->playhead = target;
+}
+
+void playback_set_speed(struct playback *pb, double speed)
+{
+	long long now;
+
+	if (!pb || speed <= 0)
+		return;
+
+	/* Re-anchor at the current position, so that the playhead does not jump */
+	if (pb->anchored) {
+		now = monotonic_us();
+		pb->playhead = pb->anchor_ts + (long long) ((now - pb->anchor_wall) * pb->speed);
+		pb->anchor_ts = pb->playhead;
+		pb->anchor_wall = now;
+	}
+
+	pb->speed = speed;
+}
+
+double playback_get_speed(struct playback *pb)
+{
+	return (pb ? pb->speed : 0);
+}
@@ -0,0 +1,35 @@
+/*
+ * playback.h
+ *
+ * Playback of frames stored with history enabled.
+ * A background thread pages through the stored frames and decodes them
+ * ahead of the playhead, so that the render loop only has to pick them up
+ * when they are due.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef PLAYBACK_H_
+#define PLAYBACK_H_
+#include <sys/time.h>
+#include "main.h"
+#include "frame.h"
+#include "appbase.h"
+
+struct playback;
+
+struct playback *playback_start(struct appbase *ab,
+		const struct timeval *from,
+		time_t until,
+		unsigned int batch);
+void playback_stop(struct playback *);
+
+bool playback_next(struct playback *, struct frame *);
+bool playback_finished(struct playback *);
+
+void playback_seek(struct playback *, long delta_ms);
+void playback_set_speed(struct playback *, double speed);
+double playback_get_speed(struct playback *);
+
+#endif /* PLAYBACK_H_ */
@@ -0,0 +1,212 @@
+/*
+ * pool.c
+ *
+ * A slab pool of reference counted buffers, for frame data.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pool.h"
+#include "utils.h"
+
+/* Smallest size class is 4 KiB, biggest is 16 MiB */
+#define POOL_MIN_SHIFT		12
+#define POOL_MAX_SHIFT		24
+#define POOL_NUM_CLASSES	(POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+/* Slabs are carved out of chunks of at least this size (one huge page) */
+#define POOL_SLAB_SIZE		(2UL << 20)
+/* Class for buffers bigger than the biggest class, which are mapped on their own */
+#define POOL_CLASS_NONE		-1
+
+/*
+ * Header placed right before the data of every buffer.
+ * It's cache line sized, so that the data is cache line aligned too.
+ */
+struct pool_buf {
+	atomic_uint refs;
+	int class;
+	size_t map_len;
+	struct pool_buf *next;
+} __attribute__((aligned(64)));
+
+struct pool_class {
+	pthread_mutex_t lock;
+	struct pool_buf *free;
+};
+
+static struct pool_class classes[POOL_NUM_CLASSES] = {
+	[0 ... POOL_NUM_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static bool use_hugepages;
+static atomic_bool in_use;
+
+static inline struct pool_buf *buf_header(const void *buf)
+{
+	return ((struct pool_buf *) buf) - 1;
+}
+
+static int size_to_class(size_t size)
+{
+	int class = 0;
+
+	while (class < POOL_NUM_CLASSES && ((size_t) 1 << (class + POOL_MIN_SHIFT)) < size)
+		class++;
+
+	return (class < POOL_NUM_CLASSES ? class : POOL_CLASS_NONE);
+}
+
+static void *map_memory(size_t *len)
+{
+	void *mem = MAP_FAILED;
+
+	if (use_hugepages) {
+		/* MAP_HUGETLB needs the length to be a multiple of the huge page size */
+		*len = (*len + POOL_SLAB_SIZE - 1) & ~(POOL_SLAB_SIZE - 1);
+		mem = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+
+	if (mem == MAP_FAILED) {
+		/* No reserved huge pages. Fall back to regular pages */
+		mem = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			fatal("Could not allocate memory for frame buffers");
+		/* ...but still ask for transparent huge pages, if we can */
+		if (use_hugepages)
+			madvise(mem, *len, MADV_HUGEPAGE);
+	}
+
+	return mem;
+}
+
+/*
+ * Carve a new slab into buffers of the given class,
+ * and put them all in the free list. Must be called with the class lock held.
+ */
+static void grow_class(int class)
+{
+	size_t stride = sizeof(struct pool_buf) + ((size_t) 1 << (class + POOL_MIN_SHIFT));
+	size_t num = (POOL_SLAB_SIZE / stride > 0 ? POOL_SLAB_SIZE / stride : 1);
+	size_t len = num * stride;
+	unsigned char *slab = map_memory(&len);
+
+	/* Huge pages might have rounded it up, so fit as many as we can */
+	for (size_t off = 0; off + stride <= len; off += stride) {
+		struct pool_buf *b = (struct pool_buf *) (slab + off);
+
+		b->class = class;
+		b->map_len = 0;
+		b->next = classes[class].free;
+		classes[class].free = b;
+	}
+}
+
+/*
+ * Choose whether buffers should be backed by huge pages.
+ * This must be called before the first call to pool_alloc().
+ * Returns false if buffers have already been allocated.
+ */
+bool pool_init(bool hugepages)
+{
+	if (atomic_load(&in_use))
+		return false;
+
+	use_hugepages = hugepages;
+	return true;
+}
+
+/*
+ * Get a buffer that can hold at least 'size' bytes,
+ * with a single reference. Its contents are undefined.
+ */
+void *pool_alloc(size_t size)
+{
+	struct pool_buf *b;
+	size_t len;
+	int class = size_to_class(size);
+
+	if (size == 0)
+		return NULL;
+	atomic_store_explicit(&in_use, true, memory_order_relaxed);
+
+	if (class == POOL_CLASS_NONE) {
+		len = sizeof(struct pool_buf) + size;
+		b = map_memory(&len);
+		b->class = POOL_CLASS_NONE;
+		b->map_len = len;
+	} else {
+		pthread_mutex_lock(&classes[class].lock);
+		if (!classes[class].free)
+			grow_class(class);
+		b = classes[class].free;
+		classes[class].free = b->next;
+		pthread_mutex_unlock(&classes[class].lock);
+	}
+
+	b->next = NULL;
+	atomic_init(&b->refs, 1);
+
+	return b + 1;
+}
+
+/*
+ * Take a new reference to the buffer. Returns the same buffer.
+ */
+void *pool_ref(void *buf)
+{
+	if (buf)
+		atomic_fetch_add_explicit(&buf_header(buf)->refs, 1, memory_order_relaxed);
+	return buf;
+}
+
+/*
+ * Drop a reference to the buffer. The last one gives it back to the pool.
+ */
+void pool_unref(void *buf)
+{
+	struct pool_buf *b;
+
+	if (!buf)
+		return;
+
+	b = buf_header(buf);
+	if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1)
+		return;
+
+	if (b->class == POOL_CLASS_NONE) {
+		munmap(b, b->map_len);
+		return;
+	}
+
+	pthread_mutex_lock(&classes[b->class].lock);
+	b->next = classes[b->class].free;
+	classes[b->class].free = b;
+	pthread_mutex_unlock(&classes[b->class].lock);
+}
+
+/*
+ * Number of bytes the buffer can actually hold,
+ * which might be more than what was asked for.
+ */
+size_t pool_capacity(const void *buf)
+{
+	struct pool_buf *b = buf_header(buf);
+
+	if (b->class == POOL_CLASS_NONE)
+		return b->map_len - sizeof(struct pool_buf);
+	return (size_t) 1 << (b->class + POOL_MIN_SHIFT);
+}
+
+/*
+ * Tells whether somebody else holds a reference to the buffer,
+ * in which case it must not be written to.
+ */
+bool pool_is_shared(const void *buf)
+{
+	return atomic_load_explicit(&buf_header(buf)->refs, memory_order_acquire) > 1;
+}
@@ -0,0 +1,34 @@
+/*
+ * pool.h
+ *
+ * A slab pool of reference counted buffers, for frame data.
+ * Buffers are grouped in power-of-two size classes, carved out of big
+ * slabs that are never given back to the system, and recycled through
+ * per-class free lists, so that steady state capture does no calls to malloc(3).
+ *
+ * Buffers are NOT zeroed. Whoever needs zeroed memory must clear it themselves.
+ *
+ * A buffer is freed when its last reference is dropped. Stages that want
+ * to keep a buffer around (eg. to upload or record it later) take their
+ * own reference with pool_ref(), and the producer must check pool_is_shared()
+ * before writing into it again.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+#include <stddef.h>
+#include "main.h"
+
+bool pool_init(bool hugepages);
+
+void *pool_alloc(size_t size);
+void *pool_ref(void *buf);
+void pool_unref(void *buf);
+
+size_t pool_capacity(const void *buf);
+bool pool_is_shared(const void *buf);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,357 @@
+/*
+ * reactor.c
+ *
+ * A single-threaded event loop on top of epoll(7).
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "utils.h"
+#include "reactor.h"
+
+#define REACTOR_MAX_EVENTS	32
+
+/*
+ * Every fd we watch has one of these, which we get back from epoll.
+ * Handlers removed while dispatching are not freed right away, since
+ * there might still be events for them in the current batch.
+ */
+struct reactor_handler {
+	int fd;
+	reactor_fd_cb_t cb;
+	void *userdata;
+	bool dead;
+	struct reactor_handler *next;
+};
+
+struct reactor {
+	int epfd;
+	atomic_bool stop;
+	struct reactor_handler *handlers;
+	struct reactor_handler *graveyard;
+	reactor_signal_cb_t signal_cb;
+	void *signal_userdata;
+	int sigfd;
+	/* So that reactor_stop() can wake us up from other threads */
+	int wakefd;
+};
+
+struct reactor_timer {
+	struct reactor *r;
+	int fd;
+	reactor_timer_cb_t cb;
+	void *userdata;
+};
+
+static void reactor_wake(int fd, uint32_t events, void *userdata)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		fprintf(stderr, "ERROR: Could not read the reactor wake-up fd\n");
+}
+
+struct reactor *reactor_new()
+{
+	struct reactor *r = ec_malloc(sizeof(struct reactor));
+
+	r->sigfd = -1;
+	r->wakefd = -1;
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd == -1) {
+		free(r);
+		return NULL;
+	}
+
+	atomic_init(&r->stop, false);
+
+	r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->wakefd == -1 || !reactor_add_fd(r, r->wakefd, EPOLLIN, reactor_wake, NULL)) {
+		reactor_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static void reactor_bury(struct reactor *r)
+{
+	struct reactor_handler *h;
+
+	while (r->graveyard) {
+		h = r->graveyard;
+		r->graveyard = h->next;
+		free(h);
+	}
+}
+
+void reactor_free(struct reactor *r)
+{
+	struct reactor_handler *h;
+
+	if (!r)
+		return;
+
+	while (r->handlers) {
+		h = r->handlers;
+		r->handlers = h->next;
+		free(h);
+	}
+	reactor_bury(r);
+
+	if (r->sigfd != -1)
+		close(r->sigfd);
+	if (r->wakefd != -1)
+		close(r->wakefd);
+	close(r->epfd);
+	free(r);
+}
+
+static struct reactor_handler *reactor_find(struct reactor *r, int fd)
+{
+	for (struct reactor_handler *h = r->handlers; h; h = h->next) {
+		if (h->fd == fd)
+			return h;
+	}
+
+	return NULL;
+}
+
+bool reactor_add_fd(struct reactor *r, int fd, uint32_t events, reactor_fd_cb_t cb, void *userdata)
+{
+	struct epoll_event ev;
+	struct reactor_handler *h;
+
+	if (!r || fd < 0 || !cb || reactor_find(r, fd))
+		return false;
+
+	h = ec_malloc(sizeof(struct reactor_handler));
+	h->fd = fd;
+	h->cb = cb;
+	h->userdata = userdata;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		free(h);
+		return false;
+	}
+
+	h->next = r->handlers;
+	r->handlers = h;
+	return true;
+}
+
+bool reactor_mod_fd(struct reactor *r, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	struct reactor_handler *h;
+
+	if (!r || !(h = reactor_find(r, fd)))
+		return false;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	return (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev) == 0);
+}
+
+void reactor_del_fd(struct reactor *r, int fd)
+{
+	struct reactor_handler **hp, *h;
+
+	if (!r)
+		return;
+
+	for (hp = &r->handlers; *hp; hp = &(*hp)->next) {
+		if ((*hp)->fd == fd) {
+			h = *hp;
+			*hp = h->next;
+
+			/* The fd might be closed already. That's fine, epoll forgot about it then */
+			epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+			h->dead = true;
+			h->next = r->graveyard;
+			r->graveyard = h;
+			return;
+		}
+	}
+}
+
+static void reactor_timer_fired(int fd, uint32_t events, void *userdata)
+{
+	struct reactor_timer *t = userdata;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		t->cb(t->userdata);
+}
+
+/*
+ * Timers are one-shot, and start disarmed.
+ */
+struct reactor_timer *reactor_timer_new(struct reactor *r, reactor_timer_cb_t cb, void *userdata)
+{
+	struct reactor_timer *t;
+
+	if (!r || !cb)
+		return NULL;
+
+	t = ec_malloc(sizeof(struct reactor_timer));
+	t->r = r;
+	t->cb = cb;
+	t->userdata = userdata;
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (t->fd == -1)
+		goto fail;
+
+	if (!reactor_add_fd(r, t->fd, EPOLLIN, reactor_timer_fired, t)) {
+		close(t->fd);
+		goto fail;
+	}
+
+	return t;
+
+fail:
+	free(t);
+	return NULL;
+}
+
+/*
+ * Fire the timer 'ms' milliseconds from now, replacing any previous deadline.
+ * Zero means "as soon as possible".
+ */
+void reactor_timer_arm(struct reactor_timer *t, unsigned long ms)
+{
+	struct itimerspec its;
+
+	if (!t)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	/* An all-zeros value would disarm it */
+	if (ms == 0)
+		its.it_value.tv_nsec = 1;
+
+	timerfd_settime(t->fd, 0, &its, NULL);
+}
+
+void reactor_timer_disarm(struct reactor_timer *t)
+{
+	struct itimerspec its;
+
+	if (t) {
+		memset(&its, 0, sizeof(its));
+		timerfd_settime(t->fd, 0, &its, NULL);
+	}
+}
+
+void reactor_timer_free(struct reactor_timer *t)
+{
+	if (t) {
+		reactor_del_fd(t->r, t->fd);
+		close(t->fd);
+		free(t);
+	}
+}
+
+static void reactor_signal_received(int fd, uint32_t events, void *userdata)
+{
+	struct reactor *r = userdata;
+	struct signalfd_siginfo si;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si))
+		r->signal_cb(si.ssi_signo, r->signal_userdata);
+}
+
+/*
+ * Deliver the signals in 'set' through the loop, rather than through
+ * a signal handler. They are blocked in the calling thread, so this should
+ * be called before starting any other thread, which would inherit
+ * the signal mask. Otherwise, they could take the signals instead.
+ */
+bool reactor_watch_signals(struct reactor *r, const sigset_t *set, reactor_signal_cb_t cb, void *userdata)
+{
+	if (!r || !set || !cb || r->sigfd != -1)
+		return false;
+
+	if (pthread_sigmask(SIG_BLOCK, set, NULL) != 0)
+		return false;
+
+	r->sigfd = signalfd(-1, set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (r->sigfd == -1)
+		return false;
+
+	r->signal_cb = cb;
+	r->signal_userdata = userdata;
+
+	if (!reactor_add_fd(r, r->sigfd, EPOLLIN, reactor_signal_received, r)) {
+		close(r->sigfd);
+		r->sigfd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Dispatch events until reactor_stop() is called.
+ * Returns false if epoll failed.
+ */
+bool reactor_run(struct reactor *r)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct reactor_handler *h;
+	int n;
+
+	if (!r)
+		return false;
+
+	while (!atomic_load(&r->stop)) {
+		n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		for (int i = 0; i < n && !atomic_load(&r->stop); i++) {
+			h = events[i].data.ptr;
+			if (!h->dead)
+				h->cb(h->fd, events[i].events, h->userdata);
+		}
+
+		reactor_bury(r);
+	}
+
+	return true;
+}
+
+/*
+ * Make reactor_run() return after the current callback.
+ * If called from another thread, the loop is woken up to notice.
+ */
+void reactor_stop(struct reactor *r)
+{
+	uint64_t one = 1;
+
+	if (r) {
+		atomic_store(&r->stop, true);
+		if (write(r->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			fprintf(stderr, "ERROR: Could not wake up the reactor\n");
+	}
+}
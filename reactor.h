@@ -0,0 +1,48 @@
+/*
+ * reactor.h
+ *
+ * A single-threaded event loop on top of epoll(7).
+ * File descriptors, timers (timerfd) and signals (signalfd) are all
+ * just fds, so one thread can wait for all of them at once, and nothing
+ * ever blocks longer than it should.
+ *
+ * Callbacks run in the thread that called reactor_run(), one at a time.
+ * None of this is thread safe, except for reactor_stop(), which also
+ * wakes the loop up if it's waiting.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef REACTOR_H_
+#define REACTOR_H_
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include "main.h"
+
+struct reactor;
+struct reactor_timer;
+
+typedef void (* reactor_fd_cb_t) (int fd, uint32_t events, void *userdata);
+typedef void (* reactor_timer_cb_t) (void *userdata);
+typedef void (* reactor_signal_cb_t) (int signo, void *userdata);
+
+struct reactor *reactor_new();
+void reactor_free(struct reactor *);
+
+bool reactor_add_fd(struct reactor *, int fd, uint32_t events, reactor_fd_cb_t, void *);
+bool reactor_mod_fd(struct reactor *, int fd, uint32_t events);
+void reactor_del_fd(struct reactor *, int fd);
+
+struct reactor_timer *reactor_timer_new(struct reactor *, reactor_timer_cb_t, void *);
+void reactor_timer_arm(struct reactor_timer *, unsigned long ms);
+void reactor_timer_disarm(struct reactor_timer *);
+void reactor_timer_free(struct reactor_timer *);
+
+bool reactor_watch_signals(struct reactor *, const sigset_t *, reactor_signal_cb_t, void *);
+
+bool reactor_run(struct reactor *);
+void reactor_stop(struct reactor *);
+
+#endif /* REACTOR_H_ */
@@ -0,0 +1,72 @@
+/*
+ * schedule.c
+ *
+ * Periodic capture on absolute deadlines.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "metrics.h"
+#include "schedule.h"
+
+/*
+ * The first deadline is the next multiple of the period (plus the phase)
+ * from now. A zero period means no waiting at all.
+ */
+void schedule_init(struct schedule *s, unsigned long period_ms, unsigned long phase_ms)
+{
+	uint64_t now = metrics_now(), phase;
+
+	if (!s)
+		return;
+
+	memset(s, 0, sizeof(struct schedule));
+	s->period = period_ms * 1000000ULL;
+	if (!s->period)
+		return;
+
+	phase = (phase_ms * 1000000ULL) % s->period;
+	s->next = now / s->period * s->period + phase;
+	if (s->next < now)
+		s->next += s->period;
+}
+
+/*
+ * Sleep until the next deadline, and move on to the one after it.
+ * Returns false if a signal woke us up before it. Then the deadline stays,
+ * and we can just call this again if we don't have to stop.
+ */
+bool schedule_wait(struct schedule *s)
+{
+	struct timespec deadline;
+	uint64_t now, missed, due;
+	int err;
+
+	if (!s || !s->period)
+		return true;
+
+	due = s->next;
+	deadline.tv_sec = s->next / 1000000000ULL;
+	deadline.tv_nsec = s->next % 1000000000ULL;
+	err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+	if (err == EINTR)
+		return false;
+
+	now = metrics_now();
+	s->next += s->period;
+	if (s->next <= now) {
+		missed = (now - s->next) / s->period + 1;
+		s->next += missed * s->period;
+		s->missed += missed;
+
+		metrics_add(METRIC_DEADLINES_MISSED, missed);
+		fprintf(stderr, "WARNING: Capture is %.0f ms behind. Skipping %llu shot(s)\n",
+				(now - due) / 1e6, (unsigned long long) missed);
+	}
+
+	return true;
+}
@@ -0,0 +1,35 @@
+/*
+ * schedule.h
+ *
+ * Periodic capture on absolute deadlines. Deadlines are multiples of the period
+ * on CLOCK_MONOTONIC (plus an optional phase), rather than some time after
+ * the last shot finished, so the cadence doesn't drift with however long
+ * capturing and uploading took. And since every daemon on the box sees
+ * the same clock, cameras with the same period shoot in step
+ * (or staggered, with different phases).
+ *
+ * If a shot takes longer than its slot, the next one still goes
+ * on its own deadline, which just comes sooner. Deadlines that went by
+ * whole are skipped, rather than shooting a burst to catch up.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef SCHEDULE_H_
+#define SCHEDULE_H_
+#include <stdint.h>
+#include "main.h"
+
+struct schedule {
+	uint64_t period;
+	/* Next deadline, in ns on CLOCK_MONOTONIC */
+	uint64_t next;
+	/* Deadlines skipped so far */
+	unsigned long missed;
+};
+
+void schedule_init(struct schedule *, unsigned long period_ms, unsigned long phase_ms);
+bool schedule_wait(struct schedule *);
+
+#endif /* SCHEDULE_H_ */
@@ -12,6 +12,7 @@
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_image.h"
 #include "utils.h"
+#include "tiles.h"
 #include "window.h"
 
 #define WINDOW_TITLE "Appbase CCTV (by ajuaristi)"
@@ -21,6 +22,11 @@ struct window {
 	SDL_Window *window;
 	SDL_Renderer *renderer;
 	SDL_Texture *texture;
+	size_t texture_width;
+	size_t texture_height;
+	/* The keyframe in the texture, that packets of tiles can be painted over */
+	bool has_keyframe;
+	uint32_t keyframe;
 };
 
 static void sdl_render_from_texture(SDL_Renderer *r, SDL_Texture *t)
@@ -30,10 +36,38 @@ static void sdl_render_from_texture(SDL_Renderer *r, SDL_Texture *t)
 	SDL_RenderPresent(r);
 }
 
+static bool sdl_create_texture(struct window *w, uint32_t format, size_t width, size_t height)
+{
+	if (width > INT_MAX || height > INT_MAX)
+		return false;
+
+	if (w->texture)
+		SDL_DestroyTexture(w->texture);
+
+	w->texture = SDL_CreateTexture(w->renderer,
+			format,
+			SDL_TEXTUREACCESS_STREAMING,
+			(int) width,
+			(int) height);
+	w->texture_width = width;
+	w->texture_height = height;
+
+	return (w->texture != NULL);
+}
+
 static bool sdl_render_yuyv(struct window *w, const struct frame *f)
 {
 	unsigned int bpp = SDL_BYTESPERPIXEL(SDL_PIXELFORMAT_YUY2);
 
+	/*
+	 * Frames need not be as big as the window (eg. when streaming
+	 * a smaller rendition). SDL scales them to fit.
+	 */
+	if (f->width && f->height &&
+			(f->width != w->texture_width || f->height != w->texture_height) &&
+			!sdl_create_texture(w, SDL_PIXELFORMAT_YUY2, f->width, f->height))
+		return false;
+
 	/*
 	 * Check to prevent read overrun, since SDL_UpdateTexture()
 	 * does not take length as an argument (although we've
@@ -51,36 +85,94 @@ static bool sdl_render_yuyv(struct window *w, const struct frame *f)
 	return true;
 }
 
-static bool sdl_render_jpeg(struct window *w, const char *data, size_t len)
+/*
+ * Returns the JPEG in 'data' as an RGB surface, so that it can go into
+ * the texture as it is (eg. grayscale JPEGs come out with a palette).
+ */
+static SDL_Surface *sdl_load_jpeg(const unsigned char *data, size_t len)
 {
-	SDL_Surface *s = NULL;
-	SDL_Texture *t;
-	SDL_RWops *ops = SDL_RWFromConstMem(data, len);
+	SDL_Surface *s, *rgb;
+	SDL_RWops *ops;
 
-	if (!ops)
-		goto fail;
+	if (len > INT_MAX || !(ops = SDL_RWFromConstMem(data, (int) len)))
+		return NULL;
 
 	s = IMG_LoadJPG_RW(ops);
+	SDL_FreeRW(ops);
+	if (!s || s->format->format == SDL_PIXELFORMAT_RGB24)
+		return s;
+
+	rgb = SDL_ConvertSurfaceFormat(s, SDL_PIXELFORMAT_RGB24, 0);
+	SDL_FreeSurface(s);
+	return rgb;
+}
+
+static bool sdl_paint_jpeg(struct window *w, const unsigned char *data, size_t len,
+		unsigned int x, unsigned int y)
+{
+	SDL_Surface *s = sdl_load_jpeg(data, len);
+	SDL_Rect rect;
+	bool result = false;
+
 	if (!s)
-		goto fail;
+		return false;
+	if (x + s->w > w->texture_width || y + s->h > w->texture_height)
+		goto end;
 
-	t = SDL_CreateTextureFromSurface(w->renderer, s);
-	if (!t)
-		goto fail;
+	rect.x = x;
+	rect.y = y;
+	rect.w = s->w;
+	rect.h = s->h;
+	result = (SDL_UpdateTexture(w->texture, &rect, s->pixels, s->pitch) == 0);
+
+end:
 	SDL_FreeSurface(s);
+	return result;
+}
 
-	sdl_render_from_texture(w->renderer, t);
+/*
+ * JPEGs go into a texture that we keep from one frame to the next,
+ * so that packets of tiles (see tiles.h) can be painted over the last keyframe.
+ * Packets made for any other keyframe are dropped.
+ */
+static bool sdl_render_jpeg(struct window *w, const unsigned char *data, size_t len)
+{
+	struct tile_reader reader;
+	struct tile tile;
+	SDL_Surface *s;
 
-	SDL_DestroyTexture(t);
-	SDL_FreeRW(ops);
-	return true;
+	if (tiles_read_start(&reader, data, len)) {
+		/* Until their keyframe comes, there is nothing to paint them over */
+		if (!w->texture || !w->has_keyframe || reader.keyframe != w->keyframe ||
+				reader.width != w->texture_width || reader.height != w->texture_height)
+			return true;
 
-fail:
-	if (s)
+		while (reader.count) {
+			if (!tiles_read_next(&reader, &tile) ||
+					!sdl_paint_jpeg(w, tile.data, tile.len, tile.x, tile.y)) {
+				/* Half painted: wait for the next keyframe */
+				w->has_keyframe = false;
+				return false;
+			}
+		}
+	} else {
+		s = sdl_load_jpeg(data, len);
+		if (!s)
+			return false;
+
+		if ((!w->texture || s->w != w->texture_width || s->h != w->texture_height) &&
+				!sdl_create_texture(w, SDL_PIXELFORMAT_RGB24, s->w, s->h)) {
+			SDL_FreeSurface(s);
+			return false;
+		}
+
+		SDL_UpdateTexture(w->texture, NULL, s->pixels, s->pitch);
 		SDL_FreeSurface(s);
-	if (ops)
-		SDL_FreeRW(ops);
-	return false;
+		w->has_keyframe = tiles_keyframe_id(data, len, &w->keyframe);
+	}
+
+	sdl_render_from_texture(w->renderer, w->texture);
+	return true;
 }
 
 static void sdl_close(struct window *w)
@@ -103,6 +195,34 @@ bool window_is_closed()
 	return SDL_QuitRequested();
 }
 
+/*
+ * Returns the next arrow key pressed by the user, if any.
+ * Only key events are taken out of the queue, so that we don't
+ * swallow the quit event window_is_closed() looks for.
+ */
+enum window_key window_poll_key()
+{
+	SDL_Event ev;
+
+	SDL_PumpEvents();
+	while (SDL_PeepEvents(&ev, 1, SDL_GETEVENT, SDL_KEYDOWN, SDL_KEYDOWN) > 0) {
+		switch (ev.key.keysym.sym) {
+		case SDLK_LEFT:
+			return WINDOW_KEY_LEFT;
+		case SDLK_RIGHT:
+			return WINDOW_KEY_RIGHT;
+		case SDLK_UP:
+			return WINDOW_KEY_UP;
+		case SDLK_DOWN:
+			return WINDOW_KEY_DOWN;
+		default:
+			break;
+		}
+	}
+
+	return WINDOW_KEY_NONE;
+}
+
 struct window *start_window(size_t width, size_t height, enum frame_format format)
 {
 	struct window *w = ec_malloc(sizeof(struct window));
@@ -135,15 +255,8 @@ struct window *start_window(size_t width, size_t height, enum frame_format forma
 		goto fail_uninitialize;
 
 	w->texture = NULL;
-	if (format == FRAME_FORMAT_YUYV) {
-		w->texture = SDL_CreateTexture(w->renderer,
-				SDL_PIXELFORMAT_YUY2,
-				SDL_TEXTUREACCESS_STREAMING,
-				(int) width,
-				(int) height);
-		if (!w->texture)
-			goto fail_uninitialize;
-	}
+	if (format == FRAME_FORMAT_YUYV && !sdl_create_texture(w, SDL_PIXELFORMAT_YUY2, width, height))
+		goto fail_uninitialize;
 
 	return w;
 
@@ -167,7 +280,7 @@ bool window_render_frame(struct window *w, struct frame *f)
 		result = sdl_render_yuyv(w, f);
 		break;
 	case FRAME_FORMAT_JPEG:
-		result = sdl_render_jpeg(w, (const char *) f->frame_data, f->frame_bytes_used);
+		result = sdl_render_jpeg(w, f->frame_data, f->frame_bytes_used);
 		break;
 	default:
 		break;
@@ -177,6 +290,16 @@ end:
 	return result;
 }
 
+/*
+ * Forget what's in the window, so that only a keyframe can draw on it
+ * again (eg. after seeking, the next packets of tiles go with other pictures).
+ */
+void window_invalidate(struct window *w)
+{
+	if (w)
+		w->has_keyframe = false;
+}
+
 void destroy_window(struct window *w)
 {
 	if (w) {
@@ -0,0 +1,127 @@
+/*
+ * segment.c
+ *
+ * Segmented storage of frames, see segment.h.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "utils.h"
+#include "segment.h"
+
+struct segment_writer {
+	char *dir;
+	unsigned int segment_secs;
+	/* The segment open right now, and the second it started at */
+	int fd;
+	time_t start;
+};
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/*
+ * Frames are stored under 'dir', which is created if it's not there.
+ */
+struct segment_writer *segment_writer_new(const char *dir, unsigned int segment_secs)
+{
+	struct segment_writer *sw;
+
+	if (!dir || !*dir || !segment_secs)
+		return NULL;
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		return NULL;
+
+	sw = ec_malloc(sizeof(struct segment_writer));
+	sw->dir = strdup(dir);
+	sw->segment_secs = segment_secs;
+	sw->fd = -1;
+
+	return sw;
+}
+
+void segment_writer_free(struct segment_writer *sw)
+{
+	if (sw) {
+		if (sw->fd != -1)
+			close(sw->fd);
+		free(sw->dir);
+		free(sw);
+	}
+}
+
+/*
+ * Close the segment we're writing to, if 'tv' falls out of it, and open
+ * the one it falls in. Frames are appended, so that a segment we were
+ * writing to before a restart is picked up where it was left.
+ */
+static bool segment_writer_roll(struct segment_writer *sw, const struct timeval *tv)
+{
+	time_t start = tv->tv_sec - tv->tv_sec % sw->segment_secs;
+	char *path;
+
+	if (sw->fd != -1 && start == sw->start)
+		return true;
+
+	if (sw->fd != -1) {
+		close(sw->fd);
+		sw->fd = -1;
+	}
+
+	if (asprintf(&path, "%s/%lld" SEGMENT_SUFFIX, sw->dir, (long long) start) == -1)
+		return false;
+
+	sw->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (sw->fd == -1)
+		fprintf(stderr, "ERROR: Could not open segment '%s'\n", path);
+	free(path);
+
+	sw->start = start;
+	return (sw->fd != -1);
+}
+
+/*
+ * The header and the frame go in a single write, so that a frame is never
+ * split by somebody reading the segment at the same time.
+ */
+bool segment_writer_append(struct segment_writer *sw, const struct timeval *tv,
+		const unsigned char *data, size_t len)
+{
+	unsigned char header[SEGMENT_HEADER_LEN];
+	struct iovec iov[2];
+	ssize_t written;
+
+	if (!sw || !tv || !data || !len || len > UINT32_MAX || !segment_writer_roll(sw, tv))
+		return false;
+
+	memcpy(header, SEGMENT_MAGIC, 4);
+	put32(header + 4, (uint64_t) tv->tv_sec >> 32);
+	put32(header + 8, (uint64_t) tv->tv_sec & 0xffffffff);
+	put32(header + 12, tv->tv_usec);
+	put32(header + 16, len);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (unsigned char *) data;
+	iov[1].iov_len = len;
+
+	do {
+		written = writev(sw->fd, iov, 2);
+	} while (written == -1 && errno == EINTR);
+
+	return (written == (ssize_t) (sizeof(header) + len));
+}
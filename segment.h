@@ -0,0 +1,35 @@
+/*
+ * segment.h
+ *
+ * Local storage for received frames. Every camera gets a directory of its own,
+ * and its frames go one after another into files that each cover a fixed
+ * span of time (segments), named after the second they start at:
+ *
+ *     <dir>/<start>.abseg
+ *
+ * Segments start at multiples of their length, so those of different cameras
+ * line up. Every frame is stored with a small header. Integers are big endian:
+ *
+ *     "ABFR" | sec (64) | usec (32) | length (32) | JPEG
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef SEGMENT_H_
+#define SEGMENT_H_
+#include <sys/time.h>
+#include "main.h"
+
+#define SEGMENT_MAGIC		"ABFR"
+#define SEGMENT_HEADER_LEN	20
+#define SEGMENT_SUFFIX		".abseg"
+
+struct segment_writer;
+
+struct segment_writer *segment_writer_new(const char *dir, unsigned int segment_secs);
+bool segment_writer_append(struct segment_writer *, const struct timeval *,
+		const unsigned char *data, size_t len);
+void segment_writer_free(struct segment_writer *);
+
+#endif /* SEGMENT_H_ */
@@ -0,0 +1,408 @@
+/*
+ * tiles.c
+ *
+ * Change encoding: only the tiles that changed since the last keyframe are sent.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "utils.h"
+#include "pool.h"
+#include "metrics.h"
+#include "tiles.h"
+
+/* Tiles are compared this many rows at a time */
+#define TILES_BAND		8
+/*
+ * Mean absolute difference per sample, over any band of a tile,
+ * above which the tile has changed. Sensor noise stays well below it,
+ * and bands are narrow enough that small things moving don't get averaged out.
+ */
+#define TILES_THRESHOLD		4
+/* When more than this fraction of the tiles changed, a keyframe is cheaper */
+#define TILES_MAX_CHANGED	0.5
+
+struct tile_encoder {
+	uint64_t keyframe_ns;
+	uint64_t last_keyframe;
+	/* Id of the last keyframe. Packets carry it, so that they only get painted on it */
+	uint32_t keyframe_id;
+	/* The last keyframe, before it was encoded. We hold a reference to it */
+	unsigned char *ref;
+	size_t width;
+	size_t height;
+	int format;
+	unsigned int cols;
+	unsigned int rows;
+	bool *changed;
+	/* Tiles the clients have, that don't look like the keyframe anymore */
+	bool *dirty;
+};
+
+/* Packets are built in a pool buffer, that grows as needed */
+struct tile_packet {
+	unsigned char *data;
+	size_t len;
+};
+
+static inline void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v & 0xffff);
+}
+
+static inline unsigned int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t) get16(p) << 16) | get16(p + 2);
+}
+
+struct tile_encoder *tiles_new(unsigned int keyframe_secs)
+{
+	struct tile_encoder *te;
+	struct timespec ts;
+
+	if (!keyframe_secs)
+		return NULL;
+
+	te = ec_malloc(sizeof(struct tile_encoder));
+	te->keyframe_ns = keyframe_secs * 1000000000ULL;
+	/* Start somewhere else every time, so that ids don't repeat across restarts */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	te->keyframe_id = (uint32_t) (ts.tv_sec * 1000003 + ts.tv_nsec) ^ (uint32_t) getpid();
+	return te;
+}
+
+void tiles_free(struct tile_encoder *te)
+{
+	if (te) {
+		pool_unref(te->ref);
+		free(te->changed);
+		free(te->dirty);
+		free(te);
+	}
+}
+
+static uint64_t sad(const unsigned char *a, const unsigned char *b, size_t len)
+{
+	uint64_t sum = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+				_mm_loadu_si128((const __m128i *) (a + i)),
+				_mm_loadu_si128((const __m128i *) (b + i))));
+	sum = _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_srli_si128(acc, 8));
+#endif
+
+	for (; i < len; i++)
+		sum += (a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]);
+
+	return sum;
+}
+
+static inline size_t tile_extent(size_t pos, size_t total)
+{
+	return (total - pos < TILE_SIZE ? total - pos : TILE_SIZE);
+}
+
+/*
+ * Compare the luma of a tile with the keyframe (in YUYV, chroma comes along,
+ * which doesn't hurt).
+ */
+static bool tile_changed(struct tile_encoder *te, const unsigned char *data, size_t x, size_t y)
+{
+	size_t bpp = (te->format == V4L2_PIX_FMT_YUYV ? 2 : 1),
+		len = tile_extent(x, te->width) * bpp,
+		height = tile_extent(y, te->height),
+		offset, rows;
+	uint64_t sum;
+
+	for (size_t band = 0; band < height; band += TILES_BAND) {
+		rows = (height - band < TILES_BAND ? height - band : TILES_BAND);
+		sum = 0;
+
+		for (size_t row = band; row < band + rows; row++) {
+			offset = (y + row) * te->width * bpp + x * bpp;
+			sum += sad(data + offset, te->ref + offset, len);
+		}
+
+		if (sum > (uint64_t) TILES_THRESHOLD * len * rows)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Copy a tile out of the frame, in the same format, so that it can be encoded.
+ */
+static void tile_extract(struct tile_encoder *te, const unsigned char *data,
+		size_t x, size_t y, struct frame *t)
+{
+	size_t width = tile_extent(x, te->width), height = tile_extent(y, te->height),
+		cwidth = te->width / 2;
+	const unsigned char *u, *v;
+	unsigned char *out;
+
+	memset(t, 0, sizeof(struct frame));
+	t->width = width;
+	t->height = height;
+	t->format = te->format;
+
+	if (te->format == V4L2_PIX_FMT_YUYV) {
+		t->frame_size = width * height * 2;
+		out = pool_alloc(t->frame_size);
+		for (size_t row = 0; row < height; row++)
+			memcpy(out + row * width * 2, data + ((y + row) * te->width + x) * 2, width * 2);
+	} else {
+		t->frame_size = width * height * 3 / 2;
+		out = pool_alloc(t->frame_size);
+		for (size_t row = 0; row < height; row++)
+			memcpy(out + row * width, data + (y + row) * te->width + x, width);
+
+		u = data + te->width * te->height;
+		v = u + cwidth * (te->height / 2);
+		for (size_t row = 0; row < height / 2; row++) {
+			memcpy(out + width * height + row * (width / 2),
+					u + (y / 2 + row) * cwidth + x / 2, width / 2);
+			memcpy(out + width * height * 5 / 4 + row * (width / 2),
+					v + (y / 2 + row) * cwidth + x / 2, width / 2);
+		}
+	}
+
+	t->frame_data = out;
+	t->frame_bytes_used = t->frame_size;
+}
+
+static void packet_append(struct tile_packet *p, size_t x, size_t y, const struct frame *t)
+{
+	size_t size = pool_capacity(p->data), len = TILES_ENTRY_LEN + t->frame_bytes_used;
+	unsigned char *data;
+
+	if (p->len + len > size) {
+		while (p->len + len > size)
+			size *= 2;
+		data = pool_alloc(size);
+		memcpy(data, p->data, p->len);
+		pool_unref(p->data);
+		p->data = data;
+	}
+
+	put16(p->data + p->len, x);
+	put16(p->data + p->len + 2, y);
+	put32(p->data + p->len + 4, t->frame_bytes_used);
+	memcpy(p->data + p->len + TILES_ENTRY_LEN, t->frame_data, t->frame_bytes_used);
+	p->len += len;
+}
+
+static void tiles_set_keyframe(struct tile_encoder *te, const struct frame *f, uint64_t now)
+{
+	unsigned int cols = (f->width + TILE_SIZE - 1) / TILE_SIZE,
+		rows = (f->height + TILE_SIZE - 1) / TILE_SIZE;
+
+	if (cols * rows != te->cols * te->rows) {
+		free(te->changed);
+		free(te->dirty);
+		te->changed = ec_malloc(cols * rows * sizeof(bool));
+		te->dirty = ec_malloc(cols * rows * sizeof(bool));
+	}
+	memset(te->dirty, 0, cols * rows * sizeof(bool));
+
+	te->cols = cols;
+	te->rows = rows;
+	te->width = f->width;
+	te->height = f->height;
+	te->format = f->format;
+	te->last_keyframe = now;
+	te->keyframe_id++;
+
+	/* Encoding gives the frame a new buffer, so this one stays as it is */
+	pool_unref(te->ref);
+	te->ref = pool_ref(f->frame_data);
+}
+
+/*
+ * Encode a YUYV or planar YUV 4:2:0 frame, in place, either as a keyframe
+ * (a plain JPEG), or as a packet with the tiles that changed since the last one.
+ *
+ * Besides those, tiles sent in the previous packet that look like the keyframe
+ * again are sent once more, so that clients can paint them back.
+ * A keyframe is sent when it's time for one, or when so much changed
+ * that it would be cheaper than the tiles. 'keyframe' (if not NULL) tells which.
+ */
+bool tiles_encode(struct tile_encoder *te, struct frame *f, const struct jpeg_params *params, bool *keyframe)
+{
+	struct jpeg_params tile_params;
+	struct tile_packet p;
+	struct frame t;
+	unsigned int count = 0, changed = 0, i;
+	uint64_t now = metrics_now();
+	bool key;
+
+	if (!te || !f || !f->frame_data || !f->frame_bytes_used || !params ||
+			f->width > UINT16_MAX || f->height > UINT16_MAX ||
+			(f->format != V4L2_PIX_FMT_YUYV && f->format != V4L2_PIX_FMT_YUV420))
+		return false;
+
+	key = (!te->ref ||
+			f->width != te->width || f->height != te->height || f->format != te->format ||
+			now - te->last_keyframe >= te->keyframe_ns);
+
+	if (!key) {
+		for (i = 0; i < te->cols * te->rows; i++) {
+			te->changed[i] = tile_changed(te, f->frame_data,
+					(i % te->cols) * TILE_SIZE, (i / te->cols) * TILE_SIZE);
+			changed += te->changed[i];
+		}
+		key = (changed > te->cols * te->rows * TILES_MAX_CHANGED);
+	}
+
+	if (keyframe)
+		*keyframe = key;
+	if (key) {
+		unsigned char id[TILES_KEYFRAME_ID_LEN];
+		struct jpeg_params key_params = *params;
+
+		tiles_set_keyframe(te, f, now);
+		memcpy(id, TILES_KEYFRAME_MAGIC, 4);
+		put32(id + 4, te->keyframe_id);
+		key_params.comment = id;
+		key_params.comment_len = sizeof(id);
+		frame_convert_yuyv_to_jpeg_ext(f, &key_params);
+		return true;
+	}
+
+	p.data = pool_alloc(f->frame_size);
+	p.len = TILES_HEADER_LEN;
+
+	/* Stats of bits and pieces would be no use */
+	tile_params = *params;
+	tile_params.analyze = false;
+
+	for (i = 0; i < te->cols * te->rows; i++) {
+		if (!te->changed[i] && !te->dirty[i])
+			continue;
+
+		tile_extract(te, f->frame_data, (i % te->cols) * TILE_SIZE, (i / te->cols) * TILE_SIZE, &t);
+		frame_convert_yuyv_to_jpeg_ext(&t, &tile_params);
+		packet_append(&p, (i % te->cols) * TILE_SIZE, (i / te->cols) * TILE_SIZE, &t);
+		pool_unref(t.frame_data);
+
+		te->dirty[i] = te->changed[i];
+		count++;
+	}
+
+	memcpy(p.data, TILES_MAGIC, 4);
+	put16(p.data + 4, f->width);
+	put16(p.data + 6, f->height);
+	put16(p.data + 8, count);
+	put32(p.data + 10, te->keyframe_id);
+	metrics_add(METRIC_TILES_SENT, count);
+
+	pool_unref(f->frame_data);
+	f->frame_data = p.data;
+	f->frame_size = pool_capacity(p.data);
+	f->frame_bytes_used = p.len;
+	f->stats.valid = false;
+
+	return true;
+}
+
+/*
+ * Returns false if 'data' is not a packet of tiles (eg. it's a keyframe).
+ */
+bool tiles_read_start(struct tile_reader *r, const unsigned char *data, size_t len)
+{
+	if (!r || !data || len < TILES_HEADER_LEN || memcmp(data, TILES_MAGIC, 4))
+		return false;
+
+	r->width = get16(data + 4);
+	r->height = get16(data + 6);
+	r->count = get16(data + 8);
+	r->keyframe = get32(data + 10);
+	r->next = data + TILES_HEADER_LEN;
+	r->end = data + len;
+
+	return true;
+}
+
+/*
+ * Returns false when there are no more tiles, or the packet is truncated.
+ */
+bool tiles_read_next(struct tile_reader *r, struct tile *t)
+{
+	if (!r || !t || !r->count || r->end - r->next < TILES_ENTRY_LEN)
+		return false;
+
+	t->x = get16(r->next);
+	t->y = get16(r->next + 2);
+	t->len = get32(r->next + 4);
+	t->data = r->next + TILES_ENTRY_LEN;
+	if (t->len > (size_t) (r->end - t->data))
+		return false;
+
+	r->next = t->data + t->len;
+	r->count--;
+
+	return true;
+}
+
+/*
+ * Find the id of a keyframe, in its comment. Only the markers before
+ * the image data are looked at. Returns false if it has none.
+ */
+bool tiles_keyframe_id(const unsigned char *data, size_t len, uint32_t *id)
+{
+	size_t pos = 2;
+
+	if (!data || !id || len < 4 || data[0] != 0xff || data[1] != 0xd8)
+		return false;
+
+	while (pos + 4 <= len && data[pos] == 0xff) {
+		unsigned int marker = data[pos + 1], seglen = get16(data + pos + 2);
+
+		/* Fill bytes */
+		if (marker == 0xff) {
+			pos++;
+			continue;
+		}
+		/* Start of scan, or end of image */
+		if (marker == 0xda || marker == 0xd9 || seglen < 2)
+			break;
+
+		if (marker == 0xfe && seglen - 2 >= TILES_KEYFRAME_ID_LEN &&
+				pos + 4 + TILES_KEYFRAME_ID_LEN <= len &&
+				memcmp(data + pos + 4, TILES_KEYFRAME_MAGIC, 4) == 0) {
+			*id = get32(data + pos + 8);
+			return true;
+		}
+
+		pos += 2 + seglen;
+	}
+
+	return false;
+}
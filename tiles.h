@@ -0,0 +1,64 @@
+/*
+ * tiles.h
+ *
+ * Change encoding for fixed cameras, which mostly see the same background.
+ * Frames are split into tiles, and only those that changed since the last
+ * keyframe are encoded and sent, each one as a small JPEG of its own.
+ * Clients paint them over the picture they already have.
+ *
+ * Keyframes are plain JPEGs, with a comment (COM marker) that holds their id.
+ * Tiles go in packets, which clients can tell apart from JPEGs by their first bytes,
+ * and which name the keyframe they go on top of. All integers are big endian:
+ *
+ *     Keyframe comment: "ABKF" | id (32)
+ *     Packet: "ABTL" | width (16) | height (16) | count (16) | keyframe id (32)
+ *     and then, 'count' times: x (16) | y (16) | length (32) | JPEG
+ *
+ * Clients that don't have that keyframe (they joined late, lost it, or seeked)
+ * must drop packets until the next one comes.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef TILES_H_
+#define TILES_H_
+#include <stdint.h>
+#include "main.h"
+#include "frame.h"
+
+/* A multiple of 16, so that tiles are made of whole 4:2:0 MCUs */
+#define TILE_SIZE		64
+#define TILES_MAGIC		"ABTL"
+#define TILES_KEYFRAME_MAGIC	"ABKF"
+#define TILES_HEADER_LEN	14
+#define TILES_KEYFRAME_ID_LEN	8
+#define TILES_ENTRY_LEN		8
+
+struct tile_encoder;
+
+struct tile_encoder *tiles_new(unsigned int keyframe_secs);
+void tiles_free(struct tile_encoder *);
+bool tiles_encode(struct tile_encoder *, struct frame *, const struct jpeg_params *, bool *keyframe);
+
+struct tile {
+	unsigned int x;
+	unsigned int y;
+	const unsigned char *data;
+	size_t len;
+};
+
+struct tile_reader {
+	unsigned int width;
+	unsigned int height;
+	unsigned int count;
+	uint32_t keyframe;
+	const unsigned char *next;
+	const unsigned char *end;
+};
+
+bool tiles_read_start(struct tile_reader *, const unsigned char *data, size_t len);
+bool tiles_read_next(struct tile_reader *, struct tile *);
+bool tiles_keyframe_id(const unsigned char *data, size_t len, uint32_t *id);
+
+#endif /* TILES_H_ */
@@ -0,0 +1,171 @@
+/*
+ * trace.c
+ *
+ * Opt-in tracing of the frame pipeline, in Chrome trace format.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "utils.h"
+#include "trace.h"
+
+/*
+ * Events kept per thread. At 30 fps and a dozen events per frame,
+ * this holds a few minutes. Older events are overwritten.
+ */
+#define TRACE_RING_EVENTS	65536
+#define TRACE_THREAD_NAME_LEN	16
+
+struct trace_event {
+	const char *name;
+	uint64_t ts_ns;
+	char phase;
+};
+
+/*
+ * Only the owner thread writes to its ring. 'head' counts all the
+ * events ever recorded, so that we know whether it wrapped around.
+ */
+struct trace_ring {
+	struct trace_event events[TRACE_RING_EVENTS];
+	atomic_uint_fast64_t head;
+	pid_t tid;
+	char thread_name[TRACE_THREAD_NAME_LEN];
+	struct trace_ring *next;
+};
+
+atomic_bool trace_enabled;
+
+static __thread struct trace_ring *local_ring = NULL;
+static struct trace_ring *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *trace_path = NULL;
+static uint64_t trace_epoch;
+
+static uint64_t trace_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct trace_ring *trace_local()
+{
+	struct trace_ring *r = local_ring;
+
+	if (!r) {
+		r = ec_malloc(sizeof(struct trace_ring));
+		r->tid = syscall(SYS_gettid);
+		pthread_getname_np(pthread_self(), r->thread_name, sizeof(r->thread_name));
+
+		pthread_mutex_lock(&rings_lock);
+		r->next = rings;
+		rings = r;
+		pthread_mutex_unlock(&rings_lock);
+
+		local_ring = r;
+	}
+
+	return r;
+}
+
+void trace_record(const char *name, char phase)
+{
+	struct trace_ring *r = trace_local();
+	uint_fast64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	struct trace_event *ev = &r->events[head % TRACE_RING_EVENTS];
+
+	ev->name = name;
+	ev->ts_ns = trace_now();
+	ev->phase = phase;
+
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/*
+ * Start recording events. They will be written to 'path' by trace_stop().
+ */
+bool trace_start(const char *path)
+{
+	if (!path || atomic_load(&trace_enabled))
+		return false;
+
+	trace_path = ec_malloc_fill(strlen(path) + 1, path);
+	trace_epoch = trace_now();
+	atomic_store(&trace_enabled, true);
+
+	return true;
+}
+
+static void trace_write_ring(FILE *fp, struct trace_ring *r, pid_t pid, bool *first)
+{
+	uint_fast64_t head = atomic_load_explicit(&r->head, memory_order_acquire),
+			tail = (head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0);
+	bool skipping = (tail > 0);
+
+	fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"name\":\"%s\"}}",
+			(*first ? "" : ","), pid, r->tid, r->thread_name);
+	*first = false;
+
+	for (; tail < head; tail++) {
+		struct trace_event *ev = &r->events[tail % TRACE_RING_EVENTS];
+
+		/* If the ring wrapped, the oldest end events have lost their beginning */
+		if (skipping && ev->phase == 'E')
+			continue;
+		skipping = false;
+
+		fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+				ev->name, ev->phase,
+				(ev->ts_ns > trace_epoch ? ev->ts_ns - trace_epoch : 0) / 1000.0,
+				pid, r->tid);
+	}
+}
+
+/*
+ * Stop recording events, and write all of them to the file given
+ * to trace_start(). Returns false if it could not be written.
+ */
+bool trace_stop()
+{
+	FILE *fp;
+	bool first = true, retval = false;
+	pid_t pid = getpid();
+
+	if (!atomic_exchange(&trace_enabled, false))
+		return false;
+
+	fp = fopen(trace_path, "w");
+	if (!fp) {
+		fprintf(stderr, "ERROR: Could not open trace file '%s'\n", trace_path);
+		goto end;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	pthread_mutex_lock(&rings_lock);
+	for (struct trace_ring *r = rings; r; r = r->next)
+		trace_write_ring(fp, r, pid, &first);
+	pthread_mutex_unlock(&rings_lock);
+
+	fprintf(fp, "\n]}\n");
+	if (fclose(fp) == 0)
+		retval = true;
+	else
+		fprintf(stderr, "ERROR: Could not write trace file '%s'\n", trace_path);
+
+end:
+	free(trace_path);
+	trace_path = NULL;
+	return retval;
+}
@@ -0,0 +1,53 @@
+/*
+ * trace.h
+ *
+ * Opt-in tracing of the frame pipeline. Begin and end events of every
+ * stage are kept in a ring buffer per thread, and are written as a Chrome
+ * trace JSON file when tracing stops, which can be opened with
+ * chrome://tracing or https://ui.perfetto.dev.
+ *
+ * When tracing was not started, trace_begin() and trace_end()
+ * are just a load and a branch.
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ajuaristi <a@juaristi.eus>
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+#include <stdatomic.h>
+#include "main.h"
+
+/* Names of the pipeline stages */
+#define TRACE_FRAME	"frame"
+#define TRACE_CAPTURE	"capture"
+#define TRACE_SCALE	"scale"
+#define TRACE_DENOISE	"denoise"
+#define TRACE_ENCODE	"jpeg"
+#define TRACE_BASE64	"base64"
+#define TRACE_JSON	"json"
+#define TRACE_UPLOAD	"upload"
+#define TRACE_DECODE	"decode"
+#define TRACE_RENDER	"render"
+
+extern atomic_bool trace_enabled;
+
+void trace_record(const char *name, char phase);
+
+/* 'name' must be a string literal, or otherwise live forever */
+static inline void trace_begin(const char *name)
+{
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+		trace_record(name, 'B');
+}
+
+static inline void trace_end(const char *name)
+{
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+		trace_record(name, 'E');
+}
+
+bool trace_start(const char *path);
+bool trace_stop();
+
+#endif /* TRACE_H_ */
@@ -47,10 +47,13 @@ void *ec_realloc(void *ptr, size_t size)
 {
 	void *mem = NULL;
 
-	if (!ptr)
+	if (!ptr) {
 		mem = ec_malloc(size);
-	else
-		mem = realloc(mem, size);
+	} else {
+		mem = realloc(ptr, size);
+		if (!mem && size)
+			fatal("Out of memory");
+	}
 
 	return mem;
 }
@@ -12,44 +12,139 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <time.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include "uvc.h"
 #include "utils.h"
+#include "metrics.h"
+#include "pool.h"
+#include "trace.h"
+#include "pixfmt.h"
 
 #define NUM_REQUESTED_BUFS	16
 #define NUM_MIN_BUFS		2
+/* Rate at which the test pattern camera delivers frames */
+#define TEST_PATTERN_FPS	30
+
+/*
+ * Accumulated capture statistics. Times are in ns, on CLOCK_MONOTONIC.
+ */
+struct capture_stats {
+	uint64_t start;
+	uint64_t last_frame;
+	unsigned int frames;
+	unsigned int intervals;
+	unsigned int lost;
+	unsigned int errors;
+	double interval_sum;
+	double interval_sum_sq;
+	uint64_t wait_sum;
+	uint64_t age_sum;
+	uint64_t age_max;
+};
 
 struct camera_internal {
 	int fd;
 	bool is_streaming;
+	bool is_test_pattern;
+	unsigned int sequence;
+	bool has_sequence;
+	uint32_t timestamp_flags;
+	/* Stats can be read from some other thread than the one capturing */
+	pthread_mutex_t stats_lock;
+	struct capture_stats stats;
+	/*
+	 * What the camera gives us, and the rows of its first plane.
+	 * Every frame is converted from it to YUYV with pixfmt->to_yuyv().
+	 */
+	const struct pixfmt *pixfmt;
+	const struct pixfmt *preferred;
+	size_t stride;
+	size_t image_size;
+	/* Test pattern frames, when they're drawn in some other format than YUYV */
+	unsigned char *staging;
 	struct v4l2_requestbuffers reqbufs;
 	char **buffers;
 	size_t *buflens;
 };
 
+static uint64_t uvc_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Ask for 'fmt'. Drivers that can't do it give back some other format,
+ * which is just as good if we know how to convert it.
+ */
 static bool uvc_setup_format(struct camera_internal *c,
 		size_t *width, size_t *height,
-		int format)
+		const struct pixfmt *fmt)
 {
-	struct v4l2_format fmt;
+	struct v4l2_format v4l2_fmt;
+	const struct pixfmt *actual;
+	size_t stride;
+
+	memset(&v4l2_fmt, 0, sizeof(v4l2_fmt));
+
+	v4l2_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	v4l2_fmt.fmt.pix.width = (*width);
+	v4l2_fmt.fmt.pix.height = (*height);
+	v4l2_fmt.fmt.pix.pixelformat = fmt->fourcc;
+	v4l2_fmt.fmt.pix.field = V4L2_FIELD_ANY;
+	if (ioctl(c->fd, VIDIOC_S_FMT, &v4l2_fmt) < 0)
+		return false;
 
-	memset(&fmt, 0, sizeof(fmt));
+	actual = pixfmt_find(v4l2_fmt.fmt.pix.pixelformat);
+	if (!actual || v4l2_fmt.fmt.pix.width == 0 || v4l2_fmt.fmt.pix.width % 2 ||
+			v4l2_fmt.fmt.pix.height == 0 || !pixfmt_height_ok(actual, v4l2_fmt.fmt.pix.height))
+		return false;
 
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = (*width);
-	fmt.fmt.pix.height = (*height);
-	fmt.fmt.pix.pixelformat = format;
-	fmt.fmt.pix.field = V4L2_FIELD_ANY;
-	if (ioctl(c->fd, VIDIOC_S_FMT, &fmt) < 0)
+	/* Some drivers leave the stride of planar formats to us */
+	stride = v4l2_fmt.fmt.pix.bytesperline;
+	if (stride == 0)
+		stride = pixfmt_min_stride(actual, v4l2_fmt.fmt.pix.width);
+	if (stride < pixfmt_min_stride(actual, v4l2_fmt.fmt.pix.width))
 		return false;
 
+	c->pixfmt = actual;
+	c->stride = stride;
+	c->image_size = pixfmt_frame_size(actual, stride, v4l2_fmt.fmt.pix.height);
+
 	/* Replace with actual width and height */
-	*width = fmt.fmt.pix.width;
-	*height = fmt.fmt.pix.height;
+	*width = v4l2_fmt.fmt.pix.width;
+	*height = v4l2_fmt.fmt.pix.height;
 
 	return true;
 }
 
+/*
+ * Settle on a format both the camera and we can do: the preferred one if any,
+ * and then every one we know of, cheapest to convert first.
+ */
+static bool uvc_negotiate_format(struct camera_internal *c, size_t *width, size_t *height)
+{
+	const struct pixfmt *fmt;
+
+	if (c->preferred && uvc_setup_format(c, width, height, c->preferred))
+		return true;
+
+	for (unsigned int i = 0; (fmt = pixfmt_get(i)); i++) {
+		if (fmt != c->preferred && uvc_setup_format(c, width, height, fmt))
+			return true;
+	}
+
+	return false;
+}
+
 static void uvc_unmap_buffers(struct camera_internal *c)
 {
 	struct v4l2_requestbuffers *rb = &c->reqbufs;
@@ -106,6 +201,10 @@ static bool uvc_map_buffers(struct camera_internal *c)
 			goto fail;
 		c->buflens[buf_index] = buf.length;
 
+		/* Frames are converted whole, so every buffer has to hold one */
+		if (buf.length < c->image_size)
+			goto fail;
+
 		if (ioctl(c->fd, VIDIOC_QBUF, &buf) < 0)
 			goto fail;
 	}
@@ -150,8 +249,13 @@ struct camera *uvc_open()
 
 	c->frame = NULL;
 	c->internal->is_streaming = false;
+	pthread_mutex_init(&c->internal->stats_lock, NULL);
 
-	c->internal->fd = open(c->dev_path, O_RDWR);
+	/*
+	 * Non-blocking, so that a camera that stops delivering frames
+	 * can't hang us forever. uvc_capture_frame() waits with a timeout instead.
+	 */
+	c->internal->fd = open(c->dev_path, O_RDWR | O_NONBLOCK);
 	if (c->internal->fd == -1)
 		goto abort;
 
@@ -167,6 +271,7 @@ struct camera *uvc_open()
 abort:
 	if (c->internal->fd != -1)
 		close(c->internal->fd);
+	pthread_mutex_destroy(&c->internal->stats_lock);
 	free(c->internal);
 	free(c->dev_path);
 	free(c);
@@ -174,24 +279,176 @@ abort:
 	return NULL;
 }
 
+/*
+ * Open a fake camera that needs no hardware, and just delivers
+ * a moving test pattern at TEST_PATTERN_FPS. Timestamps are taken from
+ * the wall clock. Useful for load testing.
+ * Its fd is a timer that becomes readable when the next frame is due,
+ * so it can be polled just like a real camera.
+ */
+struct camera *uvc_open_test_pattern()
+{
+	char test_dev_path[] = "test-pattern";
+	struct camera *c = ec_malloc(sizeof(struct camera));
+
+	c->dev_path = ec_malloc_fill(sizeof(test_dev_path), test_dev_path);
+	c->internal = ec_malloc(sizeof(struct camera_internal));
+
+	c->frame = NULL;
+	c->internal->fd = -1;
+	c->internal->is_streaming = false;
+	c->internal->is_test_pattern = true;
+	pthread_mutex_init(&c->internal->stats_lock, NULL);
+
+	return c;
+}
+
+static inline unsigned char uvc_clamp_byte(int v)
+{
+	return (v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+/*
+ * Store a pair of pixels, as YUYV in 'yuyv', at (x, y) of a frame in 'fmt'.
+ * This one switches on the format for every pair, but it's only for the test pattern,
+ * so that it can stand in for cameras of any format.
+ */
+static void uvc_put_test_pixels(const struct pixfmt *fmt, unsigned char *buf,
+		size_t stride, size_t height, size_t x, size_t y, const unsigned char yuyv[4])
+{
+	unsigned char *p = buf + y * stride, *u, *v;
+	int cb = yuyv[1] - 128, cr = yuyv[3] - 128;
+
+	switch (fmt->fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+		memcpy(p + x * 2, yuyv, 4);
+		break;
+	case V4L2_PIX_FMT_UYVY:
+		p += x * 2;
+		p[0] = yuyv[1];
+		p[1] = yuyv[0];
+		p[2] = yuyv[3];
+		p[3] = yuyv[2];
+		break;
+	case V4L2_PIX_FMT_NV12:
+		p[x] = yuyv[0];
+		p[x + 1] = yuyv[2];
+		u = buf + stride * height + (y / 2) * stride + x;
+		u[0] = yuyv[1];
+		u[1] = yuyv[3];
+		break;
+	case V4L2_PIX_FMT_YUV420:
+		p[x] = yuyv[0];
+		p[x + 1] = yuyv[2];
+		u = buf + stride * height + (y / 2) * (stride / 2) + x / 2;
+		v = u + (stride / 2) * (height / 2);
+		*u = yuyv[1];
+		*v = yuyv[3];
+		break;
+	case V4L2_PIX_FMT_GREY:
+		p[x] = yuyv[0];
+		p[x + 1] = yuyv[2];
+		break;
+	case V4L2_PIX_FMT_RGB24:
+		p += x * 3;
+		for (int i = 0; i < 2; i++, p += 3) {
+			int l = yuyv[i * 2];
+
+			p[0] = uvc_clamp_byte(l + (91881 * cr + 32768) / 65536);
+			p[1] = uvc_clamp_byte(l - (22554 * cb + 46802 * cr + 32768) / 65536);
+			p[2] = uvc_clamp_byte(l + (116130 * cb + 32768) / 65536);
+		}
+		break;
+	}
+}
+
+static void uvc_fill_test_pattern(struct camera_internal *c, struct frame *f, unsigned int n)
+{
+	/* The box has to fit in narrow frames too, where a quarter of the height would not */
+	size_t box = (f->width < f->height ? f->width : f->height) / 4,
+		box_x = (n * 4) % (f->width - box + 1), box_y = f->height / 2 - box / 2;
+	unsigned char *buf = (c->staging ? c->staging : f->frame_data);
+	unsigned char yuyv[4];
+
+	for (size_t y = 0; y < f->height; y++) {
+		bool in_box_row = (y >= box_y && y < box_y + box);
+
+		for (size_t x = 0; x < f->width; x += 2) {
+			bool in_box = (in_box_row && x >= box_x && x < box_x + box);
+
+			yuyv[0] = (in_box ? 235 : (unsigned char) (x + y + n));
+			yuyv[1] = (unsigned char) (x * 255 / f->width);
+			yuyv[2] = (in_box ? 235 : (unsigned char) (x + 1 + y + n));
+			yuyv[3] = (unsigned char) (y * 255 / f->height);
+			uvc_put_test_pixels(c->pixfmt, buf, c->stride, f->height, x, y, yuyv);
+		}
+	}
+
+	/* Converted just like frames from a real camera would */
+	if (c->staging)
+		c->pixfmt->to_yuyv(c->staging, c->stride, f->width, f->height, f->frame_data);
+
+	f->frame_bytes_used = f->width * f->height * 2;
+}
+
+static bool uvc_start_test_pattern(struct camera_internal *c)
+{
+	struct itimerspec its;
+
+	c->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (c->fd == -1)
+		return false;
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 1000000000L / TEST_PATTERN_FPS;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(c->fd, 0, &its, NULL) == -1)
+		return false;
+
+	c->is_streaming = true;
+	return true;
+}
+
+static bool uvc_capture_test_pattern(struct camera *c)
+{
+	uint64_t expirations;
+
+	/* Frames we were too slow to take are just lost, like with a real camera */
+	if (read(c->internal->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return false;
+	if (expirations > 1) {
+		pthread_mutex_lock(&c->internal->stats_lock);
+		c->internal->stats.lost += expirations - 1;
+		pthread_mutex_unlock(&c->internal->stats_lock);
+		metrics_add(METRIC_FRAMES_LOST, expirations - 1);
+	}
+
+	c->internal->sequence += expirations;
+	uvc_fill_test_pattern(c->internal, c->frame, c->internal->sequence);
+	gettimeofday(&c->frame->capture_time, NULL);
+
+	return true;
+}
+
 struct frame *uvc_alloc_frame(size_t width, size_t height, int format)
 {
 	struct frame *frame = ec_malloc(sizeof(struct frame));
+	const struct pixfmt *fmt = pixfmt_find(format);
 
 	/*
-	 * We only allow V4L2_PIX_FMT_YUYV for now.
-	 * It's easy to extend this API in the future, but
-	 * keep in mind the calculations that follow are all performed
-	 * assuming YUYV format is being used.
+	 * Frames are always V4L2_PIX_FMT_YUYV, whatever the camera gives us:
+	 * everything that comes after capture assumes it.
+	 * uvc_capture_frame() converts them from other formats.
 	 */
-	if (format != V4L2_PIX_FMT_YUYV)
+	if (format != V4L2_PIX_FMT_YUYV || !fmt)
 		goto fail;
 
-	frame->frame_size = width * height * 2;
+	frame->frame_size = pixfmt_frame_size(fmt, pixfmt_min_stride(fmt, width), height);
 	if (frame->frame_size == 0)
 		goto fail;
 
-	frame->frame_data = ec_malloc(frame->frame_size);
+	/* No need to zero it: every capture overwrites what it reports as used */
+	frame->frame_data = pool_alloc(frame->frame_size);
 	frame->frame_bytes_used = 0;
 	frame->width = width;
 	frame->height = height;
@@ -208,20 +465,65 @@ void uvc_free_frame(struct frame *f)
 {
 	if (f) {
 		if (f->frame_data)
-			free(f->frame_data);
+			pool_unref(f->frame_data);
 		free(f);
 	}
 }
 
+/*
+ * Capture in this format if the camera can, instead of the cheapest one to convert.
+ * Call before uvc_init(). The test pattern is drawn in it too.
+ */
+void uvc_set_source_format(struct camera *c, uint32_t fourcc)
+{
+	if (c && c->internal)
+		c->internal->preferred = pixfmt_find(fourcc);
+}
+
+static bool uvc_init_test_pattern(struct camera *c)
+{
+	struct camera_internal *ci = c->internal;
+	struct frame *f = c->frame;
+
+	ci->pixfmt = (ci->preferred ? ci->preferred : pixfmt_find(V4L2_PIX_FMT_YUYV));
+	if (f->width < 8 || f->height < 8 || f->width % 2 || !pixfmt_height_ok(ci->pixfmt, f->height))
+		return false;
+
+	ci->stride = pixfmt_min_stride(ci->pixfmt, f->width);
+	ci->image_size = pixfmt_frame_size(ci->pixfmt, ci->stride, f->height);
+
+	/* YUYV is drawn right into the frame */
+	free(ci->staging);
+	ci->staging = (ci->pixfmt->fourcc != V4L2_PIX_FMT_YUYV ? ec_malloc(ci->image_size) : NULL);
+
+	return (ci->is_streaming || uvc_start_test_pattern(ci));
+}
+
 bool uvc_init(struct camera *c)
 {
+	struct frame *f;
+
 	if (!c || !c->internal || !c->frame || c->frame->format != V4L2_PIX_FMT_YUYV)
 		goto fail;
 
-	/* Set up desired frame format */
-	if (!uvc_setup_format(c->internal, &c->frame->width, &c->frame->height, c->frame->format))
+	f = c->frame;
+	c->internal->stats.start = uvc_now(CLOCK_MONOTONIC);
+
+	if (c->internal->is_test_pattern)
+		return uvc_init_test_pattern(c);
+
+	/* Set up the frame format, and with it, the converter every frame will go through */
+	if (!uvc_negotiate_format(c->internal, &f->width, &f->height))
 		goto fail;
 
+	/* The driver may have settled on a bigger size than we asked for */
+	if (f->width * f->height * 2 > f->frame_size) {
+		pool_unref(f->frame_data);
+		f->frame_size = f->width * f->height * 2;
+		f->frame_data = pool_alloc(f->frame_size);
+		f->frame_bytes_used = 0;
+	}
+
 	/* Map frame buffers into userspace */
 	if (!uvc_map_buffers(c->internal))
 		goto fail;
@@ -242,17 +544,111 @@ fail:
 	return false;
 }
 
+/*
+ * Look at what the driver tells us about the buffer we've just dequeued:
+ * whether frames were dropped before it, and when it was really captured.
+ * Returns the time it was captured in ns, on CLOCK_MONOTONIC, and fills in
+ * 'capture_time' with the wall clock time (drivers timestamp frames
+ * with the monotonic clock, which is no good for the documents we store).
+ */
+static uint64_t uvc_check_buffer(struct camera_internal *c, const struct v4l2_buffer *buf,
+		struct timeval *capture_time)
+{
+	uint64_t now = uvc_now(CLOCK_MONOTONIC), ts, wall;
+	uint32_t gap;
+
+	pthread_mutex_lock(&c->stats_lock);
+
+	/* If the sequence goes backwards, the driver just restarted it */
+	if (c->has_sequence && buf->sequence > c->sequence + 1) {
+		gap = buf->sequence - c->sequence - 1;
+		c->stats.lost += gap;
+		metrics_add(METRIC_FRAMES_LOST, gap);
+	}
+	c->sequence = buf->sequence;
+	c->has_sequence = true;
+
+	if (buf->flags & V4L2_BUF_FLAG_ERROR)
+		c->stats.errors++;
+
+	c->timestamp_flags = buf->flags & (V4L2_BUF_FLAG_TIMESTAMP_MASK | V4L2_BUF_FLAG_TSTAMP_SRC_MASK);
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		/* No idea what clock that is. Say it was captured right now */
+		pthread_mutex_unlock(&c->stats_lock);
+		gettimeofday(capture_time, NULL);
+		return now;
+	}
+
+	ts = (uint64_t) buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL;
+	if (ts > now)
+		ts = now;
+
+	wall = uvc_now(CLOCK_REALTIME) - (now - ts);
+	capture_time->tv_sec = wall / 1000000000ULL;
+	capture_time->tv_usec = (wall % 1000000000ULL) / 1000;
+
+	c->stats.age_sum += now - ts;
+	if (now - ts > c->stats.age_max)
+		c->stats.age_max = now - ts;
+	pthread_mutex_unlock(&c->stats_lock);
+	metrics_observe_ns(METRIC_TIME_FRAME_AGE, now - ts);
+
+	return ts;
+}
+
+static void uvc_account_frame(struct camera_internal *c, uint64_t captured, uint64_t wait)
+{
+	struct capture_stats *st = &c->stats;
+	double interval;
+
+	pthread_mutex_lock(&c->stats_lock);
+	if (st->last_frame && captured > st->last_frame) {
+		interval = (captured - st->last_frame) / 1e6;
+		st->interval_sum += interval;
+		st->interval_sum_sq += interval * interval;
+		st->intervals++;
+		metrics_observe_ns(METRIC_TIME_FRAME_INTERVAL, captured - st->last_frame);
+	}
+	st->last_frame = captured;
+
+	st->frames++;
+	st->wait_sum += wait;
+	pthread_mutex_unlock(&c->stats_lock);
+}
+
 bool uvc_capture_frame(struct camera *c)
 {
-	size_t size = 0;
 	struct v4l2_buffer buf;
 	struct frame *f = c->frame;
+	struct pollfd pfd;
+	int ready;
+	uint64_t start = metrics_now(), waited, captured;
 
-	/*
-	 * Same as in uvc_alloc_frame(): we only support V4L2_PIX_FMT_YUYV for now.
-	 */
-	if (!c || !c->internal || !f || f->frame_size <= 0 || f->format != V4L2_PIX_FMT_YUYV)
+	/* Same as in uvc_alloc_frame(): frames are always V4L2_PIX_FMT_YUYV */
+	if (!c || !c->internal || !c->internal->pixfmt || !f ||
+			f->frame_size < f->width * f->height * 2 || f->format != V4L2_PIX_FMT_YUYV)
+		goto fail;
+
+	/* Whoever still holds the previous frame keeps it */
+	frame_make_writable(f);
+	trace_begin(TRACE_CAPTURE);
+
+	/* Wait for a frame, but not forever */
+	pfd.fd = c->internal->fd;
+	pfd.events = POLLIN;
+	while ((ready = poll(&pfd, 1, UVC_CAPTURE_TIMEOUT_MS)) == -1 && errno == EINTR);
+	if (ready != 1) {
+		fprintf(stderr, "ERROR: No frames from the camera in %d ms\n", UVC_CAPTURE_TIMEOUT_MS);
 		goto fail;
+	}
+	waited = metrics_now() - start;
+
+	if (c->internal->is_test_pattern) {
+		if (!uvc_capture_test_pattern(c))
+			goto fail;
+		captured = uvc_now(CLOCK_MONOTONIC);
+		goto end;
+	}
 
 	memset(&buf, 0, sizeof(buf));
 
@@ -261,36 +657,121 @@ bool uvc_capture_frame(struct camera *c)
 	if (ioctl(c->internal->fd, VIDIOC_DQBUF, &buf) < 0)
 		goto fail;
 
-	/* Copy time when first byte was captured */
-	memcpy(&f->capture_time, &buf.timestamp, sizeof(struct timeval));
-
+	/* Time when the frame was captured, and whether we missed any before it */
+	captured = uvc_check_buffer(c->internal, &buf, &f->capture_time);
 
-	/* Copy frame bytes */
-	size = (buf.bytesused < f->frame_size ?
-			buf.bytesused :
-			f->frame_size);
-	memcpy(f->frame_data, c->internal->buffers[buf.index], size);
-	f->frame_bytes_used = size;
+	/*
+	 * Convert it out of the driver's buffer (for YUYV, that's just a copy).
+	 * Short frames still fill a whole one, with whatever the buffer had from before,
+	 * so they're counted as broken.
+	 */
+	if (buf.bytesused < c->internal->image_size) {
+		pthread_mutex_lock(&c->internal->stats_lock);
+		c->internal->stats.errors++;
+		pthread_mutex_unlock(&c->internal->stats_lock);
+	}
+	c->internal->pixfmt->to_yuyv((const unsigned char *) c->internal->buffers[buf.index],
+			c->internal->stride, f->width, f->height, f->frame_data);
+	f->frame_bytes_used = f->width * f->height * 2;
 
 	if (ioctl(c->internal->fd, VIDIOC_QBUF, &buf) < 0)
 		goto fail;
 
+end:
+	uvc_account_frame(c->internal, captured, waited);
+	trace_end(TRACE_CAPTURE);
+	metrics_inc(METRIC_FRAMES_CAPTURED);
+	metrics_observe_since(METRIC_TIME_CAPTURE, start);
 	return true;
 
 fail:
+	trace_end(TRACE_CAPTURE);
 	return false;
 }
 
+/*
+ * The fd becomes readable when a frame can be captured without blocking.
+ * Only valid after uvc_init().
+ */
+int uvc_get_fd(struct camera *c)
+{
+	return (c && c->internal ? c->internal->fd : -1);
+}
+
+static const char *uvc_timestamp_source(struct camera_internal *c)
+{
+	if (c->is_test_pattern)
+		return "test pattern";
+
+	switch (c->timestamp_flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) {
+	case V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC:
+		return ((c->timestamp_flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE ?
+				"monotonic, start of exposure" :
+				"monotonic, end of frame");
+	case V4L2_BUF_FLAG_TIMESTAMP_COPY:
+		return "copied";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Get the capture statistics since the previous call, and start over.
+ */
+void uvc_get_stats(struct camera *c, struct uvc_stats *stats)
+{
+	struct capture_stats *st;
+	uint64_t now = uvc_now(CLOCK_MONOTONIC), last_frame;
+	double mean;
+
+	if (!c || !c->internal || !stats)
+		return;
+
+	st = &c->internal->stats;
+	memset(stats, 0, sizeof(struct uvc_stats));
+	pthread_mutex_lock(&c->internal->stats_lock);
+
+	stats->secs = (st->start ? (now - st->start) / 1e9 : 0);
+	stats->frames = st->frames;
+	stats->lost = st->lost;
+	stats->errors = st->errors;
+	stats->fps = (stats->secs > 0 ? st->frames / stats->secs : 0);
+	if (st->intervals) {
+		mean = st->interval_sum / st->intervals;
+		stats->interval = mean;
+		stats->jitter = st->interval_sum_sq / st->intervals - mean * mean;
+		stats->jitter = (stats->jitter > 0 ? sqrt(stats->jitter) : 0);
+	}
+	if (st->frames) {
+		stats->wait = st->wait_sum / 1e6 / st->frames;
+		stats->age_avg = st->age_sum / 1e6 / st->frames;
+	}
+	stats->age_max = st->age_max / 1e6;
+	stats->timestamp_source = uvc_timestamp_source(c->internal);
+	stats->format = (c->internal->pixfmt ? c->internal->pixfmt->name : "none");
+
+	/* Keep the last frame, so that the first interval of the next round is measured too */
+	last_frame = st->last_frame;
+	memset(st, 0, sizeof(struct capture_stats));
+	st->start = now;
+	st->last_frame = last_frame;
+	pthread_mutex_unlock(&c->internal->stats_lock);
+}
+
 void uvc_close(struct camera *c)
 {
 	if (c) {
 		if (c->internal) {
-			uvc_stop_streaming(c->internal);
+			if (!c->internal->is_test_pattern)
+				uvc_stop_streaming(c->internal);
 
 			if (c->internal->buffers)
 				uvc_unmap_buffers(c->internal);
+			free(c->internal->staging);
 
-			close(c->internal->fd);
+			if (c->internal->fd != -1)
+				close(c->internal->fd);
+			pthread_mutex_destroy(&c->internal->stats_lock);
 			free(c->internal);
 		}
 		if (c->dev_path)
@@ -13,6 +13,34 @@
 #include "frame.h"
 #include "utils.h"
 
+/* Give up on the camera if it doesn't deliver a frame in this time */
+#define UVC_CAPTURE_TIMEOUT_MS	5000
+
+/*
+ * Capture statistics, over the interval since the last call to uvc_get_stats(),
+ * which can be called from another thread than the one capturing.
+ * Times are in milliseconds.
+ */
+struct uvc_stats {
+	double secs;
+	unsigned int frames;
+	/* Frames the driver dropped (gaps in sequence numbers), and frames flagged as broken */
+	unsigned int lost;
+	unsigned int errors;
+	double fps;
+	/* Time between frames, as timestamped by the camera, and its standard deviation */
+	double interval;
+	double jitter;
+	/* Time blocked waiting for a frame, per frame */
+	double wait;
+	/* How long frames sat in the driver before we took them */
+	double age_avg;
+	double age_max;
+	const char *timestamp_source;
+	/* Pixel format the camera delivers, before converting it to YUYV */
+	const char *format;
+};
+
 struct camera_internal;
 struct camera {
 	char *dev_path;
@@ -21,13 +49,17 @@ struct camera {
 };
 
 struct camera *uvc_open();
+struct camera *uvc_open_test_pattern();
 
 struct frame *uvc_alloc_frame(size_t width, size_t height, int format);
 void uvc_free_frame(struct frame *);
 
+void uvc_set_source_format(struct camera *, uint32_t fourcc);
 bool uvc_init(struct camera *);
 
 bool uvc_capture_frame(struct camera *);
+int uvc_get_fd(struct camera *);
+void uvc_get_stats(struct camera *, struct uvc_stats *);
 
 void uvc_close(struct camera *);
 
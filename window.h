@@ -13,11 +13,21 @@
 
 struct window;
 
+enum window_key {
+	WINDOW_KEY_NONE,
+	WINDOW_KEY_LEFT,
+	WINDOW_KEY_RIGHT,
+	WINDOW_KEY_UP,
+	WINDOW_KEY_DOWN
+};
+
 struct window *start_window(size_t width, size_t height, enum frame_format format);
 void destroy_window(struct window *);
 
 bool window_render_frame(struct window *, struct frame *);
+void window_invalidate(struct window *);
 
 bool window_is_closed();
+enum window_key window_poll_key();
 
 #endif /* WINDOW_H_ */